@@ -1,17 +1,113 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define FILENAME "users.txt"
-#define MAX_USERS 100
-#define MAX_HISTORY 50
+#define USER_INDEX_MIN_CAPACITY 1024
+#define USER_CHUNK_SIZE 1024
+#define USER_LINE_MAX 320
+/* Fixed-width row: username, password, 4 stats, admin flag, newline.
+ * Every row has the same length, so a record can be rewritten in place. */
+#define USER_ROW_FORMAT "%-49s %-99s %11d %11d %11d %11d %d %10u %11lld\n"
+#define USER_ROW_WIDTH (49 + 1 + 99 + 1 + 4 * 12 + 2 + 11 + 12)
+#define JOURNAL_FILENAME "users.journal"
+#define JOURNAL_GROUP_COMMIT 32        // records appended between fsyncs
+#define JOURNAL_GROUP_COMMIT_SECS 1    // ...or at least once a second
+#define JOURNAL_COMPACT_BYTES (4L * 1024 * 1024) // journal size that triggers a checkpoint
+#define JOURNAL_OLD_FILENAME "users.journal.old" // journal a running checkpoint replaces
+#define CHECKPOINT_INTERVAL_SECS 60 // default for --checkpoint-interval
+#define BINARY_FILENAME "users.bin"
+#define BINARY_MAGIC "RLTUSERS"
+#define BINARY_VERSION 1
+#define USER_FLAG_ADMIN 0x1
+#define USER_FLAG_DELETED 0x2 // tombstone left by a bulk delete in the binary file
+#define BINARY_MAX_RECORDS (1u << 24) // address space reserved up front so the map never moves
+#define HISTORY_FILENAME "history.dat"
+#define HISTORY_RING_SIZE 1024  // most recent records kept in memory
+#define HISTORY_PAGE_SIZE 10
+#define HISTORY_COLUMNS_MAGIC "RLTHCOLS"
+#define HISTORY_COLUMNS_VERSION 1
+#define HISTORY_CHUNK_ROWS 65536 // rows per chunk of a columnar export
+#define USER_PAGE_SIZE 20
+#define LEADERBOARD_FILENAME "leaderboard.dat"
+#define FAIRNESS_FILENAME "fairness.log" // commitments and revealed seeds of --rng fair
+#define LEADERBOARD_MAGIC "RLTBOARD"
+#define LEADERBOARD_VERSION 1
+#define LEADERBOARD_MIN_GAMES 20 // games needed to appear on the win rate board
+#define LEADERBOARD_TOP 10
+#define SKIPLIST_MAX_LEVEL 32
+#define MAX_TABLES 16
+#define CLIENT_LINE_MAX 1024
+#define DEFAULT_ROUND_SECONDS 15
+#define SERVER_MAX_EVENTS 256
+#define LOGIN_WORKERS 2        // threads running password KDFs for the server lobby
+#define LOGIN_QUEUE_MAX 64     // logins waiting on those threads before more are refused
+#define LOGIN_FREE_FAILURES 3  // failed logins in a row before retries are delayed
+#define LOGIN_MAX_DELAY 60     // cap in seconds on the doubling delay after that
 #define STARTING_BALANCE 1000
-#define PASSWORD_LENGTH 20
+#define PASSWORD_LENGTH 100 // fits a "$s1$..." scrypt hash, see hashPassword
+#define PASSWORD_SALT_BYTES 16
+#define PASSWORD_HASH_BYTES 32
+#define SCRYPT_LOG_N 14 // N = 16384 with r = 8: 16 MB and tens of milliseconds per hash
+#define SCRYPT_R 8
+#define SCRYPT_P 1
+#define SCRYPT_MAX_LOG_N (SCRYPT_LOG_N + 1) // stored hashes may cost one doubling more, no more
+#define SHA256_DIGEST_SIZE 32
+#define CREDENTIAL_CACHE_SETS 256
+#define CREDENTIAL_CACHE_WAYS 4
+#define CREDENTIAL_CACHE_TTL 900 // seconds a verified password is remembered
 #define INACTIVITY_TIMEOUT 300 // 5 minutes in seconds
+#define SESSION_TOKEN_BYTES 16
+#define SESSION_WHEEL_SLOTS 512 // one-second slots, a power of two above INACTIVITY_TIMEOUT
+#define SPIN_RING_SIZE 4096     // pregenerated pockets per spin source, a power of two
+#define SPIN_FILL_BLOCK 256     // pockets generated between publishes to the ring
+#define FAIR_EPOCH_SPINS 10000  // spins per committed server seed, more than SPIN_RING_SIZE
+#define TERMINAL_BUFFER_SIZE (64 * 1024) // holds a whole screen, written when input is awaited
+#define TERMINAL_PENDING_MAX (1024 * 1024) // --async-output backlog before printing waits
+#define TERMINAL_INPUT_SIZE 4096 // bytes of stdin read ahead per read(2)
+#define POCKET_COUNT 37
+#define MIN_BET 10
+#define MAX_BET 1000
+#define MAX_MIX_BETS 32
+#define MAX_SIM_THREADS 256
+#define ANALYTICS_TOP_PLAYERS 10 // players listed in the analytics report
+#define SKETCH_BINS 2048 // quantile sketch buckets, enough for any 64-bit value
+/* Every (bet type, selection) pair maps to one slot: 37 single numbers,
+ * then even/odd, red/black, low/high, three dozens, three columns,
+ * 60 splits, 12 streets and 22 corners. */
+#define BET_SLOT_COUNT 143
+#define SPLIT_COUNT 60
+#define MAX_SLIP_BETS 10
+#define RED_POCKET_MASK 0x154AAD52AAULL // bit n set when pocket n is red
+#define METRIC_SUB_BUCKET_BITS 4          // 16 sub-buckets per power of two, about 6% resolution
+#define METRIC_BUCKETS (64 << METRIC_SUB_BUCKET_BITS)
 
 /* ====== COLOR MACROS ====== */
 #define RED "\x1B[31m"
@@ -33,8 +129,94 @@ typedef struct {
     int games_won;
     int highest_win;
     bool isAdmin;
+    int64_t last_active; // epoch seconds of the last login or game, 0 if never recorded
 } User;
 
+typedef enum {
+    BET_SINGLE = 1,
+    BET_EVEN_ODD,
+    BET_RED_BLACK,
+    BET_HIGH_LOW,
+    BET_DOZEN,
+    BET_COLUMN,
+    BET_SPLIT,
+    BET_STREET,
+    BET_CORNER,
+    BET_TYPE_COUNT = BET_CORNER
+} BetType;
+
+typedef struct {
+    int type;       // BetType
+    int selection;  // number for BET_SINGLE, split index for BET_SPLIT, lowest number for
+                    // BET_CORNER, otherwise the 1-based menu choice
+    int amount;
+} Bet;
+
+/* xoshiro256** state. Each simulation thread owns one, started 2^128 draws
+ * apart with rngJump so the streams never overlap. */
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+typedef struct SpinSource SpinSource;
+
+/* A way to draw pockets, chosen with --rng. Engines with `fill` cost too
+ * much per draw to run on the spin path, so the spin producer thread
+ * generates their pockets ahead of time in blocks. */
+typedef struct {
+    const char *name;
+    bool seedable;      // --seed reproduces the pockets
+    void (*fill)(SpinSource *src, uint64_t nonce, uint8_t *pockets, int count); // NULL: drawn inline
+    void (*close)(SpinSource *src);
+} SpinEngine;
+
+/* Where one thread's spins come from. A pregenerating engine's pockets wait
+ * in a single-producer single-consumer ring: the spin producer thread only
+ * advances `head` and the spinning thread only advances `tail`, so neither
+ * side takes a lock. Spin n of a source has nonce n. */
+struct SpinSource {
+    const SpinEngine *engine;
+    char label[16];     // names the stream in the fairness log
+    Rng rng;            // state of inline draws
+    uint64_t lastNonce; // nonce of the latest spin
+    uint8_t ring[SPIN_RING_SIZE];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    // --rng fair: the ring never spans more than two epochs.
+    uint8_t seed[2][32];
+    uint8_t commit[2][SHA256_DIGEST_SIZE];
+    uint64_t revealed;  // epochs whose seed has been published
+    SpinSource *nextSource;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // a ring fell to half full, or stopping
+    pthread_cond_t idle;    // `current` is no longer being filled
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    bool wakeRequested;
+    SpinSource *sources;
+    SpinSource *current;    // being filled outside the lock
+    FILE *log;              // FAIRNESS_FILENAME
+} SpinProducer;
+
+/* Structure-of-arrays batch of bets settled against a single spin. user[i]
+ * indexes the User array handed to settleBatch; payout[i] and delta[i] are
+ * filled in by the settlement kernel. */
+typedef struct {
+    uint8_t *type;
+    uint8_t *selection;
+    int32_t *slot;
+    int32_t *amount;
+    int32_t *user;
+    int32_t *payout;  // winnings, 0 when the bet lost
+    int32_t *delta;   // net balance change: payout plus returned stake, minus the stake
+    int count;
+    int capacity;
+} BetBatch;
+
 typedef struct {
     char username[50];
     char game_type[30];
@@ -42,35 +224,626 @@ typedef struct {
     int result;
     int payout;
     char timestamp[20];
+    int64_t epoch;
+    uint8_t bet_type;
+    uint8_t selection;
+    char reserved[6];
 } GameHistory;
 
+_Static_assert(sizeof(GameHistory) == 128, "GameHistory is stored as a 128-byte record");
+
+/* Quantile sketch, accurate to 1% of the value: bucket k counts the values
+ * whose magnitude lies in (gamma^(k-1), gamma^k]. */
+typedef struct {
+    int64_t count;
+    int64_t zeros;
+    int64_t positive[SKETCH_BINS];
+    int64_t negative[SKETCH_BINS];
+} QuantileSketch;
+
+// Single-pass figures over a run of bets, see HISTORY ANALYTICS.
+typedef struct {
+    int64_t bets;
+    int64_t wins;
+    int64_t wagered;
+    int64_t returned; // stakes back plus winnings
+    double mean;      // Welford: mean net result per bet
+    double m2;        // Welford: sum of squared deviations from the mean
+    int64_t net;      // running total of net results
+    int64_t peak;     // highest running total, starting from 0
+    int64_t trough;   // lowest running total, starting from 0
+    int64_t drawdown; // largest fall from a peak
+} AnalyticsTotals;
+
+// Runs of wins or losses; the bet count is in the matching totals.
+typedef struct {
+    bool firstWin;
+    bool lastWin;
+    int64_t leading;  // length of the run the range starts with
+    int64_t trailing; // length of the run the range ends with
+    int64_t longestWin;
+    int64_t longestLoss;
+} AnalyticsStreaks;
+
+typedef struct {
+    char username[50];
+    AnalyticsTotals totals;
+    AnalyticsStreaks streaks;
+} PlayerAnalytics;
+
+/* Columnar history export: a header, then chunks of up to
+ * HISTORY_CHUNK_ROWS rows ended by a chunk of zero rows. Each chunk holds
+ * the dictionary entries it introduces, then one block per column:
+ *   HISTORY_COLUMN_USER       username dictionary ids, varints
+ *   HISTORY_COLUMN_GAME       game type dictionary ids, varints
+ *   HISTORY_COLUMN_EPOCH      zigzag varint deltas from the previous row (0 for the first)
+ *   HISTORY_COLUMN_AMOUNT     zigzag varints
+ *   HISTORY_COLUMN_PAYOUT     zigzag varints
+ *   HISTORY_COLUMN_POCKET     6 bits per row, least significant bits first
+ * A game type entry is the label together with its bet type and selection. */
+typedef enum {
+    HISTORY_COLUMN_NAMES,      // new username entries: length byte, then the bytes
+    HISTORY_COLUMN_GAME_TYPES, // new game type entries: bet type, selection, length, label
+    HISTORY_COLUMN_USER,
+    HISTORY_COLUMN_GAME,
+    HISTORY_COLUMN_EPOCH,
+    HISTORY_COLUMN_AMOUNT,
+    HISTORY_COLUMN_PAYOUT,
+    HISTORY_COLUMN_POCKET,
+    HISTORY_COLUMN_COUNT
+} HistoryColumn;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunkRows;
+    char reserved[16];
+} HistoryColumnsHeader;
+
+typedef struct {
+    uint32_t rows;
+    uint32_t newNames;
+    uint32_t newGameTypes;
+    uint32_t bytes[HISTORY_COLUMN_COUNT];
+} HistoryChunkHeader;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} ColumnBuffer;
+
+// Fixed-size, zero-padded entries numbered in insertion order.
+typedef struct {
+    uint8_t *entries;
+    size_t entrySize;
+    int count;
+    int capacity;
+    int *slots;       // open addressing: entry id + 1, 0 when free
+    int slotCapacity;
+} ColumnDictionary;
+
+typedef struct {
+    char label[30];
+    uint8_t betType;
+    uint8_t selection;
+} HistoryGameType;
+
+typedef struct {
+    FILE *out;
+    char tmpPath[4096];
+    const char *path;
+    ColumnDictionary names;     // of char[50]
+    ColumnDictionary gameTypes; // of HistoryGameType
+    int namesWritten;           // entries already in earlier chunks
+    int gameTypesWritten;
+    ColumnBuffer columns[HISTORY_COLUMN_COUNT];
+    uint64_t bits;              // pockets not yet flushed to their column
+    int bitCount;
+    uint32_t rows;              // in the current chunk
+    int64_t lastEpoch;
+    long long totalRows;
+    bool failed;
+} HistoryColumnsWriter;
+
+typedef struct {
+    FILE *in;
+    ColumnDictionary names;
+    ColumnDictionary gameTypes;
+    uint8_t *chunk;
+    size_t chunkCap;
+    GameHistory *rows;
+    time_t stampMinute;         // minute whose "YYYY-MM-DD HH:MM:" prefix is cached
+    char stampPrefix[20];
+    bool failed;
+} HistoryColumnsReader;
+
+/* Per-user list of history record numbers in append (and so time) order,
+ * with their timestamps alongside for binary search. */
+typedef struct {
+    char username[50];
+    long *records;
+    int64_t *epochs;
+    int count;
+    int capacity;
+} HistoryUserIndex;
+
+typedef struct {
+    int fd;
+    long recordCount;
+    GameHistory ring[HISTORY_RING_SIZE]; // record n lives in ring[n % HISTORY_RING_SIZE] while recent
+    HistoryUserIndex **index;            // open-addressing hash by username
+    int indexCapacity;
+    int userCount;
+    pthread_mutex_t lock;
+} HistoryStore;
+
+/* Binary user file: a 64-byte header followed by 256-byte records, so a
+ * record's position is computed from its index and updated in place. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t count;
+    uint32_t capacity;
+    char reserved[40];
+} UserFileHeader;
+
+typedef struct {
+    int32_t balance;
+    int32_t games_played;
+    int32_t games_won;
+    int32_t highest_win;
+    uint32_t flags;
+    char username[50];
+    char password[PASSWORD_LENGTH];
+    uint32_t version;   // bumped on every update, see userStoreCommit
+    int64_t last_active;
+    char reserved[72];
+} UserFileRecord;
+
+_Static_assert(sizeof(UserFileHeader) == 64, "UserFileHeader must be 64 bytes");
+_Static_assert(sizeof(UserFileRecord) == 256, "UserFileRecord must be 256 bytes");
+
+typedef enum {
+    BOARD_RICHEST,
+    BOARD_BIGGEST_WIN,
+    BOARD_WIN_RATE,     // parts per million, only for users with LEADERBOARD_MIN_GAMES games
+    BOARD_COUNT
+} LeaderboardKind;
+
+typedef struct {
+    User user;
+    int id;             // position in the store, see userStoreAt
+    long offset;        // row offset in FILENAME (record index in binary mode), -1 if not written yet
+    uint32_t version;   // version of the row `user` was read from or last written as
+    bool deleted;       // row was removed by a bulk delete; lookups skip the record
+    bool online;        // logged in to the table server, accessed atomically
+    struct Session *session; // live session for the user, guarded by sessions.lock
+    uint8_t boardRanked; // bit per leaderboard the user is on, guarded by leaderboards.lock
+    int64_t boardScore[BOARD_COUNT]; // score each of those leaderboards holds the user under
+    uint8_t loginFailures; // failed server logins in a row, lobby thread only
+    time_t loginRetryAt;   // no server login before this, lobby thread only
+} UserRecord;
+
+typedef struct {
+    UserRecord **chunks; // records live in fixed-size chunks so pointers stay valid
+    int chunkCount;
+    int count;
+    int *index;          // open-addressing hash of record ids, -1 marks an empty slot
+    int indexCapacity;   // always a power of two
+    FILE *file;
+    long textEnd;        // bytes of FILENAME loaded so far; rows past it were added by other processes
+    FILE **retired;      // files replaced by another process's snapshot, closed at exit
+    int retiredCount;
+    pthread_rwlock_t indexLock; // guards chunks and index: appends may grow them under readers
+    bool loaded;
+    bool needsRewrite;   // file holds legacy variable-width rows
+    bool journalMode;    // append changes to JOURNAL_FILENAME instead of writing rows in place
+    int journalFd;
+    int journalGuardFd;  // outside journal mode: shared lock on JOURNAL_FILENAME, see userStoreOpen
+    long journalBytes;
+    int journalPending;  // appended records not yet fsync'd
+    time_t journalLastSync;
+    bool binaryMode;     // keep users in BINARY_FILENAME, memory-mapped
+    int binaryFd;
+    unsigned char *binaryMap;
+    size_t binaryMapSize;
+    uint32_t binaryCount; // records of BINARY_FILENAME loaded so far
+    pthread_mutex_t lock; // guards appends, the journal and rewrites; row updates need no lock
+} UserStore;
+
+/* Background checkpoints of a --journal store, see CHECKPOINTS. `writing`
+ * is held by whoever writes a snapshot and is taken before userStore.lock. */
+typedef struct {
+    pthread_mutex_t lock;    // guards the fields below
+    pthread_cond_t wake;
+    pthread_mutex_t writing;
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    bool requested;          // the journal outgrew JOURNAL_COMPACT_BYTES
+    int interval;            // seconds between checkpoints, 0 for size-triggered only
+    time_t last;
+    int oldJournalFd;        // JOURNAL_OLD_FILENAME while a checkpoint is replacing it, else -1
+} Checkpointer;
+
+typedef enum {
+    BULK_RESET = 1,
+    BULK_PROMOTE,
+    BULK_DELETE
+} BulkAction;
+
+/* Which users a bulk operation applies to: the listed names if any, else
+ * everyone meeting all of the set predicates. */
+typedef struct {
+    char (*names)[50];   // sorted with strcmp
+    int nameCount;
+    bool balanceBelowSet;
+    int balanceBelow;
+    time_t inactiveBefore; // last active before this time, 0 for no limit; never-seen users don't match
+    const char *keep;      // never deleted, normally the admin running the operation
+} BulkFilter;
+
+typedef enum {
+    USER_SORT_NONE = 1, // registration order
+    USER_SORT_BALANCE,
+    USER_SORT_GAMES,
+    USER_SORT_WIN_RATE
+} UserSort;
+
+typedef struct {
+    UserSort sort;
+    char nameContains[50]; // empty matches everyone
+    bool adminsOnly;
+} UserListQuery;
+
+/* Indexable skip list: each link also counts the nodes it jumps over, so
+ * finding a node's rank or the node at a rank is O(log N). Ordered by score,
+ * highest first, then by username. */
+typedef struct SkipNode {
+    UserRecord *rec;
+    int64_t score;
+    int level;
+    struct {
+        struct SkipNode *next;
+        uint32_t span;  // nodes up to and including next; to the end of the list if next is NULL
+    } links[];
+} SkipNode;
+
+typedef struct {
+    SkipNode *head;
+    int level;
+    uint32_t length;
+} SkipList;
+
+typedef struct {
+    SkipList boards[BOARD_COUNT];
+    bool built;          // set once boards hold every user; until then updates are ignored
+    uint64_t levelSeed;
+    pthread_mutex_t lock;
+} Leaderboards;
+
+typedef struct {
+    char magic[8];       // LEADERBOARD_MAGIC
+    uint32_t version;
+    uint32_t minGames;   // LEADERBOARD_MIN_GAMES the win rate board was built with
+    uint32_t counts[BOARD_COUNT];
+    uint32_t reserved;
+} LeaderboardFileHeader;
+
+typedef struct {
+    char username[50];
+    char pad[2];
+    uint32_t id;         // record id when saved; users load in file order, so usually still right
+    int64_t score;
+} LeaderboardFileEntry;
+
+_Static_assert(sizeof(LeaderboardFileEntry) == 64, "LeaderboardFileEntry must be 64 bytes");
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;     // bytes hashed so far
+    uint8_t buffer[64];
+    size_t used;
+} Sha256;
+
+/* One stored password format. verifyPassword picks the first hasher whose
+ * `matches` accepts the stored string; new passwords use the first hasher. */
+typedef struct {
+    const char *name;
+    bool (*matches)(const char *stored);
+    void (*hash)(const char *input, char *out); // writes PASSWORD_LENGTH bytes; NULL if only verified
+    bool (*verify)(const char *input, const char *stored);
+    bool (*current)(const char *stored);        // hashed with today's settings; NULL for retired formats
+} PasswordHasher;
+
+typedef struct {
+    uint8_t key[SHA256_DIGEST_SIZE];
+    time_t verifiedAt; // 0 for an empty way
+} CredentialCacheWay;
+
+typedef struct {
+    CredentialCacheWay ways[CREDENTIAL_CACHE_SETS][CREDENTIAL_CACHE_WAYS];
+    uint8_t secret[32];  // per-process HMAC key for cache keys
+    pthread_mutex_t lock;
+} CredentialCache;
+
+/* One logged-in player. While on a timer wheel it sits in slot `slot`
+ * and expires at `expires` unless touched again. */
+typedef struct Session {
+    char token[2 * SESSION_TOKEN_BYTES + 1]; // hex, handed to the player
+    User user;
+    UserRecord *rec;
+    void *owner;        // server connection or script player driving the session, NULL if none
+    bool parked;        // connection dropped; waiting on sessions.parked to be resumed
+    time_t expires;
+    int slot;           // wheel slot, -1 when on no wheel
+    struct Session *prev, *next; // wheel slot list
+    struct Session *hashNext;    // token table chain
+} Session;
+
+typedef struct {
+    Session *slots[SESSION_WHEEL_SLOTS];
+    time_t now;         // slots for every second before this have been expired
+    int count;
+} SessionWheel;
+
+typedef struct {
+    Session **buckets;  // by token
+    size_t bucketCount;
+    size_t count;
+    SessionWheel parked; // sessions whose connection dropped
+    pthread_mutex_t lock;
+} SessionTable;
+
+// A file descriptor stdout or stderr is written to.
+typedef struct {
+    int fd;
+    int escape;         // 0 outside an ANSI escape, 1 after ESC, 2 inside ESC [ ... when stripping
+    char *scratch;      // stripped copy of the bytes being written
+    size_t scratchCap;
+} TerminalStream;
+
+typedef struct {
+    bool color;
+    TerminalStream out;
+    TerminalStream err;
+    // --async-output: stdout bytes queue in `pending` for the writer thread.
+    bool async;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // pending has bytes, or stopping
+    pthread_cond_t drained; // pending emptied
+    char *pending;
+    size_t pendingLen;
+    size_t pendingCap;
+    bool writing;
+    bool stopping;
+    // stdin is unbuffered; terminalRead keeps what it read ahead here instead.
+    char input[TERMINAL_INPUT_SIZE];
+    size_t inputPos;
+    size_t inputLen;
+} Terminal;
+
+/* Timed operations and byte counters. Building with -DROULETTE_NO_METRICS
+ * compiles every probe away. */
+typedef enum {
+    METRIC_LOAD_USER,
+    METRIC_SAVE_USER,
+    METRIC_UPDATE_USER,
+    METRIC_SPIN,
+    METRIC_SETTLE,
+    METRIC_HISTORY_APPEND,
+    METRIC_HISTORY_QUERY,
+    METRIC_JOURNAL_SYNC,
+    METRIC_RENDER,
+    METRIC_PASSWORD_KDF,
+    METRIC_CHECKPOINT,
+    METRIC_OP_COUNT
+} MetricOp;
+
+typedef enum {
+    METRIC_USER_BYTES_READ,
+    METRIC_USER_BYTES_WRITTEN,
+    METRIC_JOURNAL_BYTES_WRITTEN,
+    METRIC_HISTORY_BYTES_READ,
+    METRIC_HISTORY_BYTES_WRITTEN,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+/* Log-linear latency histogram in nanoseconds: values below 16 get their own
+ * bucket, larger ones share each power of two among 16 buckets. */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRIC_BUCKETS];
+} MetricHistogram;
+
+#ifndef ROULETTE_NO_METRICS
+#define METRIC_BEGIN(start) uint64_t start = metricsNow()
+#define METRIC_END(op, start) metricsRecord(op, metricsNow() - (start))
+#define METRIC_COUNT(counter, bytes) metricsAdd(counter, bytes)
+#else
+#define METRIC_BEGIN(start) do { } while (0)
+#define METRIC_END(op, start) do { } while (0)
+#define METRIC_COUNT(counter, bytes) do { } while (0)
+#endif
+
 /* ====== GLOBAL VARIABLES ====== */
-GameHistory gameHistory[MAX_HISTORY];
-int historyCount = 0;
+HistoryStore historyStore = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+UserStore userStore;
+Checkpointer checkpointer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                              .writing = PTHREAD_MUTEX_INITIALIZER, .interval = CHECKPOINT_INTERVAL_SECS,
+                              .oldJournalFd = -1 };
+CredentialCache credentialCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+SessionTable sessions = { .lock = PTHREAD_MUTEX_INITIALIZER };
+Terminal terminal = { .color = true, .out = { .fd = STDOUT_FILENO }, .err = { .fd = STDERR_FILENO },
+                      .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+                      .drained = PTHREAD_COND_INITIALIZER };
+Leaderboards leaderboards = { .levelSeed = 0x9E3779B97F4A7C15ULL, .lock = PTHREAD_MUTEX_INITIALIZER };
+SpinSource gameSpins; // spins of the interactive game and the script driver
+SpinProducer spinProducer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                              .idle = PTHREAD_COND_INITIALIZER };
+int32_t payoutTable[POCKET_COUNT][BET_SLOT_COUNT]; // pocket x slot -> payout ratio, 0 on a loss
+uint64_t allocationCount; // successful xmalloc/xcalloc/xrealloc calls, for benchmarks
 
 /* ====== FUNCTION PROTOTYPES ====== */
 /* User Management */
-void encryptPassword(char *password);
-void decryptPassword(char *password);
+void hashPassword(char *password);
 bool verifyPassword(const char *input, const char *stored);
+bool passwordNeedsRehash(const char *stored);
+bool kdfSelfTest(void);
 int loadUser(User *user);
-void saveUser(User user);
-void updateUser(User user);
+int saveUser(User user);
+void updateUser(User *user);
 void changePassword(User *user);
 
+/* User Store */
+int userStoreOpen(void);
+void userStoreClose(void);
+UserRecord *userStoreFind(const char *username);
+UserRecord *userStoreInsert(const User *user);
+UserRecord *userStoreAt(int id);
+bool userStorePersist(UserRecord *rec);
+void userStoreCommit(UserRecord *rec, User *user);
+bool userStoreReload(UserRecord *rec);
+bool userStoreReadRow(UserRecord *rec, User *out);
+void userStoreRefresh(void);
+void userStoreSync(void);
+void userStoreCompact(void);
+int userStoreBulkApply(BulkAction action, const BulkFilter *filter);
+int convertTextToBinary(const char *src, const char *dst);
+int convertBinaryToText(const char *src, const char *dst);
+
+/* Checkpoints */
+void checkpointStart(void);
+void checkpointStop(void);
+void checkpointRequest(void);
+
+/* Leaderboards */
+void leaderboardUpdate(UserRecord *rec);
+void leaderboardBuild(void);
+int leaderboardRank(LeaderboardKind kind, const char *username, uint32_t *size);
+int leaderboardTop(LeaderboardKind kind, int count, UserRecord **rows, int64_t *scores);
+void leaderboardClose(void);
+
+/* Script Driver */
+int runScript(const char *path, const char *recordPath, uint64_t seed);
+int runReplay(const char *logPath, double speed);
+
+/* Sessions */
+Session *sessionCreate(const User *user, UserRecord *rec);
+void sessionWheelInsert(SessionWheel *wheel, Session *session);
+void sessionWheelRemove(SessionWheel *wheel, Session *session);
+void sessionTouch(SessionWheel *wheel, Session *session, time_t now);
+Session *sessionWheelAdvance(SessionWheel *wheel, time_t now);
+void sessionPark(Session *session);
+Session *sessionResume(const char *token);
+bool sessionParkedCredentials(UserRecord *rec, char *token, char *stored);
+void sessionExpireParked(time_t now);
+void sessionEnd(Session *session);
+void sessionTableClose(void);
+
+/* Random Numbers */
+void rngSeed(Rng *rng, uint64_t seed);
+uint64_t rngNext(Rng *rng);
+void rngJump(Rng *rng);
+uint32_t rngBounded(Rng *rng, uint32_t bound);
+
+/* Spin Sources */
+const SpinEngine *spinEngineFor(const char *name);
+void spinSourceInit(SpinSource *src, const SpinEngine *engine, uint64_t seed, const char *label);
+void spinSourceFork(SpinSource *dst, const SpinSource *parent, int stream, const char *label);
+void spinSourceSeed(SpinSource *src, uint64_t seed);
+int spinNext(SpinSource *src);
+bool spinProof(const SpinSource *src, char *buf, size_t size);
+void spinSourceClose(SpinSource *src);
+void spinSourcesShutdown(void);
+int verifyFairness(const char *logPath, char **queries, int queryCount);
+
+/* Roulette Engine (no I/O) */
+int spinWheel(void);
+int spinWheelWith(Rng *rng);
+bool isRedNumber(int pocket);
+bool validBetSelection(int type, int selection);
+int splitSelection(int a, int b);
+void initPayoutTable(void);
+int betSlot(int type, int selection);
+int betMultiplier(int type, int selection, int pocket);
+int settleBet(User *user, const Bet *bet, int pocket);
+
+/* Batch Settlement */
+void betBatchInit(BetBatch *batch);
+void betBatchFree(BetBatch *batch);
+void betBatchAdd(BetBatch *batch, const Bet *bet, int userIndex);
+void settleBatch(BetBatch *batch, int pocket, User *users);
+void betLabel(int type, int selection, char *buf, size_t size);
+int runSimulation(long long spins, const char *mixSpec, int threads, uint64_t seed);
+int runBenchmarks(const char *sizes, const char *outPath);
+
 /* Game Functions */
 void spinRoulette(int *result, char *color);
 void printWheel(void);
 void displayRules(void);
 void playRoulette(User *user);
-void addGameHistory(User user, const char* type, int bet, int res, int payout);
+void addGameHistory(User user, const Bet *bet, int res, int payout);
 void showGameHistory(const char* username);
+
+/* Game History Store */
+int historyStoreOpen(void);
+void historyStoreClose(void);
+int historyQuery(const char *username, int64_t before, int offset, int limit, GameHistory *out);
+int historyCountFor(const char *username);
 void displayStats(User user);
+void showLeaderboards(const char *username);
+
+/* History Analytics */
+bool analyticsForUser(const char *username, PlayerAnalytics *out);
+int runAnalytics(int threads);
+
+/* History Export */
+bool historyColumnsCreate(HistoryColumnsWriter *w, const char *path);
+void historyColumnsAppend(HistoryColumnsWriter *w, const GameHistory *h);
+bool historyColumnsFinish(HistoryColumnsWriter *w);
+bool historyColumnsOpen(HistoryColumnsReader *r, const char *path);
+const GameHistory *historyColumnsNext(HistoryColumnsReader *r, int *count);
+void historyColumnsClose(HistoryColumnsReader *r);
+int exportHistory(const char *path);
+int importHistory(const char *path);
+
+/* Hashing */
+void sha256Init(Sha256 *ctx);
+void sha256Update(Sha256 *ctx, const void *data, size_t len);
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void hmacSha256(const void *key, size_t keyLen, const void *data, size_t dataLen,
+                uint8_t mac[SHA256_DIGEST_SIZE]);
+void scrypt(const char *password, const uint8_t *salt, size_t saltLen, int logN, int r, int p,
+            uint8_t *out, size_t outLen);
 
 /* Utility Functions */
 void clearInputBuffer(void);
 void getInput(char *buf, int size);
-void checkTimeout(time_t lastActivity);
+bool waitForInput(time_t deadline);
+void terminalInit(bool color, bool wholeScreens, bool async);
+size_t terminalInputPending(void);
+void terminalClose(void);
+void *xmalloc(size_t size);
+void *xcalloc(size_t count, size_t size);
+void *xrealloc(void *ptr, size_t size);
+
+/* Metrics */
+#ifndef ROULETTE_NO_METRICS
+uint64_t metricsNow(void);
+void metricsRecord(MetricOp op, uint64_t nanos);
+void metricsAdd(MetricCounter counter, uint64_t amount);
+#endif
+void metricsInit(bool reportAtExit);
+void metricsReport(FILE *out);
+
+/* Table Server */
+int runServer(const char *address, int roundSeconds, int workers);
 
 /* Admin Functions */
 void adminMenu(User *user);
@@ -89,439 +862,6703 @@ void getInput(char *buf, int size) {
     }
 }
 
-void encryptPassword(char *password) {
-    for (int i = 0; password[i] != '\0'; i++) {
-        password[i] = password[i] + 3;
+/* Wait for a player at the terminal to type something, giving up at
+ * `deadline`. Input that is not a terminal is always ready, and so is input
+ * typed ahead that was already read from the descriptor, which polling it
+ * would miss. */
+bool waitForInput(time_t deadline) {
+    if (!isatty(STDIN_FILENO)) return true;
+    if (terminalInputPending() > 0) return true;
+    while (1) {
+        time_t now = time(NULL);
+        if (now >= deadline) return false;
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        int n = poll(&pfd, 1, (int)(deadline - now) * 1000);
+        if (n > 0 || (n < 0 && errno != EINTR)) return true;
     }
 }
 
-void decryptPassword(char *password) {
-    for (int i = 0; password[i] != '\0'; i++) {
-        password[i] = password[i] - 3;
+/* ====== TERMINAL OUTPUT ======
+ * stdout, stderr and stdin are replaced with streams that hook the actual
+ * reads and writes. For the interactive game stdout is fully buffered, and
+ * every read from stdin flushes it first, so a whole screen of prints goes
+ * out in one write just as the program starts waiting for the player. With
+ * color off the write hook drops ANSI escapes, and with --async-output it
+ * hands stdout bytes to a writer thread so a slow link never holds up the
+ * game. Anything written to stderr first waits for stdout to drain, which
+ * keeps messages in the order they were printed. */
+
+static void terminalWriteAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return; // Nowhere left to report it.
+        }
+        buf += n;
+        len -= (size_t)n;
     }
 }
 
-bool verifyPassword(const char *input, const char *stored) {
-    char decrypted[PASSWORD_LENGTH];
-    strcpy(decrypted, stored);
-    decryptPassword(decrypted);
-    return strcmp(input, decrypted) == 0;
+// Copy buf to out without escape sequences, which may span calls. Returns the length kept.
+static size_t terminalStrip(TerminalStream *stream, const char *buf, size_t len, char *out) {
+    size_t kept = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)buf[i];
+        if (stream->escape == 0) {
+            if (ch == 0x1B) stream->escape = 1;
+            else out[kept++] = (char)ch;
+        } else if (stream->escape == 1) {
+            stream->escape = ch == '[' ? 2 : 0;
+        } else if (ch >= 0x40 && ch <= 0x7E) {
+            stream->escape = 0; // final byte of a control sequence
+        }
+    }
+    return kept;
 }
 
-bool isAdminPassword(const char *input) {
-    return strcmp(input, "TEAM16") == 0;
-}
+static void *terminalWriter(void *arg) {
+    (void)arg;
+    char *spare = NULL;
+    size_t spareCap = 0;
 
-void saveUser(User user) {
-    FILE *file = fopen(FILENAME, "a+");
-    if (!file) {
-        perror(RED "Error opening user file for saving" RESET);
-        return;
+    pthread_mutex_lock(&terminal.lock);
+    while (1) {
+        while (terminal.pendingLen == 0 && !terminal.stopping) {
+            pthread_cond_wait(&terminal.ready, &terminal.lock);
+        }
+        if (terminal.pendingLen == 0) break;
+
+        // Swap buffers so printing carries on while these bytes are written.
+        char *buf = terminal.pending;
+        size_t len = terminal.pendingLen, cap = terminal.pendingCap;
+        terminal.pending = spare;
+        terminal.pendingCap = spareCap;
+        terminal.pendingLen = 0;
+        terminal.writing = true;
+        pthread_mutex_unlock(&terminal.lock);
+
+        terminalWriteAll(terminal.out.fd, buf, len);
+        spare = buf;
+        spareCap = cap;
+
+        pthread_mutex_lock(&terminal.lock);
+        terminal.writing = false;
+        pthread_cond_broadcast(&terminal.drained);
     }
-    
-    char encrypted[PASSWORD_LENGTH];
-    strcpy(encrypted, user.password);
+    pthread_mutex_unlock(&terminal.lock);
+    free(spare);
+    return NULL;
+}
 
-    fprintf(file, "%s %s %d %d %d %d %d\n", user.username, encrypted, 
-            user.balance, user.games_played, user.games_won, 
-            user.highest_win, user.isAdmin ? 1 : 0);
-    fclose(file);
+// Wait until everything printed to stdout so far has reached its descriptor.
+static void terminalDrain(void) {
+    fflush(stdout);
+    if (!terminal.async) return;
+    pthread_mutex_lock(&terminal.lock);
+    while (terminal.pendingLen > 0 || terminal.writing) {
+        pthread_cond_wait(&terminal.drained, &terminal.lock);
+    }
+    pthread_mutex_unlock(&terminal.lock);
 }
 
-int loadUser(User *user) {
-    FILE *file = fopen(FILENAME, "r");
-    if (!file) return 0; // File doesn't exist or cannot be opened, no users loaded.
-    
-    User temp;
-    char encrypted_password_from_file[PASSWORD_LENGTH];
-    int found = 0;
-    int adminFlag;
-    
-    fseek(file, 0, SEEK_SET);
-
-    while (fscanf(file, "%49s %19s %d %d %d %d %d", temp.username, encrypted_password_from_file,
-                      &temp.balance, &temp.games_played, &temp.games_won, 
-                      &temp.highest_win, &adminFlag) != EOF) {
-        temp.isAdmin = (adminFlag == 1);
-        
-        strcpy(temp.password, encrypted_password_from_file); 
-        
-        if (strcmp(temp.username, user->username) == 0) {
-            if (user->password[0] != '\0') { // Only verify if a password was provided for login
-                char decrypted_stored_password[PASSWORD_LENGTH];
-                strcpy(decrypted_stored_password, temp.password);
-                decryptPassword(decrypted_stored_password);
-
-                if (strcmp(user->password, decrypted_stored_password) != 0) {
-                    fclose(file);
-                    return -1; // Incorrect password
-                }
-            }
-            
-            *user = temp; 
-            found = 1;
-            break;
+static ssize_t terminalWrite(void *cookie, const char *buf, size_t len) {
+    TerminalStream *stream = cookie;
+    if (stream == &terminal.err) terminalDrain();
+
+    if (stream == &terminal.out && terminal.async) {
+        pthread_mutex_lock(&terminal.lock);
+        while (terminal.pendingLen > TERMINAL_PENDING_MAX && !terminal.stopping) {
+            pthread_cond_wait(&terminal.drained, &terminal.lock);
+        }
+        if (terminal.pendingLen + len > terminal.pendingCap) {
+            terminal.pendingCap = (terminal.pendingLen + len) * 2;
+            terminal.pending = xrealloc(terminal.pending, terminal.pendingCap);
+        }
+        if (terminal.color) {
+            memcpy(terminal.pending + terminal.pendingLen, buf, len);
+            terminal.pendingLen += len;
+        } else {
+            terminal.pendingLen += terminalStrip(stream, buf, len, terminal.pending + terminal.pendingLen);
         }
+        pthread_cond_signal(&terminal.ready);
+        pthread_mutex_unlock(&terminal.lock);
+        return (ssize_t)len;
     }
-    fclose(file);
-    return found;
+
+    if (terminal.color) {
+        terminalWriteAll(stream->fd, buf, len);
+    } else {
+        // Callers hold the stream's FILE lock, so the scratch buffer is ours.
+        if (len > stream->scratchCap) {
+            stream->scratchCap = len;
+            stream->scratch = xrealloc(stream->scratch, len);
+        }
+        terminalWriteAll(stream->fd, stream->scratch, terminalStrip(stream, buf, len, stream->scratch));
+    }
+    return (ssize_t)len;
+}
+
+/* stdin itself is unbuffered, so whatever was read ahead of the caller sits
+ * in terminal.input, where terminalInputPending can count it. */
+static ssize_t terminalRead(void *cookie, char *buf, size_t len) {
+    (void)cookie;
+    if (terminal.inputPos == terminal.inputLen) {
+        fflush(stdout); // The player needs to see the prompt before we wait on them.
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, terminal.input, sizeof(terminal.input));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return n;
+        terminal.inputPos = 0;
+        terminal.inputLen = (size_t)n;
+    }
+    size_t n = terminal.inputLen - terminal.inputPos;
+    if (n > len) n = len;
+    memcpy(buf, terminal.input + terminal.inputPos, n);
+    terminal.inputPos += n;
+    return (ssize_t)n;
 }
 
+// Bytes read from the terminal that stdin has not handed out yet.
+size_t terminalInputPending(void) {
+    return terminal.inputLen - terminal.inputPos;
+}
 
-void updateUser(User user) {
-    FILE *file = fopen(FILENAME, "r");
-    if (!file) {
-        perror(RED "Error opening user file for update (read)" RESET);
+/* Take over the standard streams. wholeScreens buffers stdout until input
+ * is read; otherwise it stays line buffered for modes that print progress. */
+void terminalInit(bool color, bool wholeScreens, bool async) {
+    terminal.color = color;
+    FILE *out = fopencookie(&terminal.out, "w", (cookie_io_functions_t){ .write = terminalWrite });
+    FILE *err = fopencookie(&terminal.err, "w", (cookie_io_functions_t){ .write = terminalWrite });
+    FILE *in = fopencookie(NULL, "r", (cookie_io_functions_t){ .read = terminalRead });
+    if (!out || !err || !in) {
+        perror(RED "Error setting up terminal output" RESET);
         return;
     }
-    
-    User users[MAX_USERS];
-    int count = 0;
-    char encrypted_password_from_file[PASSWORD_LENGTH];
-    int adminFlag;
-    
-    while (fscanf(file, "%49s %19s %d %d %d %d %d", users[count].username, encrypted_password_from_file,
-                      &users[count].balance, &users[count].games_played, 
-                      &users[count].games_won, &users[count].highest_win,
-                      &adminFlag) != EOF) {
-        users[count].isAdmin = (adminFlag == 1);
-        strcpy(users[count].password, encrypted_password_from_file);
-        
-        if (strcmp(users[count].username, user.username) == 0) {
-            users[count] = user; 
-        }
-        count++;
+    fflush(stdout);
+    fflush(stderr);
+    setvbuf(out, NULL, wholeScreens ? _IOFBF : _IOLBF, TERMINAL_BUFFER_SIZE);
+    setvbuf(err, NULL, _IONBF, 0);
+    setvbuf(in, NULL, _IONBF, 0);
+    stdout = out;
+    stderr = err;
+    stdin = in;
+
+    if (async) {
+        if (pthread_create(&terminal.writer, NULL, terminalWriter, NULL) != 0) {
+            perror(RED "Error starting output thread" RESET);
+            return;
+        }
+        terminal.async = true;
     }
-    fclose(file);
+}
 
-    file = fopen(FILENAME, "w");
-    if (!file) {
-        perror(RED "Error opening user file for update (write)" RESET);
-        return;
+// Write out everything still buffered and stop the writer thread.
+void terminalClose(void) {
+    fflush(stdout);
+    if (!terminal.async) return;
+    pthread_mutex_lock(&terminal.lock);
+    terminal.stopping = true;
+    pthread_cond_broadcast(&terminal.ready);
+    pthread_mutex_unlock(&terminal.lock);
+    pthread_join(terminal.writer, NULL);
+    terminal.async = false;
+}
+
+void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, RED "Out of memory!\n" RESET);
+        exit(1);
     }
-    
-    for (int i = 0; i < count; i++) {
-        fprintf(file, "%s %s %d %d %d %d %d\n", users[i].username, users[i].password,
-                users[i].balance, users[i].games_played, users[i].games_won, 
-                users[i].highest_win, users[i].isAdmin ? 1 : 0);
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+void *xcalloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        fprintf(stderr, RED "Out of memory!\n" RESET);
+        exit(1);
     }
-    fclose(file);
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    return ptr;
 }
 
+void *xrealloc(void *ptr, size_t size) {
+    void *grown = realloc(ptr, size);
+    if (!grown) {
+        fprintf(stderr, RED "Out of memory!\n" RESET);
+        exit(1);
+    }
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    return grown;
+}
 
-void printWheel() {
-    printf(BOLD "\n  ===== ROULETTE WHEEL =====\n" RESET);
-    for (int i = 0; i <= 36; i++) {
-        if (i == 0) {
-            printf(GREEN "00 " RESET);
-        } else {
-            bool isRedNumber;
-            if ((i >= 1 && i <= 10) || (i >= 19 && i <= 28)) {
-                isRedNumber = (i % 2 != 0);
-            } else if ((i >= 11 && i <= 18) || (i >= 29 && i <= 36)) {
-                isRedNumber = (i % 2 == 0);
-            } else {
-                isRedNumber = false; 
-            }
+/* ====== PASSWORD HASHING ======
+ * Passwords are stored as "$s1$<log2 N>$<r>$<p>$<salt>$<hash>", the scrypt
+ * KDF over a random salt with base64 fields. The hasher is looked up from
+ * the stored string, so rows from before scrypt (a +3 character shift) still
+ * verify and are rehashed at the user's next login. Successful checks are
+ * remembered in a small set-associative cache so repeated logins skip the
+ * KDF. The server runs the KDF on LOGIN_WORKERS threads of its own, never on
+ * the lobby's event loop (see TABLE SERVER). */
 
-            if (isRedNumber) {
-                printf(RED "%02d " RESET, i);
-            } else {
-                printf(BLUE "%02d " RESET, i);
-            }
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256Init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256Update(Sha256 *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+    while (len > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->buffer + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used == 64) {
+            sha256Block(ctx->state, ctx->buffer);
+            ctx->used = 0;
         }
-        if (i > 0 && i % 12 == 0) printf("\n  ");
     }
-    printf(BOLD "\n  ==========================\n" RESET);
 }
 
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) sha256Update(ctx, &pad, 1);
+    uint8_t lengthBytes[8];
+    for (int i = 0; i < 8; i++) lengthBytes[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256Update(ctx, lengthBytes, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+}
 
-void spinRoulette(int *result, char *color) {
-    *result = rand() % 37; // 0-36
-    
-    bool isRed = false;
-    const int redNumbers[] = {1, 3, 5, 7, 9, 12, 14, 16, 18, 19, 21, 23, 25, 27, 30, 32, 34, 36};
-    
-    if (*result == 0) {
-        strcpy(color, GREEN "Green" RESET);
+void hmacSha256(const void *key, size_t keyLen, const void *data, size_t dataLen,
+                uint8_t mac[SHA256_DIGEST_SIZE]) {
+    uint8_t block[64] = { 0 };
+    if (keyLen > sizeof(block)) {
+        Sha256 ctx;
+        sha256Init(&ctx);
+        sha256Update(&ctx, key, keyLen);
+        sha256Final(&ctx, block);
     } else {
-        for (int i = 0; i < sizeof(redNumbers)/sizeof(redNumbers[0]); i++) {
-            if (*result == redNumbers[i]) {
-                isRed = true;
-                break;
-            }
-        }
-        if (isRed) {
-            strcpy(color, RED "Red" RESET);
-        } else {
-            strcpy(color, BLUE "Black" RESET);
-        }
+        memcpy(block, key, keyLen);
     }
+
+    uint8_t pad[64], inner[SHA256_DIGEST_SIZE];
+    Sha256 ctx;
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+    sha256Init(&ctx);
+    sha256Update(&ctx, pad, sizeof(pad));
+    sha256Update(&ctx, data, dataLen);
+    sha256Final(&ctx, inner);
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5c;
+    sha256Init(&ctx);
+    sha256Update(&ctx, pad, sizeof(pad));
+    sha256Update(&ctx, inner, sizeof(inner));
+    sha256Final(&ctx, mac);
 }
 
-void displayRules() {
-    printf(BOLD CYAN "\n====== Roulette Rules =======" RESET
-           WHITE "\n1. Bet types:\n"
-           "   - Single number (" YELLOW "35:1" RESET ")\n"
-           "   - Even/Odd (" YELLOW "1:1" RESET ")\n"
-           "   - Red/Black (" YELLOW "1:1" RESET ")\n"
-           "   - High/Low (1-18/19-36) (" YELLOW "1:1" RESET ")\n"
-           "   - Dozens (1-12, 13-24, 25-36) (" YELLOW "2:1" RESET ")\n"
-           "   - Columns (" YELLOW "2:1" RESET ") " MAGENTA "[NEW]" RESET "\n"
-           "2. Min bet: $10, Max bet: $1000\n\n" RESET);
+// PBKDF2-HMAC-SHA256 with a single iteration, which is all scrypt needs.
+static void pbkdf2Sha256Once(const uint8_t *password, size_t passwordLen, const uint8_t *salt, size_t saltLen,
+                             uint8_t *out, size_t outLen) {
+    uint8_t *msg = xmalloc(saltLen + 4);
+    memcpy(msg, salt, saltLen);
+    for (uint32_t blockNo = 1; outLen > 0; blockNo++) {
+        uint8_t mac[SHA256_DIGEST_SIZE];
+        msg[saltLen] = (uint8_t)(blockNo >> 24);
+        msg[saltLen + 1] = (uint8_t)(blockNo >> 16);
+        msg[saltLen + 2] = (uint8_t)(blockNo >> 8);
+        msg[saltLen + 3] = (uint8_t)blockNo;
+        hmacSha256(password, passwordLen, msg, saltLen + 4, mac);
+        size_t take = outLen < sizeof(mac) ? outLen : sizeof(mac);
+        memcpy(out, mac, take);
+        out += take;
+        outLen -= take;
+    }
+    free(msg);
 }
 
-void addGameHistory(User user, const char* type, int bet, int res, int payout) {
-    if (historyCount >= MAX_HISTORY) {
-        for (int i = 0; i < MAX_HISTORY - 1; i++) {
-            gameHistory[i] = gameHistory[i+1];
-        }
-        historyCount = MAX_HISTORY - 1;
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= ROTL32(x[0] + x[12], 7);   x[8] ^= ROTL32(x[4] + x[0], 9);
+        x[12] ^= ROTL32(x[8] + x[4], 13);  x[0] ^= ROTL32(x[12] + x[8], 18);
+        x[9] ^= ROTL32(x[5] + x[1], 7);    x[13] ^= ROTL32(x[9] + x[5], 9);
+        x[1] ^= ROTL32(x[13] + x[9], 13);  x[5] ^= ROTL32(x[1] + x[13], 18);
+        x[14] ^= ROTL32(x[10] + x[6], 7);  x[2] ^= ROTL32(x[14] + x[10], 9);
+        x[6] ^= ROTL32(x[2] + x[14], 13);  x[10] ^= ROTL32(x[6] + x[2], 18);
+        x[3] ^= ROTL32(x[15] + x[11], 7);  x[7] ^= ROTL32(x[3] + x[15], 9);
+        x[11] ^= ROTL32(x[7] + x[3], 13);  x[15] ^= ROTL32(x[11] + x[7], 18);
+        x[1] ^= ROTL32(x[0] + x[3], 7);    x[2] ^= ROTL32(x[1] + x[0], 9);
+        x[3] ^= ROTL32(x[2] + x[1], 13);   x[0] ^= ROTL32(x[3] + x[2], 18);
+        x[6] ^= ROTL32(x[5] + x[4], 7);    x[7] ^= ROTL32(x[6] + x[5], 9);
+        x[4] ^= ROTL32(x[7] + x[6], 13);   x[5] ^= ROTL32(x[4] + x[7], 18);
+        x[11] ^= ROTL32(x[10] + x[9], 7);  x[8] ^= ROTL32(x[11] + x[10], 9);
+        x[9] ^= ROTL32(x[8] + x[11], 13);  x[10] ^= ROTL32(x[9] + x[8], 18);
+        x[12] ^= ROTL32(x[15] + x[14], 7); x[13] ^= ROTL32(x[12] + x[15], 9);
+        x[14] ^= ROTL32(x[13] + x[12], 13); x[15] ^= ROTL32(x[14] + x[13], 18);
     }
-    
-    time_t now = time(NULL);
-    strftime(gameHistory[historyCount].timestamp, sizeof(gameHistory[historyCount].timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    strcpy(gameHistory[historyCount].username, user.username);
-    strcpy(gameHistory[historyCount].game_type, type);
-    gameHistory[historyCount].bet_amount = bet;
-    gameHistory[historyCount].result = res;
-    gameHistory[historyCount].payout = payout;
-    historyCount++;
+    for (int i = 0; i < 16; i++) b[i] += x[i];
 }
 
-void playRoulette(User *user) {
-    if (user->balance < 10) {
-        printf(RED "Minimum bet is $10. Balance too low. Please top up or try again later.\n" RESET);
-        return;
+// scrypt BlockMix over 2r 64-byte blocks; y is scratch of the same size.
+static void scryptBlockMix(uint32_t *b, uint32_t *y, int r) {
+    uint32_t x[16];
+    memcpy(x, &b[(2 * r - 1) * 16], sizeof(x));
+    for (int i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 16; k++) x[k] ^= b[i * 16 + k];
+        salsa20_8(x);
+        // Even blocks go to the first half of the output, odd ones to the second.
+        memcpy(&y[((i & 1) * r + i / 2) * 16], x, sizeof(x));
+    }
+    memcpy(b, y, (size_t)128 * r);
+}
+
+static void scryptROMix(uint8_t *block, int r, uint64_t n, uint32_t *v, uint32_t *x, uint32_t *y) {
+    size_t words = (size_t)32 * r;
+    for (size_t k = 0; k < words; k++) {
+        const uint8_t *p = block + 4 * k;
+        x[k] = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        memcpy(&v[i * words], x, words * sizeof(uint32_t));
+        scryptBlockMix(x, y, r);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+        for (size_t k = 0; k < words; k++) x[k] ^= v[j * words + k];
+        scryptBlockMix(x, y, r);
     }
+    for (size_t k = 0; k < words; k++) {
+        uint8_t *p = block + 4 * k;
+        p[0] = (uint8_t)x[k];
+        p[1] = (uint8_t)(x[k] >> 8);
+        p[2] = (uint8_t)(x[k] >> 16);
+        p[3] = (uint8_t)(x[k] >> 24);
+    }
+}
 
-    int betType, betNum = 0, betAmt;
-    char gameType[30] = "Unknown";
-    const int redNumbers[] = {1, 3, 5, 7, 9, 12, 14, 16, 18, 19, 21, 23, 25, 27, 30, 32, 34, 36};
+// scrypt(password, salt, N = 2^logN, r, p) into out. Uses 128 * r * N bytes.
+void scrypt(const char *password, const uint8_t *salt, size_t saltLen, int logN, int r, int p,
+            uint8_t *out, size_t outLen) {
+    METRIC_BEGIN(start);
+    uint64_t n = (uint64_t)1 << logN;
+    size_t blockSize = (size_t)128 * r;
+    uint8_t *b = xmalloc(blockSize * p);
+    uint32_t *v = xmalloc(blockSize * n);
+    uint32_t *x = xmalloc(blockSize);
+    uint32_t *y = xmalloc(blockSize);
 
-    printf(WHITE "\nYour Current Balance: $" GREEN "%d" RESET "\n", user->balance);
-    
-    printf(BOLD YELLOW "\n--- Place Your Bet ---\n" RESET);
-    printf(WHITE "1) Single Number\n2) Even/Odd\n3) Red/Black\n"
-           "4) High/Low (1-18/19-36)\n5) Dozens (1-12, 13-24, 25-36)\n6) Columns\n"
-           BOLD CYAN "Enter your bet type choice: " RESET);
-    if (scanf("%d", &betType) != 1 || betType < 1 || betType > 6) {
-        printf(RED "Invalid bet type! Please enter a number between 1 and 6.\n" RESET);
-        clearInputBuffer();
-        return;
+    size_t passwordLen = strlen(password);
+    pbkdf2Sha256Once((const uint8_t *)password, passwordLen, salt, saltLen, b, blockSize * p);
+    for (int i = 0; i < p; i++) {
+        scryptROMix(b + blockSize * i, r, n, v, x, y);
     }
-    clearInputBuffer();
+    pbkdf2Sha256Once((const uint8_t *)password, passwordLen, b, blockSize * p, out, outLen);
 
-    switch (betType) {
-        case 1:
-            printWheel();
-            printf(BOLD BLUE "Enter the number you want to bet on (0-36): " RESET);
-            if (scanf("%d", &betNum) != 1 || betNum < 0 || betNum > 36) {
-                printf(RED "Invalid number! Please enter a number between 0 and 36.\n" RESET);
-                clearInputBuffer();
-                return;
-            }
-            break;
-        case 2:
-            printf(BOLD BLUE "1) Even 2) Odd: " RESET);
-            if (scanf("%d", &betNum) != 1 || (betNum != 1 && betNum != 2)) {
-                printf(RED "Invalid choice! Please select 1 for Even or 2 for Odd.\n" RESET);
-                clearInputBuffer();
-                return;
-            }
-            break;
-        case 3:
-            printf(BOLD BLUE "1) Red 2) Black: " RESET);
-            if (scanf("%d", &betNum) != 1 || (betNum != 1 && betNum != 2)) {
+    free(b);
+    free(v);
+    free(x);
+    free(y);
+    METRIC_END(METRIC_PASSWORD_KDF, start);
+}
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Unpadded base64; out needs 4 * ceil(len / 3) + 1 bytes.
+static void base64Encode(const uint8_t *data, size_t len, char *out) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t chunk = (uint32_t)data[i] << 16;
+        if (i + 1 < len) chunk |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) chunk |= data[i + 2];
+        out[o++] = base64Alphabet[(chunk >> 18) & 63];
+        out[o++] = base64Alphabet[(chunk >> 12) & 63];
+        if (i + 1 < len) out[o++] = base64Alphabet[(chunk >> 6) & 63];
+        if (i + 2 < len) out[o++] = base64Alphabet[chunk & 63];
+    }
+    out[o] = '\0';
+}
+
+// Decode exactly `len` bytes of unpadded base64. Returns false on bad input.
+static bool base64Decode(const char *text, size_t textLen, uint8_t *out, size_t len) {
+    if (textLen != (len * 4 + 2) / 3) return false;
+    uint32_t bits = 0;
+    int held = 0;
+    size_t o = 0;
+    for (size_t i = 0; i < textLen; i++) {
+        const char *at = strchr(base64Alphabet, text[i]);
+        if (!at || text[i] == '\0') return false;
+        bits = (bits << 6) | (uint32_t)(at - base64Alphabet);
+        held += 6;
+        if (held >= 8) {
+            held -= 8;
+            out[o++] = (uint8_t)(bits >> held);
+        }
+    }
+    return o == len;
+}
+
+static bool constantTimeEqual(const uint8_t *a, const uint8_t *b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static void randomBytes(uint8_t *out, size_t len) {
+    while (len > 0) {
+        ssize_t got = getrandom(out, len, 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            perror(RED "Error reading random bytes" RESET);
+            exit(1);
+        }
+        out += got;
+        len -= (size_t)got;
+    }
+}
+
+typedef struct {
+    int logN, r, p;
+    uint8_t salt[PASSWORD_SALT_BYTES];
+    uint8_t hash[PASSWORD_HASH_BYTES];
+} ScryptParams;
+
+static bool scryptParse(const char *stored, ScryptParams *out) {
+    int consumed = 0;
+    if (sscanf(stored, "$s1$%d$%d$%d$%n", &out->logN, &out->r, &out->p, &consumed) != 3 || consumed == 0) {
+        return false;
+    }
+    // A stored hash sets how much memory (128 * r * N bytes) and time a login
+    // spends, so anything past one step above today's settings is malformed.
+    if (out->logN < 1 || out->logN > SCRYPT_MAX_LOG_N || out->r < 1 || out->r > SCRYPT_R ||
+        out->p < 1 || out->p > SCRYPT_P) {
+        return false;
+    }
+    const char *salt = stored + consumed;
+    const char *dollar = strchr(salt, '$');
+    return dollar && base64Decode(salt, dollar - salt, out->salt, sizeof(out->salt)) &&
+           base64Decode(dollar + 1, strlen(dollar + 1), out->hash, sizeof(out->hash));
+}
+
+static bool scryptMatches(const char *stored) {
+    ScryptParams params;
+    return scryptParse(stored, &params);
+}
+
+static void scryptHash(const char *input, char *out) {
+    ScryptParams params = { SCRYPT_LOG_N, SCRYPT_R, SCRYPT_P, { 0 }, { 0 } };
+    randomBytes(params.salt, sizeof(params.salt));
+    scrypt(input, params.salt, sizeof(params.salt), params.logN, params.r, params.p,
+           params.hash, sizeof(params.hash));
+
+    char salt[4 * ((PASSWORD_SALT_BYTES + 2) / 3) + 1], hash[4 * ((PASSWORD_HASH_BYTES + 2) / 3) + 1];
+    base64Encode(params.salt, sizeof(params.salt), salt);
+    base64Encode(params.hash, sizeof(params.hash), hash);
+    snprintf(out, PASSWORD_LENGTH, "$s1$%d$%d$%d$%s$%s", params.logN, params.r, params.p, salt, hash);
+}
+
+static bool scryptVerify(const char *input, const char *stored) {
+    ScryptParams params;
+    if (!scryptParse(stored, &params)) return false;
+    uint8_t hash[PASSWORD_HASH_BYTES];
+    scrypt(input, params.salt, sizeof(params.salt), params.logN, params.r, params.p, hash, sizeof(hash));
+    return constantTimeEqual(hash, params.hash, sizeof(hash));
+}
+
+static bool scryptCurrent(const char *stored) {
+    ScryptParams params;
+    return scryptParse(stored, &params) &&
+           params.logN == SCRYPT_LOG_N && params.r == SCRYPT_R && params.p == SCRYPT_P;
+}
+
+/* A legacy password is the plaintext with every byte shifted up by 3. It
+ * was read with "%s", so no byte shifts back to whitespace or a control
+ * character, and it never takes the scrypt form. */
+static bool legacyMatches(const char *stored) {
+    if (*stored == '\0' || strncmp(stored, "$s1$", 4) == 0) return false;
+    for (const char *c = stored; *c; c++) {
+        unsigned char plain = (unsigned char)(*c - 3);
+        if (plain <= ' ' || plain == 0x7F) return false;
+    }
+    return true;
+}
+
+static bool legacyVerify(const char *input, const char *stored) {
+    size_t len = strlen(input);
+    if (len != strlen(stored)) return false;
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= (uint8_t)(stored[i] - 3) ^ (uint8_t)input[i];
+    return diff == 0;
+}
+
+// Tried in order; the first is used for new hashes.
+static const PasswordHasher passwordHashers[] = {
+    { "scrypt", scryptMatches, scryptHash, scryptVerify, scryptCurrent },
+    { "legacy-shift", legacyMatches, NULL, legacyVerify, NULL },
+};
+
+// NULL for a malformed hash, which no password matches.
+static const PasswordHasher *passwordHasherFor(const char *stored) {
+    size_t count = sizeof(passwordHashers) / sizeof(passwordHashers[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (passwordHashers[i].matches(stored)) return &passwordHashers[i];
+    }
+    return NULL;
+}
+
+// Hash a plaintext password in place. The buffer must hold PASSWORD_LENGTH bytes.
+void hashPassword(char *password) {
+    char hashed[PASSWORD_LENGTH];
+    passwordHashers[0].hash(password, hashed);
+    memcpy(password, hashed, PASSWORD_LENGTH);
+}
+
+// True if the stored password should be rehashed with the current hasher and settings.
+bool passwordNeedsRehash(const char *stored) {
+    const PasswordHasher *hasher = passwordHasherFor(stored);
+    if (!hasher) return false;
+    return hasher != &passwordHashers[0] || (hasher->current && !hasher->current(stored));
+}
+
+/* The cache key is an HMAC of the stored hash and the input under a key
+ * drawn at startup, so it is useless outside this process and stops
+ * matching as soon as the password changes. */
+static void credentialCacheKey(const char *input, const char *stored, uint8_t key[SHA256_DIGEST_SIZE]) {
+    char message[2 * PASSWORD_LENGTH + 1];
+    size_t storedLen = strnlen(stored, PASSWORD_LENGTH);
+    size_t inputLen = strnlen(input, PASSWORD_LENGTH);
+    memcpy(message, stored, storedLen);
+    message[storedLen] = '\0';
+    memcpy(message + storedLen + 1, input, inputLen);
+    hmacSha256(credentialCache.secret, sizeof(credentialCache.secret), message, storedLen + 1 + inputLen, key);
+}
+
+static bool credentialCacheLookup(const uint8_t key[SHA256_DIGEST_SIZE]) {
+    CredentialCacheWay *set = credentialCache.ways[key[0] % CREDENTIAL_CACHE_SETS];
+    time_t now = time(NULL);
+    bool hit = false;
+    pthread_mutex_lock(&credentialCache.lock);
+    for (int w = 0; w < CREDENTIAL_CACHE_WAYS; w++) {
+        if (set[w].verifiedAt && now - set[w].verifiedAt < CREDENTIAL_CACHE_TTL &&
+            constantTimeEqual(set[w].key, key, SHA256_DIGEST_SIZE)) {
+            hit = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&credentialCache.lock);
+    return hit;
+}
+
+// Remember a verified credential, replacing the oldest entry of its set.
+static void credentialCacheInsert(const uint8_t key[SHA256_DIGEST_SIZE]) {
+    CredentialCacheWay *set = credentialCache.ways[key[0] % CREDENTIAL_CACHE_SETS];
+    pthread_mutex_lock(&credentialCache.lock);
+    int oldest = 0;
+    for (int w = 1; w < CREDENTIAL_CACHE_WAYS; w++) {
+        if (set[w].verifiedAt < set[oldest].verifiedAt) oldest = w;
+    }
+    memcpy(set[oldest].key, key, SHA256_DIGEST_SIZE);
+    set[oldest].verifiedAt = time(NULL);
+    pthread_mutex_unlock(&credentialCache.lock);
+}
+
+static void credentialCacheSeed(void) {
+    randomBytes(credentialCache.secret, sizeof(credentialCache.secret));
+}
+
+bool verifyPassword(const char *input, const char *stored) {
+    const PasswordHasher *hasher = passwordHasherFor(stored);
+    if (!hasher) return false;
+    if (!hasher->current) {
+        return hasher->verify(input, stored); // Cheap formats gain nothing from the cache.
+    }
+
+    static pthread_once_t seeded = PTHREAD_ONCE_INIT;
+    pthread_once(&seeded, credentialCacheSeed);
+    uint8_t key[SHA256_DIGEST_SIZE];
+    credentialCacheKey(input, stored, key);
+    if (credentialCacheLookup(key)) return true;
+
+    bool ok = hasher->verify(input, stored);
+    if (ok) credentialCacheInsert(key);
+    return ok;
+}
+
+
+static bool kdfVectorMatches(const char *name, const uint8_t *got, const char *hex) {
+    char text[2 * 64 + 1];
+    for (int i = 0; i < 64; i++) snprintf(text + 2 * i, 3, "%02x", got[i]);
+    bool ok = strcmp(text, hex) == 0;
+    printf("%s %s\n", ok ? GREEN "ok  " RESET : RED "FAIL" RESET, name);
+    return ok;
+}
+
+/* Check PBKDF2 and scrypt against the test vectors of RFC 7914, sections
+ * 11 and 12; the last scrypt vector uses the parameters new hashes get. */
+bool kdfSelfTest(void) {
+    uint8_t out[64];
+    bool ok = true;
+    pbkdf2Sha256Once((const uint8_t *)"passwd", 6, (const uint8_t *)"salt", 4, out, sizeof(out));
+    ok &= kdfVectorMatches("PBKDF2-HMAC-SHA256 passwd/salt c=1", out,
+                           "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+                           "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783");
+    scrypt("", (const uint8_t *)"", 0, 4, 1, 1, out, sizeof(out));
+    ok &= kdfVectorMatches("scrypt N=16 r=1 p=1", out,
+                           "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442"
+                           "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906");
+    scrypt("password", (const uint8_t *)"NaCl", 4, 10, 8, 16, out, sizeof(out));
+    ok &= kdfVectorMatches("scrypt N=1024 r=8 p=16", out,
+                           "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162"
+                           "2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640");
+    scrypt("pleaseletmein", (const uint8_t *)"SodiumChloride", 14, 14, 8, 1, out, sizeof(out));
+    ok &= kdfVectorMatches("scrypt N=16384 r=8 p=1", out,
+                           "7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2"
+                           "d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887");
+    return ok;
+}
+
+bool isAdminPassword(const char *input) {
+    return strcmp(input, "TEAM16") == 0;
+}
+
+/* ====== METRICS ======
+ * Probes are lock-free so the server's worker threads can record into the
+ * same histograms. Timestamps come from CLOCK_MONOTONIC, which the vDSO
+ * serves without a system call. */
+
+static const char *metricOpNames[METRIC_OP_COUNT] = {
+    "load_user", "save_user", "update_user", "spin", "settle",
+    "history_append", "history_query", "journal_sync", "render",
+    "password_kdf", "checkpoint",
+};
+
+static const char *metricCounterNames[METRIC_COUNTER_COUNT] = {
+    "user_bytes_read", "user_bytes_written", "journal_bytes_written",
+    "history_bytes_read", "history_bytes_written",
+};
+
+#ifndef ROULETTE_NO_METRICS
+static MetricHistogram metricHistograms[METRIC_OP_COUNT];
+static uint64_t metricCounters[METRIC_COUNTER_COUNT];
+static uint64_t metricsStarted;
+
+uint64_t metricsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int metricBucket(uint64_t value) {
+    if (value < (1u << METRIC_SUB_BUCKET_BITS)) return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - METRIC_SUB_BUCKET_BITS;
+    return ((shift + 1) << METRIC_SUB_BUCKET_BITS) + (int)((value >> shift) & ((1u << METRIC_SUB_BUCKET_BITS) - 1));
+}
+
+// Largest value that lands in a bucket, which is what percentiles report.
+static uint64_t metricBucketCeiling(int bucket) {
+    int group = bucket >> METRIC_SUB_BUCKET_BITS;
+    uint64_t sub = bucket & ((1u << METRIC_SUB_BUCKET_BITS) - 1);
+    if (group == 0) return sub;
+    int shift = group - 1;
+    return (((1u << METRIC_SUB_BUCKET_BITS) + sub + 1) << shift) - 1;
+}
+
+void metricsRecord(MetricOp op, uint64_t nanos) {
+    MetricHistogram *h = &metricHistograms[op];
+    __atomic_fetch_add(&h->buckets[metricBucket(nanos)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, nanos, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (nanos > max && !__atomic_compare_exchange_n(&h->max, &max, nanos, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void metricsAdd(MetricCounter counter, uint64_t amount) {
+    __atomic_fetch_add(&metricCounters[counter], amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t metricPercentile(const MetricHistogram *h, uint64_t count, double percentile) {
+    uint64_t rank = (uint64_t)ceil(count * percentile / 100.0), seen = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t ceiling = metricBucketCeiling(b);
+            return ceiling < h->max ? ceiling : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void formatNanos(uint64_t nanos, char *buf, size_t size) {
+    if (nanos < 1000) snprintf(buf, size, "%lluns", (unsigned long long)nanos);
+    else if (nanos < 1000000) snprintf(buf, size, "%.1fus", nanos / 1e3);
+    else if (nanos < 1000000000) snprintf(buf, size, "%.1fms", nanos / 1e6);
+    else snprintf(buf, size, "%.2fs", nanos / 1e9);
+}
+
+void metricsReport(FILE *out) {
+    if (!metricsStarted) metricsStarted = metricsNow();
+    double uptime = (metricsNow() - metricsStarted) / 1e9;
+
+    fprintf(out, BOLD CYAN "\n====== Metrics (%.1fs) ======\n" RESET, uptime);
+    fprintf(out, YELLOW "%-15s %9s %9s %9s %9s %9s %9s %9s %10s\n" RESET,
+            "operation", "count", "p50", "p90", "p99", "p99.9", "max", "mean", "ops/s");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        const MetricHistogram *h = &metricHistograms[op];
+        uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        if (count == 0) continue;
+
+        const double percentiles[] = { 50, 90, 99, 99.9 };
+        char cells[6][16];
+        for (int i = 0; i < 4; i++) {
+            formatNanos(metricPercentile(h, count, percentiles[i]), cells[i], sizeof(cells[i]));
+        }
+        formatNanos(__atomic_load_n(&h->max, __ATOMIC_RELAXED), cells[4], sizeof(cells[4]));
+        formatNanos(__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count, cells[5], sizeof(cells[5]));
+        fprintf(out, WHITE "%-15s %9llu %9s %9s %9s %9s %9s %9s %10.1f\n" RESET, metricOpNames[op],
+                (unsigned long long)count, cells[0], cells[1], cells[2], cells[3], cells[4], cells[5],
+                uptime > 0 ? count / uptime : 0.0);
+    }
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+        fprintf(out, WHITE "%-22s %12llu\n" RESET, metricCounterNames[c],
+                (unsigned long long)__atomic_load_n(&metricCounters[c], __ATOMIC_RELAXED));
+    }
+}
+
+static void metricsReportAtExit(void) {
+    metricsReport(stderr);
+}
+
+void metricsInit(bool reportAtExit) {
+    metricsStarted = metricsNow();
+    if (reportAtExit) atexit(metricsReportAtExit);
+}
+#else
+void metricsInit(bool reportAtExit) {
+    (void)metricOpNames;
+    (void)metricCounterNames;
+    if (reportAtExit) metricsReport(stderr);
+}
+
+void metricsReport(FILE *out) {
+    fprintf(out, YELLOW "Metrics were compiled out (ROULETTE_NO_METRICS).\n" RESET);
+}
+#endif
+
+/* ====== USER STORE ======
+ * users.txt is read once into memory. Lookups go through a hash index keyed
+ * by username, and a changed user is written back by overwriting only its
+ * own fixed-width row instead of rewriting the whole file.
+ *
+ * Several processes may share the file. Each row carries a version number
+ * and is updated under an advisory lock on just that row's bytes, so
+ * updates to different users never wait for each other. An update compares
+ * the row's version with the one it was based on; if another process got
+ * there first, the change is replayed on top of the newer row instead of
+ * overwriting it. The locks are open-file-description locks, so closing some
+ * other descriptor for the file does not drop them. */
+
+static unsigned int hashUsername(const char *username) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*username) {
+        h ^= (unsigned char)*username++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Caller holds userStore.indexLock, or is the only thread.
+static UserRecord *userStoreSlot(int id) {
+    return &userStore.chunks[id / USER_CHUNK_SIZE][id % USER_CHUNK_SIZE];
+}
+
+/* Records never move once appended, but the chunk table does, so it is read
+ * under the index lock; the returned pointer stays valid after it is dropped. */
+UserRecord *userStoreAt(int id) {
+    pthread_rwlock_rdlock(&userStore.indexLock);
+    UserRecord *rec = userStoreSlot(id);
+    pthread_rwlock_unlock(&userStore.indexLock);
+    return rec;
+}
+
+static void userStoreIndexInsert(int id) {
+    unsigned int mask = userStore.indexCapacity - 1;
+    unsigned int slot = hashUsername(userStoreSlot(id)->user.username) & mask;
+    while (userStore.index[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    userStore.index[slot] = id;
+}
+
+static void userStoreGrowIndex(void) {
+    free(userStore.index);
+    userStore.indexCapacity = userStore.indexCapacity ? userStore.indexCapacity * 2 : USER_INDEX_MIN_CAPACITY;
+    userStore.index = xmalloc(userStore.indexCapacity * sizeof(int));
+    memset(userStore.index, -1, userStore.indexCapacity * sizeof(int));
+    for (int i = 0; i < userStore.count; i++) {
+        userStoreIndexInsert(i);
+    }
+}
+
+/* An append holds the index lock for writing, so lookups on other threads
+ * never see the chunk table or the index halfway through a reallocation. */
+static UserRecord *userStoreAppend(const User *user, long offset) {
+    pthread_rwlock_wrlock(&userStore.indexLock);
+    if (userStore.count == userStore.chunkCount * USER_CHUNK_SIZE) {
+        userStore.chunks = xrealloc(userStore.chunks, (userStore.chunkCount + 1) * sizeof(UserRecord *));
+        userStore.chunks[userStore.chunkCount++] = xmalloc(USER_CHUNK_SIZE * sizeof(UserRecord));
+    }
+    // Keep the index at most 70% full so probe chains stay short.
+    if ((userStore.count + 1) * 10 > userStore.indexCapacity * 7) {
+        userStoreGrowIndex();
+    }
+
+    int id = userStore.count++;
+    UserRecord *rec = userStoreSlot(id);
+    rec->user = *user;
+    rec->id = id;
+    rec->offset = offset;
+    rec->version = 0;
+    rec->deleted = false;
+    rec->online = false;
+    rec->session = NULL;
+    rec->boardRanked = 0;
+    rec->loginFailures = 0;
+    rec->loginRetryAt = 0;
+    userStoreIndexInsert(id);
+    pthread_rwlock_unlock(&userStore.indexLock);
+    return rec;
+}
+
+/* Take in a row found on disk and note where it lives. If we were in the
+ * middle of adding the same username ourselves, the row on disk won the race
+ * and replaces our copy. Users we already know keep their in-memory state. */
+static void userStoreAdoptRow(const User *disk, uint32_t version, long offset) {
+    UserRecord *rec = userStoreFind(disk->username);
+    if (rec && rec->offset >= 0 && rec->offset != offset) {
+        // A second row for the name: the first was deleted and the name registered again.
+        rec->deleted = true;
+        rec->offset = -1;
+        leaderboardUpdate(rec);
+        rec = NULL;
+    }
+    if (!rec) {
+        rec = userStoreAppend(disk, offset);
+        rec->version = version;
+    } else if (rec->offset == -1) { // Pending registration: the other process got the name first.
+        rec->user = *disk;
+        rec->version = version;
+    }
+    rec->offset = offset;
+    leaderboardUpdate(rec);
+}
+
+/* Before re-reading a whole user file, mark every written record missing;
+ * userStoreAdoptRow clears the mark for each row still present, and
+ * userStoreSweepMissing then treats the rest as deleted. */
+#define USER_OFFSET_MISSING (-2L)
+
+static void userStoreMarkMissing(void) {
+    for (int i = 0; i < userStore.count; i++) {
+        UserRecord *rec = userStoreAt(i);
+        if (rec->offset >= 0) rec->offset = USER_OFFSET_MISSING;
+    }
+}
+
+static void userStoreSweepMissing(void) {
+    for (int i = 0; i < userStore.count; i++) {
+        UserRecord *rec = userStoreAt(i);
+        if (rec->offset == USER_OFFSET_MISSING) {
+            rec->offset = -1;
+            rec->deleted = true;
+            leaderboardUpdate(rec);
+        }
+    }
+}
+
+static void userStoreReplayJournal(void);
+static bool userStoreOpenJournal(void);
+static bool userStoreWriteSnapshot(void);
+static int userStoreOpenBinary(void);
+static UserFileHeader *binaryHeader(void);
+static bool binaryReadRecord(UserRecord *rec, User *out, uint32_t *version);
+static void binaryCommit(UserRecord *rec, User *user);
+static bool binaryAppend(UserRecord *rec);
+static void binaryLoadTailLocked(void);
+static bool convertTextToBinaryLocked(const char *src, const char *dst);
+
+static bool fileLock(int fd, short type, off_t start, off_t len) {
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET, .l_start = start, .l_len = len };
+    while (fcntl(fd, F_OFD_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            perror(RED "Error locking file" RESET);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fileUnlock(int fd, off_t start, off_t len) {
+    struct flock fl = { .l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = start, .l_len = len };
+    fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+// Older rows lack the version and last-active columns, which then read as 0.
+static bool parseUserRow(const char *line, User *user, uint32_t *version) {
+    int adminFlag;
+    unsigned int rowVersion = 0;
+    long long lastActive = 0;
+    if (sscanf(line, "%49s %99s %d %d %d %d %d %u %lld", user->username, user->password,
+               &user->balance, &user->games_played, &user->games_won,
+               &user->highest_win, &adminFlag, &rowVersion, &lastActive) < 7) {
+        return false;
+    }
+    user->isAdmin = (adminFlag == 1);
+    user->last_active = lastActive;
+    if (version) *version = rowVersion;
+    return true;
+}
+
+static void writeUserRow(FILE *file, const User *user, uint32_t version) {
+    fprintf(file, USER_ROW_FORMAT, user->username, user->password,
+            user->balance, user->games_played, user->games_won,
+            user->highest_win, user->isAdmin ? 1 : 0, version, (long long)user->last_active);
+}
+
+static bool readRowAt(int fd, long offset, User *user, uint32_t *version) {
+    char row[USER_ROW_WIDTH + 1];
+    if (pread(fd, row, USER_ROW_WIDTH, offset) != USER_ROW_WIDTH) return false;
+    METRIC_COUNT(METRIC_USER_BYTES_READ, USER_ROW_WIDTH);
+    row[USER_ROW_WIDTH] = '\0';
+    memset(user, 0, sizeof(User));
+    return parseUserRow(row, user, version);
+}
+
+static bool writeRowAt(int fd, long offset, const User *user, uint32_t version) {
+    char row[USER_ROW_WIDTH + 1];
+    snprintf(row, sizeof(row), USER_ROW_FORMAT, user->username, user->password,
+             user->balance, user->games_played, user->games_won,
+             user->highest_win, user->isAdmin ? 1 : 0, version, (long long)user->last_active);
+    if (pwrite(fd, row, USER_ROW_WIDTH, offset) != USER_ROW_WIDTH) {
+        perror(RED "Error writing user record" RESET);
+        return false;
+    }
+    METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, USER_ROW_WIDTH);
+    return true;
+}
+
+// True once another process has swapped a new snapshot in under FILENAME.
+static bool pathReplaced(const char *path, int fd) {
+    struct stat onDisk, opened;
+    return stat(path, &onDisk) == 0 && fstat(fd, &opened) == 0 &&
+           (onDisk.st_ino != opened.st_ino || onDisk.st_dev != opened.st_dev);
+}
+
+static bool userFileReplaced(FILE *file) {
+    return pathReplaced(FILENAME, fileno(file));
+}
+
+// Load rows appended since textEnd. Caller holds userStore.lock and a lock from textEnd on.
+static void userStoreLoadTailLocked(int fd) {
+    User disk;
+    uint32_t version;
+    char row[USER_ROW_WIDTH + 1];
+    while (pread(fd, row, USER_ROW_WIDTH, userStore.textEnd) == USER_ROW_WIDTH) {
+        METRIC_COUNT(METRIC_USER_BYTES_READ, USER_ROW_WIDTH);
+        row[USER_ROW_WIDTH] = '\0';
+        memset(&disk, 0, sizeof(User));
+        if (parseUserRow(row, &disk, &version)) {
+            userStoreAdoptRow(&disk, version, userStore.textEnd);
+        }
+        userStore.textEnd += USER_ROW_WIDTH;
+    }
+}
+
+/* Reopen FILENAME after another process replaced it and note where each row
+ * now lives; users whose rows are gone were deleted. In-memory users are left
+ * alone: they are the base that pending updates are compared against. The
+ * stale FILE stays open until exit since other threads may still hold its
+ * descriptor. Caller holds userStore.lock. */
+static bool userStoreFollowFileLocked(FILE *stale) {
+    if (userStore.file != stale) return true; // Another thread already followed it.
+
+    FILE *file = fopen(FILENAME, "r+");
+    if (!file) {
+        perror(RED "Error reopening user file" RESET);
+        return false;
+    }
+    if (!fileLock(fileno(file), F_RDLCK, 0, 0)) {
+        fclose(file);
+        return false;
+    }
+    userStoreMarkMissing();
+    userStore.textEnd = 0;
+    userStoreLoadTailLocked(fileno(file));
+    userStoreSweepMissing();
+    fileUnlock(fileno(file), 0, 0);
+
+    userStore.retired = xrealloc(userStore.retired, (userStore.retiredCount + 1) * sizeof(FILE *));
+    userStore.retired[userStore.retiredCount++] = stale;
+    userStore.file = file;
+    return true;
+}
+
+/* Lock one row, following FILENAME if it was replaced before we got the
+ * lock. Returns the descriptor holding the lock, or -1, also when the user
+ * turns out to have been deleted. */
+static int userStoreLockRow(UserRecord *rec, short type) {
+    while (1) {
+        if (rec->deleted) return -1;
+        FILE *file = userStore.file;
+        int fd = fileno(file);
+        long offset = rec->offset;
+        if (!fileLock(fd, type, offset, USER_ROW_WIDTH)) return -1;
+        if (!userFileReplaced(file)) return fd;
+
+        fileUnlock(fd, offset, USER_ROW_WIDTH);
+        pthread_mutex_lock(&userStore.lock);
+        bool followed = userStoreFollowFileLocked(file);
+        pthread_mutex_unlock(&userStore.lock);
+        if (!followed) return -1;
+    }
+}
+
+/* Lock the end of FILENAME, where new rows go, and load rows other processes
+ * appended. Two such locks always overlap, so appends are serialized across
+ * processes. Caller holds userStore.lock. Returns the descriptor, or -1. */
+static int userStoreLockTailLocked(short type, long *lockedFrom) {
+    while (1) {
+        FILE *file = userStore.file;
+        int fd = fileno(file);
+        *lockedFrom = userStore.textEnd;
+        if (!fileLock(fd, type, *lockedFrom, 0)) return -1;
+        if (!userFileReplaced(file)) {
+            userStoreLoadTailLocked(fd);
+            return fd;
+        }
+        fileUnlock(fd, *lockedFrom, 0);
+        if (!userStoreFollowFileLocked(file)) return -1;
+    }
+}
+
+/* Journal mode keeps recent changes in memory only, so it must be the sole
+ * writer: a snapshot it writes would drop rows other instances changed in
+ * place. Every other instance holds a shared lock on JOURNAL_FILENAME for as
+ * long as it runs, and a journal-mode instance needs an exclusive one, so
+ * whichever starts second refuses. */
+static bool userStoreGuardJournal(void) {
+    userStore.journalGuardFd = open(JOURNAL_FILENAME, O_RDONLY | O_CREAT, 0644);
+    if (userStore.journalGuardFd < 0) {
+        perror(RED "Error opening user journal" RESET);
+        return false;
+    }
+    struct flock fl = { .l_type = F_RDLCK, .l_whence = SEEK_SET };
+    if (fcntl(userStore.journalGuardFd, F_OFD_SETLK, &fl) != 0) {
+        printf(RED BOLD "A --journal instance is using the user files; stop it first!\n" RESET);
+        return false;
+    }
+    return true;
+}
+
+int userStoreOpen(void) {
+    if (userStore.loaded) return 1;
+
+    userStoreGrowIndex();
+    userStore.loaded = true;
+    userStore.journalFd = -1;
+    userStore.journalGuardFd = -1;
+    userStore.binaryFd = -1;
+    pthread_mutex_init(&userStore.lock, NULL);
+    pthread_rwlock_init(&userStore.indexLock, NULL);
+
+    if (!userStore.journalMode && !userStoreGuardJournal()) {
+        return 0;
+    }
+    if (userStore.binaryMode) {
+        return userStoreOpenBinary();
+    }
+
+    // Load under a whole-file lock so no row changes mid-read and a legacy
+    // file is migrated by exactly one process.
+    while (1) {
+        int fd = open(FILENAME, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || !(userStore.file = fdopen(fd, "r+"))) {
+            perror(RED "Error opening user file" RESET);
+            return 0;
+        }
+        if (!fileLock(fd, F_WRLCK, 0, 0)) return 0;
+        if (!userFileReplaced(userStore.file)) break;
+        fclose(userStore.file);
+    }
+
+    char line[USER_LINE_MAX];
+    long offset = ftell(userStore.file);
+    while (fgets(line, sizeof(line), userStore.file)) {
+        User temp;
+        uint32_t version;
+        memset(&temp, 0, sizeof(User));
+        if (parseUserRow(line, &temp, &version)) {
+            if (userStoreFind(temp.username)) {
+                userStore.needsRewrite = true; // Duplicate row: the first one wins, as before.
+            } else {
+                userStoreAppend(&temp, offset)->version = version;
+            }
+            if (strlen(line) != USER_ROW_WIDTH) {
+                userStore.needsRewrite = true;
+            }
+        }
+        offset = ftell(userStore.file);
+    }
+    userStore.textEnd = offset;
+    METRIC_COUNT(METRIC_USER_BYTES_READ, offset);
+    if (userStore.needsRewrite) {
+        userStoreWriteSnapshot();
+    }
+    fileUnlock(fileno(userStore.file), 0, 0);
+
+    // A journal left behind by a crashed journal-mode run is replayed either way.
+    userStoreReplayJournal();
+
+    if (userStore.journalMode) {
+        // Fails while any other instance runs, see userStoreGuardJournal.
+        struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+        if ((userStore.journalFd < 0 && !userStoreOpenJournal()) ||
+            fcntl(userStore.journalFd, F_OFD_SETLK, &fl) != 0) {
+            printf(RED BOLD "Another instance is using the user files; --journal must be the only one!\n" RESET);
+            return 0;
+        }
+        checkpointStart();
+    }
+    return 1;
+}
+
+void userStoreClose(void) {
+    checkpointStop();
+    if (userStore.journalMode && userStore.loaded) {
+        userStoreCompact();
+    }
+    if (userStore.journalFd >= 0) {
+        close(userStore.journalFd);
+    }
+    if (userStore.journalGuardFd >= 0) {
+        close(userStore.journalGuardFd);
+    }
+    if (userStore.binaryMap) {
+        msync(userStore.binaryMap, sizeof(UserFileHeader) + (size_t)binaryHeader()->capacity * sizeof(UserFileRecord), MS_SYNC);
+        munmap(userStore.binaryMap, userStore.binaryMapSize);
+    }
+    if (userStore.binaryFd >= 0) {
+        close(userStore.binaryFd);
+    }
+    if (userStore.file) {
+        fclose(userStore.file);
+        userStore.file = NULL;
+    }
+    for (int i = 0; i < userStore.retiredCount; i++) {
+        fclose(userStore.retired[i]);
+    }
+    leaderboardClose(); // Before the records its boards point at are freed.
+    free(userStore.retired);
+    for (int i = 0; i < userStore.chunkCount; i++) {
+        free(userStore.chunks[i]);
+    }
+    free(userStore.chunks);
+    free(userStore.index);
+    pthread_rwlock_destroy(&userStore.indexLock);
+    pthread_mutex_destroy(&userStore.lock);
+    memset(&userStore, 0, sizeof(UserStore));
+}
+
+UserRecord *userStoreFind(const char *username) {
+    if (!userStore.loaded) userStoreOpen();
+
+    UserRecord *found = NULL;
+    pthread_rwlock_rdlock(&userStore.indexLock);
+    unsigned int mask = userStore.indexCapacity - 1;
+    unsigned int slot = hashUsername(username) & mask;
+    while (userStore.index[slot] != -1) {
+        UserRecord *rec = userStoreSlot(userStore.index[slot]);
+        if (!rec->deleted && strcmp(rec->user.username, username) == 0) {
+            found = rec;
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    pthread_rwlock_unlock(&userStore.indexLock);
+    return found;
+}
+
+UserRecord *userStoreInsert(const User *user) {
+    if (!userStore.loaded) userStoreOpen();
+    // The checkpoint thread reads the chunks under the lock.
+    pthread_mutex_lock(&userStore.lock);
+    UserRecord *rec = userStoreAppend(user, -1);
+    pthread_mutex_unlock(&userStore.lock);
+    return rec;
+}
+
+// Make renames into the current directory survive a crash.
+static bool syncDirectory(void) {
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+/* Point userStore.file at the file just renamed over FILENAME, closing the
+ * old one, which drops its lock. If the new file cannot be opened the old
+ * handle is kept and unlocked; the next row lock sees the rename and follows
+ * it then. */
+static bool userStoreReopenFile(void) {
+    FILE *file = fopen(FILENAME, "r+");
+    if (!file) {
+        perror(RED "Error reopening user file" RESET);
+        if (userStore.file) fileUnlock(fileno(userStore.file), 0, 0);
+        return false;
+    }
+    if (userStore.file) fclose(userStore.file);
+    userStore.file = file;
+    return true;
+}
+
+/* Write every record to a fresh fixed-width snapshot and swap it in. Used for
+ * the one-time migration of legacy files and for journal compaction. The old
+ * file stays locked until it is closed, so other processes see the rename
+ * before they can touch a row again. */
+static bool userStoreWriteSnapshot(void) {
+    if (userStore.file && !fileLock(fileno(userStore.file), F_WRLCK, 0, 0)) return false;
+
+    FILE *file = fopen(FILENAME ".tmp", "w");
+    if (!file) {
+        perror(RED "Error opening user file for rewrite" RESET);
+        return false;
+    }
+    long rows = 0;
+    for (int i = 0; i < userStore.count; i++) {
+        if (!userStoreAt(i)->deleted) {
+            writeUserRow(file, &userStoreAt(i)->user, userStoreAt(i)->version);
+        }
+    }
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        perror(RED "Error writing user snapshot" RESET);
+        fclose(file);
+        return false;
+    }
+    if (fclose(file) != 0 || rename(FILENAME ".tmp", FILENAME) != 0) {
+        perror(RED "Error replacing user file" RESET);
+        return false;
+    }
+    syncDirectory();
+
+    for (int i = 0; i < userStore.count; i++) {
+        if (!userStoreAt(i)->deleted) {
+            userStoreAt(i)->offset = rows++ * USER_ROW_WIDTH;
+        }
+    }
+    userStore.textEnd = rows * USER_ROW_WIDTH;
+    METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, userStore.textEnd);
+    userStore.needsRewrite = false;
+    return userStoreReopenFile();
+}
+
+/* ====== USER JOURNAL ======
+ * In journal mode every change is appended to JOURNAL_FILENAME as one full
+ * user row followed by a checksum, and fsync'd in groups. The snapshot in
+ * FILENAME is only rewritten when the journal is compacted. Rows hold the
+ * whole user state, so replaying a record twice is harmless. */
+
+static unsigned int journalChecksum(const char *data, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int userStoreReplayJournalFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    // A journal-mode instance that is still running owns its journal.
+    struct flock fl = { .l_type = F_RDLCK, .l_whence = SEEK_SET };
+    FILE *file = fcntl(fd, F_OFD_SETLK, &fl) == 0 ? fdopen(fd, "r") : NULL;
+    if (!file) {
+        close(fd);
+        return 0;
+    }
+
+    char line[USER_LINE_MAX];
+    int replayed = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // A record is "<row> #<checksum>\n"; a torn or damaged tail is skipped.
+        char *mark = strrchr(line, '#');
+        unsigned int sum;
+        if (!mark || line[strlen(line) - 1] != '\n' || sscanf(mark + 1, "%x", &sum) != 1 ||
+            sum != journalChecksum(line, mark - line)) {
+            continue;
+        }
+
+        User temp;
+        uint32_t version;
+        memset(&temp, 0, sizeof(User));
+        if (!parseUserRow(line, &temp, &version)) continue;
+
+        UserRecord *rec = userStoreFind(temp.username);
+        if (!rec) {
+            rec = userStoreAppend(&temp, -1);
+        }
+        rec->user = temp;
+        rec->version = version ? version : rec->version + 1; // Older records carry no version.
+        replayed++;
+    }
+    fclose(file);
+    return replayed;
+}
+
+/* A checkpoint that did not finish leaves the journal it was replacing
+ * behind; its records are older than the current journal's. */
+static void userStoreReplayJournal(void) {
+    int replayed = userStoreReplayJournalFile(JOURNAL_OLD_FILENAME);
+    replayed += userStoreReplayJournalFile(JOURNAL_FILENAME);
+    if (replayed > 0) {
+        // Fold what was replayed into the snapshot so the journal starts empty.
+        userStoreCompact();
+    }
+}
+
+static bool userStoreOpenJournal(void) {
+    userStore.journalFd = open(JOURNAL_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (userStore.journalFd < 0) {
+        perror(RED "Error opening user journal" RESET);
+        return false;
+    }
+    userStore.journalBytes = lseek(userStore.journalFd, 0, SEEK_END);
+    userStore.journalLastSync = time(NULL);
+    return true;
+}
+
+static void journalSyncLocked(void) {
+    if (userStore.journalFd >= 0 && userStore.journalPending > 0) {
+        METRIC_BEGIN(start);
+        fdatasync(userStore.journalFd);
+        METRIC_END(METRIC_JOURNAL_SYNC, start);
+        userStore.journalPending = 0;
+        userStore.journalLastSync = time(NULL);
+    }
+}
+
+/* Write a snapshot of the whole table in the caller's thread. Only for
+ * shutdown, startup and bulk operations: the spin path leaves this to the
+ * checkpoint thread. The caller holds checkpointer.writing. */
+static void journalCompactLocked(void) {
+    journalSyncLocked();
+    // The journal is only cleared once the new snapshot is safely in place.
+    if (!userStoreWriteSnapshot()) return;
+    if (checkpointer.oldJournalFd >= 0) {
+        close(checkpointer.oldJournalFd);
+        checkpointer.oldJournalFd = -1;
+    }
+    unlink(JOURNAL_OLD_FILENAME);
+
+    // Truncate rather than reopen so the journal lock stays held.
+    if (userStore.journalFd < 0 && !userStoreOpenJournal()) return;
+    if (ftruncate(userStore.journalFd, 0) != 0) {
+        perror(RED "Error truncating user journal" RESET);
+        return;
+    }
+    userStore.journalBytes = 0;
+    userStore.journalPending = 0;
+    fsync(userStore.journalFd);
+}
+
+/* Log rec as a new version. The version bump and the copy of the user are
+ * made under the store lock, so a checkpoint copying the same chunk sees
+ * the record either before or after, never halfway. */
+static void userStoreAppendJournal(UserRecord *rec) {
+    char record[USER_LINE_MAX];
+    pthread_mutex_lock(&userStore.lock);
+    const User *user = &rec->user;
+    uint32_t version = ++rec->version;
+    int len = snprintf(record, sizeof(record), "%s %s %d %d %d %d %d %u %lld ",
+                       user->username, user->password, user->balance,
+                       user->games_played, user->games_won, user->highest_win,
+                       user->isAdmin ? 1 : 0, version, (long long)user->last_active);
+    len += snprintf(record + len, sizeof(record) - len, "#%08x\n", journalChecksum(record, len));
+
+    if (userStore.journalFd < 0 && !userStoreOpenJournal()) {
+        pthread_mutex_unlock(&userStore.lock);
+        return;
+    }
+    if (write(userStore.journalFd, record, len) != len) {
+        perror(RED "Error appending to user journal" RESET);
+    } else {
+        METRIC_COUNT(METRIC_JOURNAL_BYTES_WRITTEN, len);
+        userStore.journalBytes += len;
+        userStore.journalPending++;
+        if (userStore.journalPending >= JOURNAL_GROUP_COMMIT ||
+            difftime(time(NULL), userStore.journalLastSync) >= JOURNAL_GROUP_COMMIT_SECS) {
+            journalSyncLocked();
+        }
+        if (userStore.journalBytes >= JOURNAL_COMPACT_BYTES) {
+            checkpointRequest();
+        }
+    }
+    pthread_mutex_unlock(&userStore.lock);
+}
+
+void userStoreSync(void) {
+    pthread_mutex_lock(&userStore.lock);
+    journalSyncLocked();
+    pthread_mutex_unlock(&userStore.lock);
+}
+
+void userStoreCompact(void) {
+    pthread_mutex_lock(&checkpointer.writing);
+    pthread_mutex_lock(&userStore.lock);
+    journalCompactLocked();
+    pthread_mutex_unlock(&userStore.lock);
+    pthread_mutex_unlock(&checkpointer.writing);
+}
+
+/* Replay a caller's change on top of a row that moved on since the caller
+ * read it: counters move by the caller's delta, the record high is kept, and
+ * password or admin changes apply only if the caller made them. */
+static void userMergeChange(User *disk, const User *base, const User *user) {
+    disk->balance += user->balance - base->balance;
+    disk->games_played += user->games_played - base->games_played;
+    disk->games_won += user->games_won - base->games_won;
+    if (user->highest_win > disk->highest_win) {
+        disk->highest_win = user->highest_win;
+    }
+    if (strcmp(user->password, base->password) != 0) {
+        memcpy(disk->password, user->password, sizeof(disk->password));
+    }
+    if (user->isAdmin != base->isAdmin) {
+        disk->isAdmin = user->isAdmin;
+    }
+    if (user->last_active > disk->last_active) {
+        disk->last_active = user->last_active;
+    }
+}
+
+// Append a row for a user that has none yet. Fails if another process took the name first.
+static bool userStoreAppendRow(UserRecord *rec) {
+    bool added = false;
+    long lockedFrom;
+    pthread_mutex_lock(&userStore.lock);
+    int fd = userStoreLockTailLocked(F_WRLCK, &lockedFrom);
+    if (fd >= 0) {
+        if (rec->offset < 0 && writeRowAt(fd, userStore.textEnd, &rec->user, rec->version)) {
+            rec->offset = userStore.textEnd;
+            userStore.textEnd += USER_ROW_WIDTH;
+            added = true;
+        }
+        fileUnlock(fd, lockedFrom, 0);
+    }
+    pthread_mutex_unlock(&userStore.lock);
+    return added;
+}
+
+/* Write out a record as it stands: append a new user, or log it in journal
+ * mode. Returns false if the username was taken by another process, in
+ * which case rec now holds that process's user. */
+bool userStorePersist(UserRecord *rec) {
+    if (userStore.journalMode) {
+        userStoreAppendJournal(rec);
+        leaderboardUpdate(rec);
+        return true;
+    }
+    if (rec->offset >= 0) {
+        User user = rec->user;
+        userStoreCommit(rec, &user);
+        return true;
+    }
+    bool added = userStore.binaryMode ? binaryAppend(rec) : userStoreAppendRow(rec);
+    leaderboardUpdate(rec);
+    return added;
+}
+
+// The row write behind userStoreCommit.
+static void userStoreCommitRow(UserRecord *rec, User *user) {
+    if (rec->deleted) return;
+    if (userStore.journalMode || rec->offset < 0) {
+        pthread_mutex_lock(&userStore.lock); // a checkpoint may be copying the record
+        rec->user = *user;
+        pthread_mutex_unlock(&userStore.lock);
+        userStorePersist(rec);
+        *user = rec->user;
+        return;
+    }
+    if (userStore.binaryMode) {
+        binaryCommit(rec, user);
+        return;
+    }
+
+    int fd = userStoreLockRow(rec, F_WRLCK);
+    if (fd < 0) return;
+    User disk;
+    uint32_t version;
+    if (readRowAt(fd, rec->offset, &disk, &version) && version != rec->version) {
+        userMergeChange(&disk, &rec->user, user);
+        *user = disk;
+        rec->version = version;
+    }
+    if (writeRowAt(fd, rec->offset, user, rec->version + 1)) {
+        rec->user = *user;
+        rec->version++;
+    }
+    fileUnlock(fd, rec->offset, USER_ROW_WIDTH);
+}
+
+/* Compare-and-swap a user's row: `user` is rec->user with the caller's
+ * changes applied. If the row still has the version rec was read at, it is
+ * simply overwritten; otherwise the change is merged into the newer row.
+ * Either way *user ends up as what was written, and the leaderboards follow. */
+void userStoreCommit(UserRecord *rec, User *user) {
+    userStoreCommitRow(rec, user);
+    leaderboardUpdate(rec);
+}
+
+// Read a user's current row without changing the in-memory copy.
+static bool userStoreReadRowVersion(UserRecord *rec, User *out, uint32_t *version) {
+    if (rec->deleted) return false;
+    if (userStore.journalMode || rec->offset < 0) {
+        *out = rec->user;
+        *version = rec->version;
+        return true;
+    }
+    if (userStore.binaryMode) {
+        return binaryReadRecord(rec, out, version);
+    }
+
+    int fd = userStoreLockRow(rec, F_RDLCK);
+    if (fd < 0) return false;
+    bool ok = readRowAt(fd, rec->offset, out, version);
+    fileUnlock(fd, rec->offset, USER_ROW_WIDTH);
+    return ok;
+}
+
+bool userStoreReadRow(UserRecord *rec, User *out) {
+    uint32_t version;
+    return userStoreReadRowVersion(rec, out, &version);
+}
+
+/* Bring rec up to date with its row. Only call this when no one holds a
+ * copy of the user to commit later, since that copy's base would move. */
+bool userStoreReload(UserRecord *rec) {
+    User user;
+    uint32_t version;
+    bool ok = userStoreReadRowVersion(rec, &user, &version);
+    if (ok) {
+        rec->user = user;
+        rec->version = version;
+    }
+    leaderboardUpdate(rec); // Picks up other processes' changes, or a deletion.
+    return ok;
+}
+
+// Pick up users that other processes registered since we loaded.
+void userStoreRefresh(void) {
+    if (!userStore.loaded) userStoreOpen();
+    if (userStore.journalMode) return;
+
+    pthread_mutex_lock(&userStore.lock);
+    if (userStore.binaryMode) {
+        if (userStore.binaryMap && fileLock(userStore.binaryFd, F_RDLCK, 0, sizeof(UserFileHeader))) {
+            binaryLoadTailLocked();
+            fileUnlock(userStore.binaryFd, 0, sizeof(UserFileHeader));
+        }
+    } else {
+        long lockedFrom;
+        int fd = userStoreLockTailLocked(F_RDLCK, &lockedFrom);
+        if (fd >= 0) fileUnlock(fd, lockedFrom, 0);
+    }
+    pthread_mutex_unlock(&userStore.lock);
+}
+
+/* ====== CHECKPOINTS ======
+ * In journal mode a background thread folds the journal into a new
+ * snapshot every --checkpoint-interval seconds, and as soon as the journal
+ * outgrows JOURNAL_COMPACT_BYTES. A checkpoint runs in four steps:
+ *   1. Under the store lock, hard-link the journal to JOURNAL_OLD_FILENAME
+ *      and rename a fresh one into its place. This is O(1), and later
+ *      changes go to the fresh journal.
+ *   2. Copy the table one chunk at a time, each under the lock for a single
+ *      memcpy, and write it to a temporary file outside the lock.
+ *   3. fsync the file, rename it over FILENAME and fsync the directory.
+ *   4. Delete the old journal.
+ * Chunks are copied at different moments, so the snapshot is fuzzy: a
+ * record may already hold changes that are also in the fresh journal.
+ * Journal records are whole rows, so replaying them again is harmless.
+ * The snapshot plus the fresh journal is always the full state. A crash at
+ * any step leaves the previous snapshot and both journals, which startup
+ * replays oldest first. Spins only ever wait for one chunk copy. */
+
+// Start a new journal; the caller holds userStore.lock.
+static bool journalRotateLocked(void) {
+    if (userStore.journalFd < 0 && !userStoreOpenJournal()) return false;
+    int fd = open(JOURNAL_FILENAME ".next", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (fd < 0 || fcntl(fd, F_OFD_SETLK, &fl) != 0) {
+        perror(RED "Error starting a new user journal" RESET);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    // JOURNAL_FILENAME always names a journal we hold locked, so no other instance can take over.
+    unlink(JOURNAL_OLD_FILENAME);
+    if (link(JOURNAL_FILENAME, JOURNAL_OLD_FILENAME) != 0 || rename(JOURNAL_FILENAME ".next", JOURNAL_FILENAME) != 0) {
+        perror(RED "Error starting a new user journal" RESET);
+        unlink(JOURNAL_FILENAME ".next");
+        close(fd);
+        return false;
+    }
+    syncDirectory();
+    checkpointer.oldJournalFd = userStore.journalFd;
+    userStore.journalFd = fd;
+    userStore.journalBytes = 0;
+    userStore.journalPending = 0;
+    return true;
+}
+
+static bool checkpointRun(void) {
+    pthread_mutex_lock(&checkpointer.writing);
+    pthread_mutex_lock(&userStore.lock);
+    if (userStore.journalBytes == 0 && checkpointer.oldJournalFd < 0) {
+        // Nothing changed since the last snapshot.
+        pthread_mutex_unlock(&userStore.lock);
+        pthread_mutex_unlock(&checkpointer.writing);
+        return true;
+    }
+    METRIC_BEGIN(start);
+    journalSyncLocked();
+    // After a failed checkpoint the old journal is still waiting; the fresh one covers the retry.
+    bool ok = checkpointer.oldJournalFd >= 0 || journalRotateLocked();
+    int count = userStore.count;
+    pthread_mutex_unlock(&userStore.lock);
+
+    FILE *file = ok ? fopen(FILENAME ".tmp", "w") : NULL;
+    if (ok && !file) {
+        perror(RED "Error opening user checkpoint" RESET);
+        ok = false;
+    }
+    if (file) {
+        setvbuf(file, NULL, _IOFBF, 1 << 20);
+        UserRecord *copy = xmalloc(USER_CHUNK_SIZE * sizeof(UserRecord));
+        for (int first = 0; first < count; first += USER_CHUNK_SIZE) {
+            int n = count - first < USER_CHUNK_SIZE ? count - first : USER_CHUNK_SIZE;
+            pthread_mutex_lock(&userStore.lock);
+            memcpy(copy, userStore.chunks[first / USER_CHUNK_SIZE], n * sizeof(UserRecord));
+            pthread_mutex_unlock(&userStore.lock);
+            for (int i = 0; i < n; i++) {
+                if (!copy[i].deleted) writeUserRow(file, &copy[i].user, copy[i].version);
+            }
+        }
+        free(copy);
+        METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, ftell(file));
+        if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+            perror(RED "Error writing user checkpoint" RESET);
+            ok = false;
+        }
+        if (fclose(file) != 0) ok = false;
+    }
+
+    if (ok) {
+        // As with a snapshot, the old file stays locked until it is closed.
+        pthread_mutex_lock(&userStore.lock);
+        if (userStore.file && !fileLock(fileno(userStore.file), F_WRLCK, 0, 0)) ok = false;
+        if (ok && rename(FILENAME ".tmp", FILENAME) != 0) {
+            perror(RED "Error replacing user file" RESET);
+            ok = false;
+        }
+        if (ok) {
+            syncDirectory();
+            // Journal mode never writes rows in place, so row offsets need no update.
+            userStoreReopenFile();
+            close(checkpointer.oldJournalFd);
+            checkpointer.oldJournalFd = -1;
+            unlink(JOURNAL_OLD_FILENAME);
+        } else if (userStore.file) {
+            fileUnlock(fileno(userStore.file), 0, 0);
+        }
+        pthread_mutex_unlock(&userStore.lock);
+    }
+    if (!ok) unlink(FILENAME ".tmp");
+    METRIC_END(METRIC_CHECKPOINT, start);
+    pthread_mutex_unlock(&checkpointer.writing);
+    return ok;
+}
+
+static void *checkpointLoop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&checkpointer.lock);
+    while (!checkpointer.stopping) {
+        if (!checkpointer.requested) {
+            if (checkpointer.interval > 0) {
+                struct timespec due = { .tv_sec = checkpointer.last + checkpointer.interval };
+                pthread_cond_timedwait(&checkpointer.wake, &checkpointer.lock, &due);
+            } else {
+                pthread_cond_wait(&checkpointer.wake, &checkpointer.lock);
+            }
+        }
+        if (checkpointer.stopping) break;
+        time_t now = time(NULL);
+        if (!checkpointer.requested && (checkpointer.interval <= 0 || now < checkpointer.last + checkpointer.interval)) {
+            continue;
+        }
+        checkpointer.requested = false;
+        checkpointer.last = now;
+        pthread_mutex_unlock(&checkpointer.lock);
+        checkpointRun();
+        pthread_mutex_lock(&checkpointer.lock);
+    }
+    pthread_mutex_unlock(&checkpointer.lock);
+    return NULL;
+}
+
+void checkpointStart(void) {
+    pthread_mutex_lock(&checkpointer.lock);
+    if (!checkpointer.running) {
+        checkpointer.stopping = false;
+        checkpointer.requested = false;
+        checkpointer.last = time(NULL);
+        if (pthread_create(&checkpointer.thread, NULL, checkpointLoop, NULL) != 0) {
+            perror(RED "Error starting checkpoint thread" RESET);
+            exit(1);
+        }
+        checkpointer.running = true;
+    }
+    pthread_mutex_unlock(&checkpointer.lock);
+}
+
+// Waits for a checkpoint in progress to finish.
+void checkpointStop(void) {
+    pthread_mutex_lock(&checkpointer.lock);
+    bool running = checkpointer.running;
+    checkpointer.stopping = true;
+    checkpointer.running = false;
+    pthread_cond_signal(&checkpointer.wake);
+    pthread_mutex_unlock(&checkpointer.lock);
+    if (running) pthread_join(checkpointer.thread, NULL);
+}
+
+/* Ask for a checkpoint now. Called with userStore.lock held, so this never
+ * writes one itself: without the thread (stopping or not yet started) the
+ * journal keeps growing until userStoreClose or the next start compacts it. */
+void checkpointRequest(void) {
+    pthread_mutex_lock(&checkpointer.lock);
+    checkpointer.requested = true;
+    pthread_cond_signal(&checkpointer.wake);
+    pthread_mutex_unlock(&checkpointer.lock);
+}
+
+/* ====== BINARY USER FILE ======
+ * Records are locked individually just like text rows; the header's bytes
+ * double as the lock for appending a record. */
+
+static void userToFileRecord(const User *user, uint32_t version, UserFileRecord *out) {
+    memset(out, 0, sizeof(UserFileRecord));
+    out->balance = user->balance;
+    out->games_played = user->games_played;
+    out->games_won = user->games_won;
+    out->highest_win = user->highest_win;
+    out->flags = user->isAdmin ? USER_FLAG_ADMIN : 0;
+    out->version = version;
+    out->last_active = user->last_active;
+    strncpy(out->username, user->username, sizeof(out->username));
+    strncpy(out->password, user->password, sizeof(out->password));
+}
+
+static void fileRecordToUser(const UserFileRecord *rec, User *out) {
+    memset(out, 0, sizeof(User));
+    out->balance = rec->balance;
+    out->games_played = rec->games_played;
+    out->games_won = rec->games_won;
+    out->highest_win = rec->highest_win;
+    out->isAdmin = (rec->flags & USER_FLAG_ADMIN) != 0;
+    out->last_active = rec->last_active;
+    memcpy(out->username, rec->username, sizeof(out->username) - 1);
+    memcpy(out->password, rec->password, sizeof(out->password) - 1);
+}
+
+static bool validFileHeader(const UserFileHeader *header) {
+    return memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == BINARY_VERSION &&
+           header->recordSize == sizeof(UserFileRecord) &&
+           header->count <= header->capacity;
+}
+
+static UserFileHeader *binaryHeader(void) {
+    return (UserFileHeader *)userStore.binaryMap;
+}
+
+static UserFileRecord *binaryRecord(long index) {
+    return (UserFileRecord *)(userStore.binaryMap + sizeof(UserFileHeader)) + index;
+}
+
+static off_t binaryRecordOffset(long index) {
+    return sizeof(UserFileHeader) + (off_t)index * sizeof(UserFileRecord);
+}
+
+/* Size the binary file for `capacity` records. The mapping itself covers
+ * BINARY_MAX_RECORDS from the start, so growing the file never moves records
+ * that other threads may be writing. */
+static bool userStoreMapBinary(uint32_t capacity) {
+    if (capacity > BINARY_MAX_RECORDS) {
+        printf(RED BOLD "Binary user file is full (%u records)!\n" RESET, BINARY_MAX_RECORDS);
+        return false;
+    }
+    size_t size = sizeof(UserFileHeader) + (size_t)capacity * sizeof(UserFileRecord);
+    if (ftruncate(userStore.binaryFd, size) != 0) {
+        perror(RED "Error resizing binary user file" RESET);
+        return false;
+    }
+    if (!userStore.binaryMap) {
+        size_t reserve = sizeof(UserFileHeader) + (size_t)BINARY_MAX_RECORDS * sizeof(UserFileRecord);
+        userStore.binaryMap = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED, userStore.binaryFd, 0);
+        if (userStore.binaryMap == MAP_FAILED) {
+            perror(RED "Error mapping binary user file" RESET);
+            userStore.binaryMap = NULL;
+            return false;
+        }
+        userStore.binaryMapSize = reserve;
+    }
+    binaryHeader()->capacity = capacity;
+    return true;
+}
+
+// Load records appended since binaryCount. Caller holds userStore.lock and the header lock.
+static void binaryLoadTailLocked(void) {
+    while (userStore.binaryCount < binaryHeader()->count) {
+        User disk;
+        UserFileRecord *rec = binaryRecord(userStore.binaryCount);
+        if (!(rec->flags & USER_FLAG_DELETED)) {
+            fileRecordToUser(rec, &disk);
+            userStoreAdoptRow(&disk, rec->version, userStore.binaryCount);
+        }
+        userStore.binaryCount++;
+    }
+}
+
+static int userStoreOpenBinary(void) {
+    // Hold the whole file while sizing and loading it. An empty file was
+    // never set up, so the first run converts the existing text file; other
+    // processes waiting for the lock then open the converted one.
+    struct stat st;
+    UserFileHeader header;
+    while (1) {
+        userStore.binaryFd = open(BINARY_FILENAME, O_RDWR | O_CREAT, 0644);
+        if (userStore.binaryFd < 0) {
+            perror(RED "Error opening binary user file" RESET);
+            return 0;
+        }
+        if (!fileLock(userStore.binaryFd, F_WRLCK, 0, 0)) return 0;
+        if (fstat(userStore.binaryFd, &st) != 0) {
+            perror(RED "Error reading binary user file" RESET);
+            return 0;
+        }
+        if (pathReplaced(BINARY_FILENAME, userStore.binaryFd)) {
+            close(userStore.binaryFd);
+            continue;
+        }
+        if (st.st_size == 0 && access(FILENAME, F_OK) == 0) {
+            bool converted = convertTextToBinaryLocked(FILENAME, BINARY_FILENAME);
+            close(userStore.binaryFd);
+            if (!converted) return 0;
+            continue;
+        }
+        break;
+    }
+
+    int ok = 1;
+    if (st.st_size == 0) {
+        if (userStoreMapBinary(USER_CHUNK_SIZE)) {
+            UserFileHeader *fresh = binaryHeader();
+            memcpy(fresh->magic, BINARY_MAGIC, sizeof(fresh->magic));
+            fresh->version = BINARY_VERSION;
+            fresh->recordSize = sizeof(UserFileRecord);
+            fresh->count = 0;
+        } else {
+            ok = 0;
+        }
+    } else if (st.st_size < (off_t)sizeof(UserFileHeader) ||
+               pread(userStore.binaryFd, &header, sizeof(header), 0) != sizeof(header) ||
+               !validFileHeader(&header) ||
+               st.st_size < (off_t)(sizeof(UserFileHeader) + (size_t)header.capacity * sizeof(UserFileRecord))) {
+        printf(RED BOLD "%s is not a valid user file!\n" RESET, BINARY_FILENAME);
+        ok = 0;
+    } else if (userStoreMapBinary(header.capacity)) {
+        binaryLoadTailLocked();
+    } else {
+        ok = 0;
+    }
+    fileUnlock(userStore.binaryFd, 0, 0);
+    return ok;
+}
+
+static bool binaryReadRecord(UserRecord *rec, User *out, uint32_t *version) {
+    if (!userStore.binaryMap) return false;
+    off_t at = binaryRecordOffset(rec->offset);
+    if (!fileLock(userStore.binaryFd, F_RDLCK, at, sizeof(UserFileRecord))) return false;
+    const UserFileRecord *stored = binaryRecord(rec->offset);
+    rec->deleted = (stored->flags & USER_FLAG_DELETED) != 0;
+    fileRecordToUser(stored, out);
+    *version = stored->version;
+    fileUnlock(userStore.binaryFd, at, sizeof(UserFileRecord));
+    return !rec->deleted;
+}
+
+static void binaryCommit(UserRecord *rec, User *user) {
+    if (!userStore.binaryMap) return;
+    off_t at = binaryRecordOffset(rec->offset);
+    if (!fileLock(userStore.binaryFd, F_WRLCK, at, sizeof(UserFileRecord))) return;
+
+    UserFileRecord *stored = binaryRecord(rec->offset);
+    if (stored->flags & USER_FLAG_DELETED) {
+        rec->deleted = true;
+        fileUnlock(userStore.binaryFd, at, sizeof(UserFileRecord));
+        return;
+    }
+    if (stored->version != rec->version) {
+        User disk;
+        fileRecordToUser(stored, &disk);
+        userMergeChange(&disk, &rec->user, user);
+        *user = disk;
+        rec->version = stored->version;
+    }
+    userToFileRecord(user, rec->version + 1, stored);
+    METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, sizeof(UserFileRecord));
+    rec->user = *user;
+    rec->version++;
+    fileUnlock(userStore.binaryFd, at, sizeof(UserFileRecord));
+}
+
+static bool binaryAppend(UserRecord *rec) {
+    if (!userStore.binaryMap) return false;
+
+    bool added = false;
+    pthread_mutex_lock(&userStore.lock);
+    if (fileLock(userStore.binaryFd, F_WRLCK, 0, sizeof(UserFileHeader))) {
+        binaryLoadTailLocked();
+        UserFileHeader *header = binaryHeader();
+        if (rec->offset < 0 &&
+            (header->count < header->capacity || userStoreMapBinary(header->capacity ? header->capacity * 2 : USER_CHUNK_SIZE))) {
+            rec->offset = header->count;
+            userToFileRecord(&rec->user, rec->version, binaryRecord(rec->offset));
+            METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, sizeof(UserFileRecord));
+            header->count++;
+            userStore.binaryCount++;
+            added = true;
+        }
+        fileUnlock(userStore.binaryFd, 0, sizeof(UserFileHeader));
+    }
+    pthread_mutex_unlock(&userStore.lock);
+    return added;
+}
+
+/* Open path and lock all of it, reopening until the lock is on the file path
+ * names rather than one a rename just replaced. Returns the descriptor, or -1. */
+static int openLockedFile(const char *path, int flags, short type) {
+    while (1) {
+        int fd = open(path, flags, 0644);
+        if (fd < 0) {
+            perror(RED "Error opening user file" RESET);
+            return -1;
+        }
+        if (!fileLock(fd, type, 0, 0)) {
+            close(fd);
+            return -1;
+        }
+        if (!pathReplaced(path, fd)) return fd;
+        close(fd);
+    }
+}
+
+/* Flush, fsync and close a converted file, then rename it over dst unless
+ * the conversion already failed. The caller holds dst's whole-file lock, so
+ * processes waiting on the old file find the rename once they get it. */
+static bool finishConversion(FILE *out, bool ok, const char *tmp, const char *dst) {
+    bool written = !ferror(out) && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    written = fclose(out) == 0 && written;
+    if (ok && (!written || rename(tmp, dst) != 0)) {
+        perror(RED "Error writing converted user file" RESET);
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp);
+        return false;
+    }
+    syncDirectory();
+    return true;
+}
+
+// Caller holds the whole-file lock on dst.
+static bool convertTextToBinaryLocked(const char *src, const char *dst) {
+    int inFd = openLockedFile(src, O_RDONLY, F_RDLCK);
+    FILE *in = inFd >= 0 ? fdopen(inFd, "r") : NULL;
+    if (!in) {
+        if (inFd >= 0) close(inFd);
+        return false;
+    }
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        perror(RED "Error creating binary user file" RESET);
+        fclose(in);
+        return false;
+    }
+
+    UserFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.recordSize = sizeof(UserFileRecord);
+    fwrite(&header, sizeof(header), 1, out);
+
+    char line[USER_LINE_MAX];
+    while (!ferror(out) && fgets(line, sizeof(line), in)) {
+        User user;
+        UserFileRecord rec;
+        uint32_t version;
+        memset(&user, 0, sizeof(User));
+        if (!parseUserRow(line, &user, &version)) continue;
+        userToFileRecord(&user, version, &rec);
+        fwrite(&rec, sizeof(rec), 1, out);
+        header.count++;
+    }
+    bool ok = !ferror(in);
+    if (!ok) perror(RED "Error reading text user file" RESET);
+    fclose(in);
+
+    // The header goes in last, once every record it counts is written.
+    header.capacity = header.count;
+    if (ok && (fflush(out) != 0 || pwrite(fileno(out), &header, sizeof(header), 0) != sizeof(header))) {
+        perror(RED "Error writing binary user file" RESET);
+        ok = false;
+    }
+    return finishConversion(out, ok, tmp, dst);
+}
+
+// Caller holds the whole-file lock on dst.
+static bool convertBinaryToTextLocked(const char *src, const char *dst) {
+    int inFd = openLockedFile(src, O_RDONLY, F_RDLCK);
+    FILE *in = inFd >= 0 ? fdopen(inFd, "rb") : NULL;
+    if (!in) {
+        if (inFd >= 0) close(inFd);
+        return false;
+    }
+
+    UserFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || !validFileHeader(&header)) {
+        printf(RED BOLD "%s is not a valid user file!\n" RESET, src);
+        fclose(in);
+        return false;
+    }
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        perror(RED "Error creating text user file" RESET);
+        fclose(in);
+        return false;
+    }
+
+    bool ok = true;
+    UserFileRecord rec;
+    for (uint32_t i = 0; i < header.count && !ferror(out); i++) {
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            printf(RED BOLD "%s is truncated!\n" RESET, src);
+            ok = false;
+            break;
+        }
+        User user;
+        if (rec.flags & USER_FLAG_DELETED) continue;
+        fileRecordToUser(&rec, &user);
+        writeUserRow(out, &user, rec.version);
+    }
+    fclose(in);
+    return finishConversion(out, ok, tmp, dst);
+}
+
+int convertTextToBinary(const char *src, const char *dst) {
+    int fd = openLockedFile(dst, O_RDWR | O_CREAT, F_WRLCK);
+    if (fd < 0) return 0;
+    bool ok = convertTextToBinaryLocked(src, dst);
+    close(fd);
+    return ok;
+}
+
+int convertBinaryToText(const char *src, const char *dst) {
+    int fd = openLockedFile(dst, O_RDWR | O_CREAT, F_WRLCK);
+    if (fd < 0) return 0;
+    bool ok = convertBinaryToTextLocked(src, dst);
+    close(fd);
+    return ok;
+}
+
+/* ====== BULK ADMIN OPERATIONS ======
+ * Resets, promotions and deletions for many users at once. The text file is
+ * streamed into a new snapshot under one whole-file lock and swapped in with a
+ * single rename; the binary file is updated in place, deletions leaving
+ * tombstones; journal mode changes the records in memory and compacts. */
+
+static int compareUsernames(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+static bool bulkMatches(const BulkFilter *filter, const User *user) {
+    if (filter->nameCount > 0) {
+        return bsearch(user->username, filter->names, filter->nameCount,
+                       sizeof(filter->names[0]), compareUsernames) != NULL;
+    }
+    if (!filter->balanceBelowSet && filter->inactiveBefore == 0) return false;
+    if (filter->balanceBelowSet && user->balance >= filter->balanceBelow) return false;
+    if (filter->inactiveBefore != 0 &&
+        (user->last_active == 0 || user->last_active >= filter->inactiveBefore)) {
+        return false;
+    }
+    return true;
+}
+
+/* Apply the action to one user if the filter selects it. Returns true if the
+ * user changed or, for deletions, should be removed. */
+static bool bulkApplyUser(BulkAction action, const BulkFilter *filter, User *user) {
+    if (!bulkMatches(filter, user)) return false;
+    switch (action) {
+        case BULK_RESET:
+            user->balance = STARTING_BALANCE;
+            return true;
+        case BULK_PROMOTE:
+            if (user->isAdmin) return false;
+            user->isAdmin = 1;
+            return true;
+        case BULK_DELETE:
+            return !filter->keep || strcmp(user->username, filter->keep) != 0;
+    }
+    return false;
+}
+
+// Keep this process's record in step with a row the bulk pass rewrote.
+static void bulkNoteRecord(UserRecord *rec, BulkAction action, const User *user, uint32_t version) {
+    if (!rec) return;
+    if (action == BULK_DELETE) {
+        rec->deleted = true;
+        rec->offset = -1;
+    } else {
+        rec->user = *user;
+        rec->version = version;
+    }
+    leaderboardUpdate(rec);
+}
+
+static int bulkApplyTextLocked(BulkAction action, const BulkFilter *filter) {
+    int fd;
+    while (1) {
+        FILE *file = userStore.file;
+        fd = fileno(file);
+        if (!fileLock(fd, F_WRLCK, 0, 0)) return -1;
+        if (!userFileReplaced(file)) break;
+        fileUnlock(fd, 0, 0);
+        if (!userStoreFollowFileLocked(file)) return -1;
+    }
+    userStoreLoadTailLocked(fd);
+
+    FILE *in = fdopen(dup(fd), "r");
+    FILE *out = fopen(FILENAME ".tmp", "w");
+    if (!in || !out) {
+        perror(RED "Error opening user file for bulk update" RESET);
+        if (in) fclose(in);
+        if (out) fclose(out);
+        fileUnlock(fd, 0, 0);
+        return -1;
+    }
+    setvbuf(in, NULL, _IOFBF, 1 << 16);
+    setvbuf(out, NULL, _IOFBF, 1 << 16);
+    rewind(in); // The duplicate shares userStore.file's position.
+
+    userStoreMarkMissing();
+    int affected = 0;
+    long rows = 0;
+    char line[USER_LINE_MAX];
+    while (fgets(line, sizeof(line), in)) {
+        User user;
+        uint32_t version;
+        memset(&user, 0, sizeof(User));
+        if (!parseUserRow(line, &user, &version)) continue;
+        UserRecord *rec = userStoreFind(user.username);
+
+        if (bulkApplyUser(action, filter, &user)) {
+            affected++;
+            bulkNoteRecord(rec, action, &user, version + 1);
+            if (action == BULK_DELETE) continue;
+            version++;
+        }
+        writeUserRow(out, &user, version);
+        if (rec) rec->offset = rows * USER_ROW_WIDTH;
+        rows++;
+    }
+    METRIC_COUNT(METRIC_USER_BYTES_READ, ftell(in));
+    fclose(in);
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0 ||
+        rename(FILENAME ".tmp", FILENAME) != 0) {
+        perror(RED "Error writing bulk update" RESET);
+        fileUnlock(fd, 0, 0);
+        return -1;
+    }
+    syncDirectory();
+    userStoreSweepMissing();
+    userStore.textEnd = rows * USER_ROW_WIDTH;
+    METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, userStore.textEnd);
+
+    // As with a snapshot, the old file stays locked until it is closed.
+    return userStoreReopenFile() ? affected : -1;
+}
+
+static int bulkApplyBinaryLocked(BulkAction action, const BulkFilter *filter) {
+    if (!userStore.binaryMap || !fileLock(userStore.binaryFd, F_WRLCK, 0, 0)) return -1;
+    binaryLoadTailLocked();
+
+    int affected = 0;
+    for (uint32_t i = 0; i < userStore.binaryCount; i++) {
+        UserFileRecord *stored = binaryRecord(i);
+        if (stored->flags & USER_FLAG_DELETED) continue;
+
+        User user;
+        fileRecordToUser(stored, &user);
+        if (!bulkApplyUser(action, filter, &user)) continue;
+        affected++;
+        uint32_t version = stored->version + 1;
+        bulkNoteRecord(userStoreFind(user.username), action, &user, version);
+        if (action == BULK_DELETE) {
+            stored->flags |= USER_FLAG_DELETED;
+            stored->version = version;
+        } else {
+            userToFileRecord(&user, version, stored);
+        }
+        METRIC_COUNT(METRIC_USER_BYTES_WRITTEN, sizeof(UserFileRecord));
+    }
+    msync(userStore.binaryMap, binaryRecordOffset(userStore.binaryCount), MS_SYNC);
+    fileUnlock(userStore.binaryFd, 0, 0);
+    return affected;
+}
+
+static int bulkApplyJournalLocked(BulkAction action, const BulkFilter *filter) {
+    int affected = 0;
+    for (int i = 0; i < userStore.count; i++) {
+        UserRecord *rec = userStoreAt(i);
+        User user = rec->user;
+        if (rec->deleted || !bulkApplyUser(action, filter, &user)) continue;
+        affected++;
+        bulkNoteRecord(rec, action, &user, rec->version + 1);
+    }
+    // One snapshot holds every change, so the journal needs no records for them.
+    if (affected > 0) journalCompactLocked();
+    return affected;
+}
+
+/* Apply an admin action to every user the filter selects in one pass.
+ * Returns the number of users changed, or -1 if the pass failed. */
+int userStoreBulkApply(BulkAction action, const BulkFilter *filter) {
+    if (!userStore.loaded) userStoreOpen();
+
+    pthread_mutex_lock(&checkpointer.writing);
+    pthread_mutex_lock(&userStore.lock);
+    int affected;
+    if (userStore.journalMode) {
+        affected = bulkApplyJournalLocked(action, filter);
+    } else if (userStore.binaryMode) {
+        affected = bulkApplyBinaryLocked(action, filter);
+    } else {
+        affected = bulkApplyTextLocked(action, filter);
+    }
+    pthread_mutex_unlock(&userStore.lock);
+    pthread_mutex_unlock(&checkpointer.writing);
+    return affected;
+}
+
+/* ====== LEADERBOARDS ======
+ * Richest, biggest single win and best win rate, each an indexable skip list
+ * kept current by every commit, so a player's rank or the top of a board
+ * never needs a scan. The boards are built the first time they are asked
+ * for and saved to LEADERBOARD_FILENAME on exit; a saved board is reused
+ * only if every entry still matches the loaded users, which skips the sort. */
+
+static bool leaderboardScore(const UserRecord *rec, LeaderboardKind kind, int64_t *score) {
+    if (rec->deleted) return false;
+    const User *user = &rec->user;
+    switch (kind) {
+        case BOARD_RICHEST:
+            *score = user->balance;
+            return true;
+        case BOARD_BIGGEST_WIN:
+            *score = user->highest_win;
+            return true;
+        case BOARD_WIN_RATE:
+            if (user->games_played < LEADERBOARD_MIN_GAMES) return false;
+            *score = (int64_t)user->games_won * 1000000 / user->games_played;
+            return true;
+        case BOARD_COUNT:
+            break;
+    }
+    return false;
+}
+
+// True if the node ranks ahead of (score, rec).
+static bool skipNodeAhead(const SkipNode *node, int64_t score, const UserRecord *rec) {
+    if (node->score != score) return node->score > score;
+    return strcmp(node->rec->user.username, rec->user.username) < 0;
+}
+
+static int skipRandomLevel(void) {
+    uint64_t x = leaderboards.levelSeed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    leaderboards.levelSeed = x;
+    int level = 1;
+    while (level < SKIPLIST_MAX_LEVEL && (x & 3) == 0) { // each level holds a quarter of the one below
+        level++;
+        x >>= 2;
+    }
+    return level;
+}
+
+static SkipNode *skipNodeNew(int level, UserRecord *rec, int64_t score) {
+    SkipNode *node = xmalloc(sizeof(SkipNode) + level * sizeof(node->links[0]));
+    node->rec = rec;
+    node->score = score;
+    node->level = level;
+    for (int i = 0; i < level; i++) {
+        node->links[i].next = NULL;
+        node->links[i].span = 0;
+    }
+    return node;
+}
+
+static void skipListInit(SkipList *list) {
+    list->head = skipNodeNew(SKIPLIST_MAX_LEVEL, NULL, 0);
+    list->level = 1;
+    list->length = 0;
+}
+
+static void skipListFree(SkipList *list) {
+    SkipNode *node = list->head;
+    while (node) {
+        SkipNode *next = node->links[0].next;
+        free(node);
+        node = next;
+    }
+    memset(list, 0, sizeof(SkipList));
+}
+
+// Last node ahead of (score, rec) on every level, and how many nodes precede each.
+static void skipListFind(SkipList *list, int64_t score, const UserRecord *rec,
+                         SkipNode **update, uint32_t *rank) {
+    SkipNode *x = list->head;
+    for (int i = list->level - 1; i >= 0; i--) {
+        rank[i] = i == list->level - 1 ? 0 : rank[i + 1];
+        while (x->links[i].next && skipNodeAhead(x->links[i].next, score, rec)) {
+            rank[i] += x->links[i].span;
+            x = x->links[i].next;
+        }
+        update[i] = x;
+    }
+}
+
+static void skipListInsert(SkipList *list, UserRecord *rec, int64_t score) {
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    uint32_t rank[SKIPLIST_MAX_LEVEL];
+    skipListFind(list, score, rec, update, rank);
+
+    int level = skipRandomLevel();
+    for (int i = list->level; i < level; i++) {
+        rank[i] = 0;
+        update[i] = list->head;
+        update[i]->links[i].span = list->length;
+    }
+    if (level > list->level) list->level = level;
+
+    SkipNode *node = skipNodeNew(level, rec, score);
+    for (int i = 0; i < level; i++) {
+        node->links[i].next = update[i]->links[i].next;
+        update[i]->links[i].next = node;
+        node->links[i].span = update[i]->links[i].span - (rank[0] - rank[i]);
+        update[i]->links[i].span = rank[0] - rank[i] + 1;
+    }
+    for (int i = level; i < list->level; i++) {
+        update[i]->links[i].span++;
+    }
+    list->length++;
+}
+
+static void skipListDelete(SkipList *list, UserRecord *rec, int64_t score) {
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    uint32_t rank[SKIPLIST_MAX_LEVEL];
+    skipListFind(list, score, rec, update, rank);
+    SkipNode *node = update[0]->links[0].next;
+    if (!node || node->rec != rec) return;
+
+    for (int i = 0; i < list->level; i++) {
+        if (update[i]->links[i].next == node) {
+            update[i]->links[i].span += node->links[i].span - 1;
+            update[i]->links[i].next = node->links[i].next;
+        } else {
+            update[i]->links[i].span--;
+        }
+    }
+    while (list->level > 1 && !list->head->links[list->level - 1].next) {
+        list->level--;
+    }
+    list->length--;
+    free(node);
+}
+
+// 1-based rank of the node for (score, rec), or 0 if it is not on the list.
+static uint32_t skipListRank(SkipList *list, int64_t score, const UserRecord *rec) {
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    uint32_t rank[SKIPLIST_MAX_LEVEL];
+    skipListFind(list, score, rec, update, rank);
+    SkipNode *node = update[0]->links[0].next;
+    return node && node->rec == rec ? rank[0] + 1 : 0;
+}
+
+/* Append a node that ranks behind everything on the list. `last` and
+ * `lastPos` track the final node on each level and its rank, starting at the
+ * head and 0; building from sorted input this way is O(N). */
+static void skipListAppend(SkipList *list, SkipNode **last, uint32_t *lastPos, UserRecord *rec, int64_t score) {
+    int level = skipRandomLevel();
+    for (int i = list->level; i < level; i++) {
+        list->head->links[i].span = list->length;
+    }
+    if (level > list->level) list->level = level;
+
+    uint32_t pos = list->length + 1;
+    SkipNode *node = skipNodeNew(level, rec, score);
+    for (int i = 0; i < level; i++) {
+        last[i]->links[i].next = node;
+        last[i]->links[i].span = pos - lastPos[i];
+        last[i] = node;
+        lastPos[i] = pos;
+    }
+    for (int i = level; i < list->level; i++) {
+        last[i]->links[i].span++;
+    }
+    list->length = pos;
+}
+
+// Move rec to where its current stats put it on each board. Caller holds leaderboards.lock.
+static void leaderboardUpdateLocked(UserRecord *rec) {
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        int64_t score = 0;
+        bool ranked = (rec->boardRanked >> kind) & 1;
+        bool wanted = leaderboardScore(rec, kind, &score);
+        if (ranked && wanted && score == rec->boardScore[kind]) continue;
+
+        if (ranked) {
+            skipListDelete(&leaderboards.boards[kind], rec, rec->boardScore[kind]);
+            rec->boardRanked &= ~(1u << kind);
+        }
+        if (wanted) {
+            skipListInsert(&leaderboards.boards[kind], rec, score);
+            rec->boardScore[kind] = score;
+            rec->boardRanked |= 1u << kind;
+        }
+    }
+}
+
+void leaderboardUpdate(UserRecord *rec) {
+    if (!__atomic_load_n(&leaderboards.built, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&leaderboards.lock);
+    leaderboardUpdateLocked(rec);
+    pthread_mutex_unlock(&leaderboards.lock);
+}
+
+typedef struct {
+    UserRecord *rec;
+    int64_t score;
+} LeaderboardSeed;
+
+static int compareLeaderboardSeeds(const void *a, const void *b) {
+    const LeaderboardSeed *x = a, *y = b;
+    if (x->score != y->score) return x->score > y->score ? -1 : 1;
+    return strcmp(x->rec->user.username, y->rec->user.username);
+}
+
+static void leaderboardAppendLocked(LeaderboardKind kind, SkipNode **last, uint32_t *lastPos,
+                                    UserRecord *rec, int64_t score) {
+    skipListAppend(&leaderboards.boards[kind], last, lastPos, rec, score);
+    rec->boardScore[kind] = score;
+    rec->boardRanked |= 1u << kind;
+}
+
+static void leaderboardResetLocked(void) {
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        if (leaderboards.boards[kind].head) skipListFree(&leaderboards.boards[kind]);
+        skipListInit(&leaderboards.boards[kind]);
+    }
+    for (int i = 0; i < userStore.count; i++) {
+        userStoreAt(i)->boardRanked = 0;
+    }
+}
+
+/* Rebuild the boards from LEADERBOARD_FILENAME. Fails, leaving the boards
+ * to be rebuilt from scratch, unless the saved entries are in order and are
+ * exactly the users that belong on each board with their current scores. */
+static bool leaderboardLoadLocked(void) {
+    FILE *file = fopen(LEADERBOARD_FILENAME, "rb");
+    if (!file) return false;
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    LeaderboardFileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, LEADERBOARD_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == LEADERBOARD_VERSION && header.minGames == LEADERBOARD_MIN_GAMES;
+
+    for (int kind = 0; ok && kind < BOARD_COUNT; kind++) {
+        SkipNode *last[SKIPLIST_MAX_LEVEL];
+        uint32_t lastPos[SKIPLIST_MAX_LEVEL] = { 0 };
+        for (int i = 0; i < SKIPLIST_MAX_LEVEL; i++) last[i] = leaderboards.boards[kind].head;
+
+        UserRecord *prev = NULL;
+        int64_t prevScore = 0;
+        for (uint32_t n = 0; ok && n < header.counts[kind]; n++) {
+            LeaderboardFileEntry entry;
+            int64_t score;
+            UserRecord *rec = NULL;
+            if (fread(&entry, sizeof(entry), 1, file) == 1) {
+                entry.username[sizeof(entry.username) - 1] = '\0';
+                rec = entry.id < (uint32_t)userStore.count ? userStoreAt(entry.id) : NULL;
+                if (!rec || rec->deleted || strcmp(rec->user.username, entry.username) != 0) {
+                    rec = userStoreFind(entry.username);
+                }
+            }
+            ok = rec && !((rec->boardRanked >> kind) & 1) &&
+                 leaderboardScore(rec, kind, &score) && score == entry.score &&
+                 (!prev || prevScore > score || (prevScore == score && strcmp(prev->user.username, rec->user.username) < 0));
+            if (ok) {
+                leaderboardAppendLocked(kind, last, lastPos, rec, score);
+                prev = rec;
+                prevScore = score;
+            }
+        }
+    }
+    fclose(file);
+    if (!ok) return false;
+
+    // Every user that belongs on a board must have been in the file.
+    for (int i = 0; i < userStore.count; i++) {
+        UserRecord *rec = userStoreAt(i);
+        for (int kind = 0; kind < BOARD_COUNT; kind++) {
+            int64_t score;
+            if (leaderboardScore(rec, kind, &score) && !((rec->boardRanked >> kind) & 1)) return false;
+        }
+    }
+    return true;
+}
+
+static void leaderboardSortLocked(void) {
+    LeaderboardSeed *seeds = xmalloc((size_t)(userStore.count ? userStore.count : 1) * sizeof(LeaderboardSeed));
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        int n = 0;
+        for (int i = 0; i < userStore.count; i++) {
+            UserRecord *rec = userStoreAt(i);
+            if (leaderboardScore(rec, kind, &seeds[n].score)) seeds[n++].rec = rec;
+        }
+        qsort(seeds, n, sizeof(LeaderboardSeed), compareLeaderboardSeeds);
+
+        SkipNode *last[SKIPLIST_MAX_LEVEL];
+        uint32_t lastPos[SKIPLIST_MAX_LEVEL] = { 0 };
+        for (int i = 0; i < SKIPLIST_MAX_LEVEL; i++) last[i] = leaderboards.boards[kind].head;
+        for (int i = 0; i < n; i++) {
+            leaderboardAppendLocked(kind, last, lastPos, seeds[i].rec, seeds[i].score);
+        }
+    }
+    free(seeds);
+}
+
+void leaderboardBuild(void) {
+    if (__atomic_load_n(&leaderboards.built, __ATOMIC_ACQUIRE)) return;
+    if (!userStore.loaded) userStoreOpen();
+
+    // Holding userStore.lock keeps new users out until the boards can take them.
+    pthread_mutex_lock(&userStore.lock);
+    pthread_mutex_lock(&leaderboards.lock);
+    if (!leaderboards.built) {
+        leaderboardResetLocked();
+        if (!leaderboardLoadLocked()) {
+            leaderboardResetLocked();
+            leaderboardSortLocked();
+        }
+        __atomic_store_n(&leaderboards.built, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&leaderboards.lock);
+    pthread_mutex_unlock(&userStore.lock);
+}
+
+/* A user's 1-based rank on a board, or 0 if they are not on it. *size is
+ * set to the number of users on the board. */
+int leaderboardRank(LeaderboardKind kind, const char *username, uint32_t *size) {
+    leaderboardBuild();
+    UserRecord *rec = userStoreFind(username);
+    pthread_mutex_lock(&leaderboards.lock);
+    int rank = 0;
+    if (rec && ((rec->boardRanked >> kind) & 1)) {
+        rank = (int)skipListRank(&leaderboards.boards[kind], rec->boardScore[kind], rec);
+    }
+    if (size) *size = leaderboards.boards[kind].length;
+    pthread_mutex_unlock(&leaderboards.lock);
+    return rank;
+}
+
+// Copy up to `count` leaders of a board, best first. Returns how many were copied.
+int leaderboardTop(LeaderboardKind kind, int count, UserRecord **rows, int64_t *scores) {
+    leaderboardBuild();
+    pthread_mutex_lock(&leaderboards.lock);
+    int n = 0;
+    for (SkipNode *node = leaderboards.boards[kind].head->links[0].next; node && n < count; node = node->links[0].next) {
+        rows[n] = node->rec;
+        scores[n++] = node->score;
+    }
+    pthread_mutex_unlock(&leaderboards.lock);
+    return n;
+}
+
+static void leaderboardSaveLocked(void) {
+    FILE *file = fopen(LEADERBOARD_FILENAME ".tmp", "wb");
+    if (!file) {
+        perror(RED "Error saving leaderboards" RESET);
+        return;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    LeaderboardFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LEADERBOARD_MAGIC, sizeof(header.magic));
+    header.version = LEADERBOARD_VERSION;
+    header.minGames = LEADERBOARD_MIN_GAMES;
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        header.counts[kind] = leaderboards.boards[kind].length;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        for (SkipNode *node = leaderboards.boards[kind].head->links[0].next; node; node = node->links[0].next) {
+            LeaderboardFileEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            memcpy(entry.username, node->rec->user.username, sizeof(entry.username) - 1);
+            entry.id = node->rec->id;
+            entry.score = node->score;
+            fwrite(&entry, sizeof(entry), 1, file);
+        }
+    }
+    // Only a cache: a torn file fails validation and the boards are rebuilt.
+    if (fclose(file) != 0 || rename(LEADERBOARD_FILENAME ".tmp", LEADERBOARD_FILENAME) != 0) {
+        perror(RED "Error saving leaderboards" RESET);
+    }
+}
+
+// Save the boards if they were built, then drop them.
+void leaderboardClose(void) {
+    pthread_mutex_lock(&leaderboards.lock);
+    if (leaderboards.built) {
+        leaderboardSaveLocked();
+        for (int kind = 0; kind < BOARD_COUNT; kind++) {
+            skipListFree(&leaderboards.boards[kind]);
+        }
+        for (int i = 0; i < userStore.count; i++) {
+            userStoreAt(i)->boardRanked = 0;
+        }
+        __atomic_store_n(&leaderboards.built, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&leaderboards.lock);
+}
+
+// Returns 0 if another process registered the same username first.
+int saveUser(User user) {
+    METRIC_BEGIN(start);
+    bool saved = userStorePersist(userStoreInsert(&user));
+    METRIC_END(METRIC_SAVE_USER, start);
+    return saved ? 1 : 0;
+}
+
+static int loadUserRecord(User *user) {
+    UserRecord *rec = userStoreFind(user->username);
+    if (!rec) {
+        userStoreRefresh(); // It may have been registered by another process.
+        rec = userStoreFind(user->username);
+        if (!rec) return 0;
+    }
+    if (!userStoreReload(rec) && rec->deleted) {
+        return 0; // Deleted by an admin in another process.
+    }
+
+    if (user->password[0] != '\0') { // Only verify if a password was provided for login
+        if (!verifyPassword(user->password, rec->user.password)) {
+            return -1; // Incorrect password
+        }
+        if (passwordNeedsRehash(rec->user.password)) {
+            // Move an old-format password to the current hasher now that we know it.
+            User upgraded = rec->user;
+            memcpy(upgraded.password, user->password, sizeof(upgraded.password));
+            hashPassword(upgraded.password);
+            userStoreCommit(rec, &upgraded);
+        }
+    }
+
+    *user = rec->user;
+    return 1;
+}
+
+int loadUser(User *user) {
+    METRIC_BEGIN(start);
+    int found = loadUserRecord(user);
+    METRIC_END(METRIC_LOAD_USER, start);
+    return found;
+}
+
+
+/* Write back a user loaded with loadUser. Changes other processes made in
+ * the meantime are merged in, and *user is refreshed to the result. */
+void updateUser(User *user) {
+    UserRecord *rec = userStoreFind(user->username);
+    if (!rec) {
+        printf(RED "Error updating user '%s': not found\n" RESET, user->username);
+        return;
+    }
+    METRIC_BEGIN(start);
+    user->last_active = time(NULL);
+    userStoreCommit(rec, user);
+    METRIC_END(METRIC_UPDATE_USER, start);
+}
+
+
+/* ====== RANDOM NUMBERS ====== */
+
+static uint64_t splitMix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+void rngSeed(Rng *rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitMix64(&seed);
+    }
+}
+
+uint64_t rngNext(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// Advance the stream by 2^128 draws.
+void rngJump(Rng *rng) {
+    static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                     0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (1ULL << b)) {
+                s0 ^= rng->s[0];
+                s1 ^= rng->s[1];
+                s2 ^= rng->s[2];
+                s3 ^= rng->s[3];
+            }
+            rngNext(rng);
+        }
+    }
+    rng->s[0] = s0;
+    rng->s[1] = s1;
+    rng->s[2] = s2;
+    rng->s[3] = s3;
+}
+
+// Uniform value in [0, bound) without modulo bias (Lemire's multiply-and-reject).
+uint32_t rngBounded(Rng *rng, uint32_t bound) {
+    uint64_t m = (uint64_t)(uint32_t)(rngNext(rng) >> 32) * bound;
+    uint32_t low = (uint32_t)m;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            m = (uint64_t)(uint32_t)(rngNext(rng) >> 32) * bound;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+/* ====== SPIN SOURCES ======
+ * --rng picks how pockets are drawn:
+ *   xoshiro  the seeded xoshiro256** stream, drawn inline (default; --seed reproduces it)
+ *   system   the kernel's generator through getrandom
+ *   fair     provably fair: commit-reveal over HMAC-SHA256
+ * Every engine maps random bits to pockets by rejection, so no pocket is
+ * favored.
+ *
+ * In fair mode each source draws from a secret 32-byte server seed per
+ * epoch of FAIR_EPOCH_SPINS spins. Before any spin of an epoch is used, the
+ * SHA-256 of its seed is appended to FAIRNESS_FILENAME as a COMMIT line.
+ * Once every spin of the epoch has been played, the seed itself follows as
+ * a REVEAL line. Spin n is the first 32-bit word of
+ * HMAC-SHA256(seed, "n:round") below the largest multiple of 37, taken mod
+ * 37, for the first round that has one. Anyone can then check with
+ * --verify-fairness that the revealed seed matches its commitment and
+ * recompute any spin.
+ *
+ * Pregenerating engines never hash or call into the kernel on the spin
+ * path: one spin producer thread keeps every source's ring topped up and
+ * sleeps until a ring falls to half full. */
+
+static void hexEncode(const uint8_t *data, size_t len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    out[2 * len] = '\0';
+}
+
+static bool hexDecode(const char *text, uint8_t *out, size_t len) {
+    if (strlen(text) != 2 * len) return false;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)text[2 * i]) || !isxdigit((unsigned char)text[2 * i + 1]) ||
+            sscanf(text + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+static void systemFill(SpinSource *src, uint64_t nonce, uint8_t *pockets, int count) {
+    (void)src;
+    (void)nonce;
+    uint8_t bytes[SPIN_FILL_BLOCK];
+    int have = 0, used = 0;
+    for (int i = 0; i < count;) {
+        if (used == have) {
+            randomBytes(bytes, sizeof(bytes));
+            have = sizeof(bytes);
+            used = 0;
+        }
+        uint8_t b = bytes[used++];
+        // 222 = 6 * 37: every pocket gets exactly six byte values.
+        if (b < 256 / POCKET_COUNT * POCKET_COUNT) pockets[i++] = b % POCKET_COUNT;
+    }
+}
+
+static int fairPocket(const uint8_t seed[32], uint64_t nonce) {
+    const uint64_t limit = (1ULL << 32) / POCKET_COUNT * POCKET_COUNT;
+    for (unsigned int round = 0;; round++) {
+        char msg[48];
+        uint8_t mac[SHA256_DIGEST_SIZE];
+        int len = snprintf(msg, sizeof(msg), "%llu:%u", (unsigned long long)nonce, round);
+        hmacSha256(seed, 32, msg, len, mac);
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i += 4) {
+            uint32_t word = (uint32_t)mac[i] << 24 | (uint32_t)mac[i + 1] << 16 | (uint32_t)mac[i + 2] << 8 | mac[i + 3];
+            if (word < limit) return (int)(word % POCKET_COUNT);
+        }
+    }
+}
+
+static void fairLog(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fairLog(const char *fmt, ...) {
+    if (!spinProducer.log) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(spinProducer.log, fmt, ap);
+    va_end(ap);
+    // A commitment only counts once it is on disk ahead of the spins it covers.
+    fflush(spinProducer.log);
+    fdatasync(fileno(spinProducer.log));
+}
+
+// Publish the seeds of epochs before `epoch`.
+static void fairReveal(SpinSource *src, uint64_t epoch) {
+    for (; src->revealed < epoch; src->revealed++) {
+        char commit[2 * SHA256_DIGEST_SIZE + 1], seed[65];
+        hexEncode(src->commit[src->revealed & 1], SHA256_DIGEST_SIZE, commit);
+        hexEncode(src->seed[src->revealed & 1], 32, seed);
+        fairLog("REVEAL %s %llu %s %s\n", src->label, (unsigned long long)src->revealed, commit, seed);
+    }
+}
+
+static void fairFill(SpinSource *src, uint64_t nonce, uint8_t *pockets, int count) {
+    // Epochs the player has finished can be revealed; this also frees their seed slot.
+    fairReveal(src, __atomic_load_n(&src->tail, __ATOMIC_ACQUIRE) / FAIR_EPOCH_SPINS);
+    for (int i = 0; i < count; i++, nonce++) {
+        uint64_t epoch = nonce / FAIR_EPOCH_SPINS;
+        if (nonce % FAIR_EPOCH_SPINS == 0) {
+            randomBytes(src->seed[epoch & 1], 32);
+            Sha256 ctx;
+            sha256Init(&ctx);
+            sha256Update(&ctx, src->seed[epoch & 1], 32);
+            sha256Final(&ctx, src->commit[epoch & 1]);
+            char commit[2 * SHA256_DIGEST_SIZE + 1];
+            hexEncode(src->commit[epoch & 1], SHA256_DIGEST_SIZE, commit);
+            fairLog("COMMIT %s %llu %s\n", src->label, (unsigned long long)epoch, commit);
+        }
+        pockets[i] = (uint8_t)fairPocket(src->seed[epoch & 1], nonce);
+    }
+}
+
+// The source is off the producer's list: reveal every epoch it has started.
+static void fairClose(SpinSource *src) {
+    fairReveal(src, (src->head + FAIR_EPOCH_SPINS - 1) / FAIR_EPOCH_SPINS);
+}
+
+_Static_assert(SPIN_RING_SIZE < FAIR_EPOCH_SPINS, "the ring must not span more than two fair epochs");
+
+static const SpinEngine spinEngines[] = {
+    { "xoshiro", true, NULL, NULL },
+    { "system", false, systemFill, NULL },
+    { "fair", false, fairFill, fairClose },
+};
+
+const SpinEngine *spinEngineFor(const char *name) {
+    for (size_t i = 0; i < sizeof(spinEngines) / sizeof(spinEngines[0]); i++) {
+        if (strcmp(spinEngines[i].name, name) == 0) return &spinEngines[i];
+    }
+    return NULL;
+}
+
+static void spinProducerWake(void) {
+    pthread_mutex_lock(&spinProducer.lock);
+    spinProducer.wakeRequested = true;
+    pthread_cond_signal(&spinProducer.wake);
+    pthread_mutex_unlock(&spinProducer.lock);
+}
+
+// Top the ring up, publishing each block as soon as it is ready.
+static void spinSourceFill(SpinSource *src) {
+    uint8_t block[SPIN_FILL_BLOCK];
+    uint64_t head = src->head;
+    while (1) {
+        uint64_t space = SPIN_RING_SIZE - (head - __atomic_load_n(&src->tail, __ATOMIC_ACQUIRE));
+        if (space < SPIN_FILL_BLOCK) return;
+        src->engine->fill(src, head, block, SPIN_FILL_BLOCK);
+        for (int i = 0; i < SPIN_FILL_BLOCK; i++) {
+            src->ring[(head + i) & (SPIN_RING_SIZE - 1)] = block[i];
+        }
+        head += SPIN_FILL_BLOCK;
+        __atomic_store_n(&src->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void *spinProducerLoop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&spinProducer.lock);
+    while (!spinProducer.stopping) {
+        // Sources can be closed while the lock is dropped, so every fill restarts the scan.
+        SpinSource *src = spinProducer.sources;
+        while (src && SPIN_RING_SIZE - (src->head - __atomic_load_n(&src->tail, __ATOMIC_ACQUIRE)) < SPIN_FILL_BLOCK) {
+            src = src->nextSource;
+        }
+        if (!src) {
+            while (!spinProducer.wakeRequested && !spinProducer.stopping) {
+                pthread_cond_wait(&spinProducer.wake, &spinProducer.lock);
+            }
+            spinProducer.wakeRequested = false;
+            continue;
+        }
+
+        spinProducer.current = src;
+        pthread_mutex_unlock(&spinProducer.lock);
+        spinSourceFill(src);
+        pthread_mutex_lock(&spinProducer.lock);
+        spinProducer.current = NULL;
+        pthread_cond_broadcast(&spinProducer.idle);
+    }
+    pthread_mutex_unlock(&spinProducer.lock);
+    return NULL;
+}
+
+void spinSourceInit(SpinSource *src, const SpinEngine *engine, uint64_t seed, const char *label) {
+    memset(src, 0, sizeof(SpinSource));
+    src->engine = engine;
+    snprintf(src->label, sizeof(src->label), "%s", label);
+    rngSeed(&src->rng, seed);
+    if (!engine->fill) return;
+
+    pthread_mutex_lock(&spinProducer.lock);
+    if (engine->close == fairClose && !spinProducer.log) {
+        spinProducer.log = fopen(FAIRNESS_FILENAME, "a");
+        if (!spinProducer.log) perror(RED "Error opening " FAIRNESS_FILENAME RESET);
+    }
+    src->nextSource = spinProducer.sources;
+    spinProducer.sources = src;
+    if (!spinProducer.running) {
+        if (pthread_create(&spinProducer.thread, NULL, spinProducerLoop, NULL) != 0) {
+            perror(RED "Error starting spin producer" RESET);
+            exit(1);
+        }
+        spinProducer.running = true;
+    }
+    spinProducer.wakeRequested = true;
+    pthread_cond_signal(&spinProducer.wake);
+    pthread_mutex_unlock(&spinProducer.lock);
+}
+
+// Another thread's source with the parent's engine. Seeded streams start 2^128 draws apart.
+void spinSourceFork(SpinSource *dst, const SpinSource *parent, int stream, const char *label) {
+    spinSourceInit(dst, parent->engine, 0, label);
+    dst->rng = parent->rng;
+    for (int j = 0; j <= stream; j++) rngJump(&dst->rng);
+}
+
+void spinSourceSeed(SpinSource *src, uint64_t seed) {
+    rngSeed(&src->rng, seed);
+    src->lastNonce = 0;
+}
+
+int spinNext(SpinSource *src) {
+    if (!src->engine->fill) {
+        src->lastNonce++;
+        return spinWheelWith(&src->rng);
+    }
+    uint64_t tail = src->tail;
+    uint64_t head = __atomic_load_n(&src->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        // Only when spins outrun the producer, e.g. right after start-up.
+        spinProducerWake();
+        while ((head = __atomic_load_n(&src->head, __ATOMIC_ACQUIRE)) == tail) sched_yield();
+    }
+    int pocket = src->ring[tail & (SPIN_RING_SIZE - 1)];
+    __atomic_store_n(&src->tail, tail + 1, __ATOMIC_RELEASE);
+    if (head - tail - 1 == SPIN_RING_SIZE / 2) spinProducerWake();
+    src->lastNonce = tail;
+    return pocket;
+}
+
+/* How to check the latest spin, for fair sources: the stream, the nonce and
+ * the start of the commitment it was drawn under. */
+bool spinProof(const SpinSource *src, char *buf, size_t size) {
+    if (src->engine->close != fairClose) return false;
+    char commit[2 * SHA256_DIGEST_SIZE + 1];
+    hexEncode(src->commit[(src->lastNonce / FAIR_EPOCH_SPINS) & 1], SHA256_DIGEST_SIZE, commit);
+    snprintf(buf, size, "%s nonce %llu commit %.16s", src->label, (unsigned long long)src->lastNonce, commit);
+    return true;
+}
+
+void spinSourceClose(SpinSource *src) {
+    if (!src->engine || !src->engine->fill) return;
+    pthread_mutex_lock(&spinProducer.lock);
+    for (SpinSource **link = &spinProducer.sources; *link; link = &(*link)->nextSource) {
+        if (*link == src) {
+            *link = src->nextSource;
+            break;
+        }
+    }
+    while (spinProducer.current == src) {
+        pthread_cond_wait(&spinProducer.idle, &spinProducer.lock);
+    }
+    pthread_mutex_unlock(&spinProducer.lock);
+    if (src->engine->close) src->engine->close(src);
+    src->engine = NULL;
+}
+
+void spinSourcesShutdown(void) {
+    spinSourceClose(&gameSpins);
+    pthread_mutex_lock(&spinProducer.lock);
+    bool running = spinProducer.running;
+    spinProducer.stopping = true;
+    pthread_cond_signal(&spinProducer.wake);
+    pthread_mutex_unlock(&spinProducer.lock);
+    if (running) pthread_join(spinProducer.thread, NULL);
+    spinProducer.running = false;
+    if (spinProducer.log) fclose(spinProducer.log);
+    spinProducer.log = NULL;
+}
+
+/* Check every revealed seed in a fairness log against its commitment, then
+ * recompute the spins asked for as "<commit prefix>:<nonce>". */
+int verifyFairness(const char *logPath, char **queries, int queryCount) {
+    FILE *log = fopen(logPath, "r");
+    if (!log) {
+        perror(RED "Error opening fairness log" RESET);
+        return 0;
+    }
+
+    typedef struct {
+        char commit[2 * SHA256_DIGEST_SIZE + 1];
+        uint8_t seed[32];
+        bool revealed;
+    } FairEpoch;
+    FairEpoch *epochs = NULL;
+    int count = 0, capacity = 0, revealed = 0, bad = 0, unanswered = 0;
+    char line[256], label[16], commit[2 * SHA256_DIGEST_SIZE + 1], seedHex[65];
+    unsigned long long epoch;
+    while (fgets(line, sizeof(line), log)) {
+        if (sscanf(line, "COMMIT %15s %llu %64s", label, &epoch, commit) == 3) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                epochs = xrealloc(epochs, capacity * sizeof(FairEpoch));
+            }
+            memset(&epochs[count], 0, sizeof(FairEpoch));
+            strcpy(epochs[count++].commit, commit);
+        } else if (sscanf(line, "REVEAL %15s %llu %64s %64s", label, &epoch, commit, seedHex) == 4) {
+            FairEpoch *e = NULL;
+            for (int i = count - 1; i >= 0 && !e; i--) {
+                if (strcmp(epochs[i].commit, commit) == 0) e = &epochs[i];
+            }
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            char digestHex[2 * SHA256_DIGEST_SIZE + 1];
+            bool ok = e && hexDecode(seedHex, e->seed, 32);
+            if (ok) {
+                Sha256 ctx;
+                sha256Init(&ctx);
+                sha256Update(&ctx, e->seed, 32);
+                sha256Final(&ctx, digest);
+                hexEncode(digest, SHA256_DIGEST_SIZE, digestHex);
+                ok = strcmp(digestHex, commit) == 0;
+            }
+            if (ok) {
+                e->revealed = true;
+                revealed++;
+            } else {
+                printf(RED BOLD "MISMATCH %s epoch %llu: revealed seed does not match commitment %.16s\n" RESET,
+                       label, epoch, commit);
+                bad++;
+            }
+        }
+    }
+    fclose(log);
+
+    for (int q = 0; q < queryCount; q++) {
+        char prefix[80];
+        unsigned long long nonce;
+        if (sscanf(queries[q], "%79[0-9a-f]:%llu", prefix, &nonce) != 2) {
+            printf(RED "Expected <commit prefix>:<nonce>, got '%s'\n" RESET, queries[q]);
+            unanswered++;
+            continue;
+        }
+        FairEpoch *e = NULL;
+        for (int i = 0; i < count && !e; i++) {
+            if (strncmp(epochs[i].commit, prefix, strlen(prefix)) == 0) e = &epochs[i];
+        }
+        if (!e) printf(RED "%s: no such commitment\n" RESET, queries[q]);
+        else if (!e->revealed) printf(YELLOW "%s: seed not revealed yet\n" RESET, queries[q]);
+        if (!e || !e->revealed) unanswered++;
+        else printf("%s: pocket %d\n", queries[q], fairPocket(e->seed, nonce));
+    }
+
+    printf("%d commitment%s, %d revealed, %d mismatch%s\n", count, count == 1 ? "" : "s", revealed, bad,
+           bad == 1 ? "" : "es");
+    free(epochs);
+    return bad == 0 && unanswered == 0;
+}
+
+/* ====== ROULETTE ENGINE ======
+ * Spin and bet resolution without any terminal I/O, shared by the
+ * interactive game and the batch simulator. */
+
+int spinWheel(void) {
+    return spinNext(&gameSpins);
+}
+
+int spinWheelWith(Rng *rng) {
+    return (int)rngBounded(rng, POCKET_COUNT); // 0-36
+}
+
+bool isRedNumber(int pocket) {
+    return (RED_POCKET_MASK >> pocket) & 1;
+}
+
+/* The 60 two-number splits: 0-1, 0-2, 0-3, then for each number its
+ * neighbour to the right and the one below it on the layout. */
+static int splitLow[SPLIT_COUNT], splitHigh[SPLIT_COUNT];
+
+static void initSplits(void) {
+    int n = 0;
+    for (int b = 1; b <= 3; b++) {
+        splitLow[n] = 0;
+        splitHigh[n++] = b;
+    }
+    for (int a = 1; a <= 36; a++) {
+        if (a % 3 != 0) {
+            splitLow[n] = a;
+            splitHigh[n++] = a + 1;
+        }
+        if (a <= 33) {
+            splitLow[n] = a;
+            splitHigh[n++] = a + 3;
+        }
+    }
+}
+
+// Split index for two adjacent numbers in either order, or -1 if they are not adjacent.
+int splitSelection(int a, int b) {
+    if (a > b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    for (int i = 0; i < SPLIT_COUNT; i++) {
+        if (splitLow[i] == a && splitHigh[i] == b) return i;
+    }
+    return -1;
+}
+
+bool validBetSelection(int type, int selection) {
+    switch (type) {
+        case BET_SINGLE: return selection >= 0 && selection <= 36;
+        case BET_EVEN_ODD:
+        case BET_RED_BLACK:
+        case BET_HIGH_LOW: return selection == 1 || selection == 2;
+        case BET_DOZEN:
+        case BET_COLUMN: return selection >= 1 && selection <= 3;
+        case BET_SPLIT: return selection >= 0 && selection < SPLIT_COUNT;
+        case BET_STREET: return selection >= 1 && selection <= 12;
+        case BET_CORNER: return selection >= 1 && selection <= 32 && selection % 3 != 0;
+    }
+    return false;
+}
+
+// Rule-by-rule payout ratio, only used to fill payoutTable.
+static int computeMultiplier(int type, int selection, int pocket) {
+    if (type == BET_SINGLE) return selection == pocket ? 35 : 0;
+    if (type == BET_SPLIT) return pocket == splitLow[selection] || pocket == splitHigh[selection] ? 17 : 0;
+    if (pocket == 0) return 0; // Every other bet loses on green.
+
+    switch (type) {
+        case BET_EVEN_ODD:
+            return (selection == 1) == (pocket % 2 == 0) ? 1 : 0;
+        case BET_RED_BLACK:
+            return (selection == 1) == isRedNumber(pocket) ? 1 : 0;
+        case BET_HIGH_LOW:
+            return (selection == 1) == (pocket <= 18) ? 1 : 0;
+        case BET_DOZEN:
+            return (pocket - 1) / 12 + 1 == selection ? 2 : 0;
+        case BET_COLUMN:
+            return (pocket - 1) % 3 + 1 == selection ? 2 : 0;
+        case BET_STREET:
+            return (pocket - 1) / 3 + 1 == selection ? 11 : 0;
+        case BET_CORNER:
+            return pocket == selection || pocket == selection + 1 ||
+                   pocket == selection + 3 || pocket == selection + 4 ? 8 : 0;
+    }
+    return 0;
+}
+
+int betSlot(int type, int selection) {
+    static const int firstSlot[] = { 0, 0, 37, 39, 41, 43, 46, 49, 109, 121 };
+    switch (type) {
+        case BET_SINGLE:
+        case BET_SPLIT: return firstSlot[type] + selection;
+        case BET_CORNER: return firstSlot[type] + (selection - 1) / 3 * 2 + (selection - 1) % 3;
+        default: return firstSlot[type] + selection - 1;
+    }
+}
+
+void initPayoutTable(void) {
+    initSplits();
+    for (int type = BET_SINGLE; type <= BET_TYPE_COUNT; type++) {
+        for (int sel = 0; sel < SPLIT_COUNT; sel++) {
+            if (!validBetSelection(type, sel)) continue;
+            for (int pocket = 0; pocket < POCKET_COUNT; pocket++) {
+                payoutTable[pocket][betSlot(type, sel)] = computeMultiplier(type, sel, pocket);
+            }
+        }
+    }
+}
+
+// Payout ratio for a winning bet (35 for 35:1), or 0 if the bet loses.
+int betMultiplier(int type, int selection, int pocket) {
+    return payoutTable[pocket][betSlot(type, selection)];
+}
+
+void betLabel(int type, int selection, char *buf, size_t size) {
+    switch (type) {
+        case BET_SINGLE: snprintf(buf, size, "Single Number"); break;
+        case BET_EVEN_ODD: snprintf(buf, size, "%s", selection == 1 ? "Even" : "Odd"); break;
+        case BET_RED_BLACK: snprintf(buf, size, "%s", selection == 1 ? "Red" : "Black"); break;
+        case BET_HIGH_LOW: snprintf(buf, size, "%s", selection == 1 ? "Low (1-18)" : "High (19-36)"); break;
+        case BET_DOZEN: snprintf(buf, size, "Dozens %d-%d", (selection - 1) * 12 + 1, selection * 12); break;
+        case BET_COLUMN: snprintf(buf, size, "Column %d", selection); break;
+        case BET_SPLIT: snprintf(buf, size, "Split %d-%d", splitLow[selection], splitHigh[selection]); break;
+        case BET_STREET: snprintf(buf, size, "Street %d-%d", selection * 3 - 2, selection * 3); break;
+        case BET_CORNER: snprintf(buf, size, "Corner %d-%d", selection, selection + 4); break;
+        default: snprintf(buf, size, "Unknown");
+    }
+}
+
+// Apply one resolved bet to the user's balance and stats; returns the payout (0 on a loss).
+int settleBet(User *user, const Bet *bet, int pocket) {
+    int payout = betMultiplier(bet->type, bet->selection, pocket) * bet->amount;
+
+    user->balance -= bet->amount;
+    user->games_played++;
+    if (payout) {
+        user->balance += payout + bet->amount;
+        user->games_won++;
+        if (payout > user->highest_win) user->highest_win = payout;
+    }
+    return payout;
+}
+
+/* ====== BATCH SETTLEMENT ======
+ * Settles every bet placed on one spin in a single pass. The kernel looks up
+ * each bet's payout ratio in the pocket's payoutTable row and derives payout
+ * and balance delta with masks instead of branches; AVX2 handles 8 bets per
+ * step with a gather, SSE4.1 handles 4, and a scalar loop covers the rest. */
+
+typedef void (*SettleKernel)(const int32_t *row, const int32_t *slot, const int32_t *amount,
+                             int32_t *payout, int32_t *delta, int count);
+
+static void settleKernelScalar(const int32_t *row, const int32_t *slot, const int32_t *amount,
+                               int32_t *payout, int32_t *delta, int count) {
+    for (int i = 0; i < count; i++) {
+        int32_t mult = row[slot[i]];
+        int32_t won = -(mult != 0); // all ones on a win
+        payout[i] = mult * amount[i];
+        delta[i] = payout[i] + (amount[i] & won) - amount[i];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void settleKernelAvx2(const int32_t *row, const int32_t *slot, const int32_t *amount,
+                             int32_t *payout, int32_t *delta, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i mult = _mm256_i32gather_epi32(row, _mm256_loadu_si256((const __m256i *)(slot + i)), 4);
+        __m256i amt = _mm256_loadu_si256((const __m256i *)(amount + i));
+        __m256i pay = _mm256_mullo_epi32(mult, amt);
+        __m256i stake = _mm256_and_si256(_mm256_cmpgt_epi32(mult, zero), amt);
+        _mm256_storeu_si256((__m256i *)(payout + i), pay);
+        _mm256_storeu_si256((__m256i *)(delta + i), _mm256_sub_epi32(_mm256_add_epi32(pay, stake), amt));
+    }
+    settleKernelScalar(row, slot + i, amount + i, payout + i, delta + i, count - i);
+}
+
+__attribute__((target("sse4.1")))
+static void settleKernelSse41(const int32_t *row, const int32_t *slot, const int32_t *amount,
+                              int32_t *payout, int32_t *delta, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i mult = _mm_set_epi32(row[slot[i + 3]], row[slot[i + 2]], row[slot[i + 1]], row[slot[i]]);
+        __m128i amt = _mm_loadu_si128((const __m128i *)(amount + i));
+        __m128i pay = _mm_mullo_epi32(mult, amt);
+        __m128i stake = _mm_and_si128(_mm_cmpgt_epi32(mult, zero), amt);
+        _mm_storeu_si128((__m128i *)(payout + i), pay);
+        _mm_storeu_si128((__m128i *)(delta + i), _mm_sub_epi32(_mm_add_epi32(pay, stake), amt));
+    }
+    settleKernelScalar(row, slot + i, amount + i, payout + i, delta + i, count - i);
+}
+#endif
+
+static SettleKernel selectSettleKernel(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return settleKernelAvx2;
+    if (__builtin_cpu_supports("sse4.1")) return settleKernelSse41;
+#endif
+    return settleKernelScalar;
+}
+
+void betBatchInit(BetBatch *batch) {
+    memset(batch, 0, sizeof(BetBatch));
+}
+
+void betBatchFree(BetBatch *batch) {
+    free(batch->type);
+    free(batch->selection);
+    free(batch->slot);
+    free(batch->amount);
+    free(batch->user);
+    free(batch->payout);
+    free(batch->delta);
+    memset(batch, 0, sizeof(BetBatch));
+}
+
+void betBatchAdd(BetBatch *batch, const Bet *bet, int userIndex) {
+    if (batch->count == batch->capacity) {
+        int cap = batch->capacity ? batch->capacity * 2 : 16;
+        batch->type = xrealloc(batch->type, cap * sizeof(uint8_t));
+        batch->selection = xrealloc(batch->selection, cap * sizeof(uint8_t));
+        batch->slot = xrealloc(batch->slot, cap * sizeof(int32_t));
+        batch->amount = xrealloc(batch->amount, cap * sizeof(int32_t));
+        batch->user = xrealloc(batch->user, cap * sizeof(int32_t));
+        batch->payout = xrealloc(batch->payout, cap * sizeof(int32_t));
+        batch->delta = xrealloc(batch->delta, cap * sizeof(int32_t));
+        batch->capacity = cap;
+    }
+    int i = batch->count++;
+    batch->type[i] = (uint8_t)bet->type;
+    batch->selection[i] = (uint8_t)bet->selection;
+    batch->slot[i] = betSlot(bet->type, bet->selection);
+    batch->amount[i] = bet->amount;
+    batch->user[i] = userIndex;
+}
+
+/* Settle every bet in the batch against `pocket` and apply the results to
+ * users[]. Stats are updated with arithmetic rather than per-bet branches. */
+static SettleKernel settleKernel;
+static pthread_once_t settleKernelOnce = PTHREAD_ONCE_INIT;
+
+static void initSettleKernel(void) {
+    settleKernel = selectSettleKernel();
+}
+
+void settleBatch(BetBatch *batch, int pocket, User *users) {
+    pthread_once(&settleKernelOnce, initSettleKernel);
+    METRIC_BEGIN(start);
+
+    settleKernel(payoutTable[pocket], batch->slot, batch->amount, batch->payout, batch->delta, batch->count);
+
+    for (int i = 0; i < batch->count; i++) {
+        User *u = &users[batch->user[i]];
+        int32_t payout = batch->payout[i];
+        u->balance += batch->delta[i];
+        u->games_played++;
+        u->games_won += payout > 0;
+        u->highest_win = payout > u->highest_win ? payout : u->highest_win;
+    }
+    METRIC_END(METRIC_SETTLE, start);
+}
+
+/* ====== BATCH SIMULATION ====== */
+
+typedef struct {
+    Bet bet;
+    long long hits;
+    long long wagered;
+    long long returned;   // stake back plus winnings
+    long long netSquares; // sum of squared net results, for the variance
+} SimBetStats;
+
+static int betWinningPockets(int type) {
+    switch (type) {
+        case BET_SINGLE: return 1;
+        case BET_SPLIT: return 2;
+        case BET_STREET: return 3;
+        case BET_CORNER: return 4;
+        case BET_DOZEN:
+        case BET_COLUMN: return 12;
+        default: return 18;
+    }
+}
+
+/* Parse a bet mix such as "1:17:10,3:1:25": comma separated
+ * type:selection:amount triples, all placed on every spin. */
+static int parseBetMix(const char *spec, Bet *bets, int max) {
+    int count = 0;
+    while (*spec && count < max) {
+        Bet bet;
+        int used;
+        if (sscanf(spec, "%d:%d:%d%n", &bet.type, &bet.selection, &bet.amount, &used) != 3 ||
+            !validBetSelection(bet.type, bet.selection) || bet.amount <= 0) {
+            return -1;
+        }
+        bets[count++] = bet;
+        spec += used;
+        if (*spec == ',') spec++;
+        else if (*spec) return -1;
+    }
+    return *spec ? -1 : count;
+}
+
+typedef struct {
+    const Bet *bets;
+    int betCount;
+    long long spins;
+    Rng rng;
+    SimBetStats stats[MAX_MIX_BETS];
+} SimWorker;
+
+static void *simulationWorker(void *arg) {
+    SimWorker *w = arg;
+    uint8_t slots[MAX_MIX_BETS];
+    for (int b = 0; b < w->betCount; b++) {
+        slots[b] = betSlot(w->bets[b].type, w->bets[b].selection);
+    }
+
+    for (long long i = 0; i < w->spins; i++) {
+        const int32_t *row = payoutTable[spinWheelWith(&w->rng)];
+        for (int b = 0; b < w->betCount; b++) {
+            long long mult = row[slots[b]];
+            long long won = mult != 0;
+            long long ret = (mult + 1) * w->bets[b].amount * won;
+            long long net = ret - w->bets[b].amount;
+            w->stats[b].hits += won;
+            w->stats[b].returned += ret;
+            w->stats[b].netSquares += net * net;
+        }
+    }
+    return NULL;
+}
+
+/* Spins are split into one shard per thread. Thread t draws from the seed's
+ * stream jumped t times, and the counters are plain sums, so a given seed and
+ * thread count always reproduce the same report. */
+int runSimulation(long long spins, const char *mixSpec, int threads, uint64_t seed) {
+    static const char *defaultMix = "1:17:10,2:1:10,3:1:10,4:1:10,5:1:10,6:1:10";
+    Bet bets[MAX_MIX_BETS];
+    int betCount = parseBetMix(mixSpec ? mixSpec : defaultMix, bets, MAX_MIX_BETS);
+    if (betCount <= 0) {
+        printf(RED BOLD "Invalid bet mix! Use type:selection:amount[,...]\n" RESET);
+        return 0;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SIM_THREADS) threads = MAX_SIM_THREADS;
+    if (threads > spins) threads = (int)spins;
+
+    SimWorker *workers = xcalloc(threads, sizeof(SimWorker));
+    pthread_t *tids = xmalloc(threads * sizeof(pthread_t));
+    Rng stream;
+    rngSeed(&stream, seed);
+    for (int t = 0; t < threads; t++) {
+        workers[t].bets = bets;
+        workers[t].betCount = betCount;
+        workers[t].spins = spins / threads + (t < spins % threads ? 1 : 0);
+        workers[t].rng = stream;
+        rngJump(&stream);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, simulationWorker, &workers[t]) != 0) {
+            perror(RED "Error starting simulation thread" RESET);
+            exit(1);
+        }
+    }
+    simulationWorker(&workers[0]);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    SimBetStats stats[MAX_MIX_BETS];
+    memset(stats, 0, sizeof(stats));
+    for (int b = 0; b < betCount; b++) {
+        stats[b].bet = bets[b];
+        for (int t = 0; t < threads; t++) {
+            stats[b].hits += workers[t].stats[b].hits;
+            stats[b].returned += workers[t].stats[b].returned;
+            stats[b].netSquares += workers[t].stats[b].netSquares;
+        }
+    }
+    free(workers);
+    free(tids);
+
+    printf(BOLD CYAN "\n====== Simulation: %lld spins, %d threads, seed %llu ======\n" RESET,
+           spins, threads, (unsigned long long)seed);
+    printf("%-16s %8s %10s %10s %8s %12s\n", "Bet", "Amount", "Hit rate", "Expected", "RTP", "Variance");
+    long long totalWagered = 0, totalReturned = 0;
+    for (int b = 0; b < betCount; b++) {
+        SimBetStats *st = &stats[b];
+        st->wagered = st->bet.amount * spins;
+        char label[30];
+        betLabel(st->bet.type, st->bet.selection, label, sizeof(label));
+        if (st->bet.type == BET_SINGLE) {
+            snprintf(label, sizeof(label), "Number %d", st->bet.selection);
+        }
+
+        double meanNet = (double)(st->returned - st->wagered) / spins;
+        double variance = spins > 1 ? ((double)st->netSquares - meanNet * meanNet * spins) / (spins - 1) : 0;
+        printf("%-16s %8d %9.4f%% %9.4f%% %7.3f%% %12.2f\n", label, st->bet.amount,
+               100.0 * st->hits / spins, 100.0 * betWinningPockets(st->bet.type) / POCKET_COUNT,
+               100.0 * st->returned / st->wagered, variance);
+        totalWagered += st->wagered;
+        totalReturned += st->returned;
+    }
+    printf(BOLD "Overall RTP: %.4f%% (theoretical %.4f%%), house edge %.4f%%\n" RESET,
+           100.0 * totalReturned / totalWagered, 100.0 * (POCKET_COUNT - 1) / POCKET_COUNT,
+           100.0 - 100.0 * totalReturned / totalWagered);
+    printf("Elapsed: %.3fs, %.2f million spins/s\n", seconds, seconds > 0 ? spins / seconds / 1e6 : 0.0);
+    return 1;
+}
+
+
+void printWheel() {
+    printf(BOLD "\n  ===== ROULETTE WHEEL =====\n" RESET);
+    for (int i = 0; i <= 36; i++) {
+        if (i == 0) {
+            printf(GREEN "00 " RESET);
+        } else {
+            if (isRedNumber(i)) {
+                printf(RED "%02d " RESET, i);
+            } else {
+                printf(BLUE "%02d " RESET, i);
+            }
+        }
+        if (i > 0 && i % 12 == 0) printf("\n  ");
+    }
+    printf(BOLD "\n  ==========================\n" RESET);
+}
+
+
+void spinRoulette(int *result, char *color) {
+    METRIC_BEGIN(start);
+    *result = spinWheel();
+    METRIC_END(METRIC_SPIN, start);
+
+    if (*result == 0) {
+        strcpy(color, GREEN "Green" RESET);
+    } else if (isRedNumber(*result)) {
+        strcpy(color, RED "Red" RESET);
+    } else {
+        strcpy(color, BLUE "Black" RESET);
+    }
+}
+
+void displayRules() {
+    printf(BOLD CYAN "\n====== Roulette Rules =======" RESET
+           WHITE "\n1. Bet types:\n"
+           "   - Single number (" YELLOW "35:1" RESET ")\n"
+           "   - Even/Odd (" YELLOW "1:1" RESET ")\n"
+           "   - Red/Black (" YELLOW "1:1" RESET ")\n"
+           "   - High/Low (1-18/19-36) (" YELLOW "1:1" RESET ")\n"
+           "   - Dozens (1-12, 13-24, 25-36) (" YELLOW "2:1" RESET ")\n"
+           "   - Columns (" YELLOW "2:1" RESET ")\n"
+           "   - Split, two adjacent numbers (" YELLOW "17:1" RESET ") " MAGENTA "[NEW]" RESET "\n"
+           "   - Street, a row of three (" YELLOW "11:1" RESET ") " MAGENTA "[NEW]" RESET "\n"
+           "   - Corner, a block of four (" YELLOW "8:1" RESET ") " MAGENTA "[NEW]" RESET "\n"
+           "2. Min bet: $10, Max bet: $1000 per bet\n"
+           "3. Up to %d bets per spin on one bet slip\n\n" RESET, MAX_SLIP_BETS);
+}
+
+/* ====== BENCHMARKS ======
+ * `--bench` times the hot paths in a scratch directory against synthetic
+ * user files of each requested size. Every benchmark draws from a fixed
+ * seed, so runs are comparable between builds. Each result is printed and
+ * also appended as one JSON object per line to the output file, ready to
+ * diff. Allocations are those made through xmalloc/xcalloc/xrealloc. */
+
+#define BENCH_LOOKUPS 100000
+#define BENCH_UPDATES 20000
+#define BENCH_SPINS 1000000
+#define BENCH_SETTLES 1000000
+#define BENCH_HISTORY 100000
+#define BENCH_HISTORY_USERS 1000
+
+typedef struct {
+    uint64_t start;
+    uint64_t allocations;
+} BenchClock;
+
+static volatile int benchSink; // keeps measured results alive
+
+static BenchClock benchStart(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (BenchClock){ (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec,
+                         __atomic_load_n(&allocationCount, __ATOMIC_RELAXED) };
+}
+
+static void benchStop(BenchClock clock, FILE *out, const char *name, long rows, long ops) {
+    BenchClock end = benchStart();
+    double nsPerOp = (double)(end.start - clock.start) / ops;
+    double allocsPerOp = (double)(end.allocations - clock.allocations) / ops;
+    printf("%-22s %9ld %9ld %12.1f %12.3f\n", name, rows, ops, nsPerOp, allocsPerOp);
+    fprintf(out, "{\"name\":\"%s\",\"mode\":\"%s\",\"rows\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f}\n",
+            name, userStore.binaryMode ? "binary" : userStore.journalMode ? "journal" : "text",
+            rows, ops, nsPerOp, allocsPerOp);
+}
+
+static void benchUserName(long i, char *buf, size_t size) {
+    snprintf(buf, size, "user%07ld", i);
+}
+
+static bool benchWriteUsers(long rows) {
+    FILE *file = fopen(FILENAME, "w");
+    if (!file) {
+        perror(RED "Error creating benchmark user file" RESET);
+        return false;
+    }
+    User user;
+    memset(&user, 0, sizeof(User));
+    strcpy(user.password, "vhfuhw4");
+    for (long i = 0; i < rows; i++) {
+        benchUserName(i, user.username, sizeof(user.username));
+        user.balance = STARTING_BALANCE + (int)(i % 500);
+        writeUserRow(file, &user, 0);
+    }
+    return fclose(file) == 0;
+}
+
+static void benchUserStore(FILE *out, long rows, Rng *rng) {
+    bool binaryMode = userStore.binaryMode, journalMode = userStore.journalMode;
+    unlink(FILENAME);
+    unlink(BINARY_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    if (!benchWriteUsers(rows)) return;
+
+    BenchClock clock = benchStart();
+    if (!userStoreOpen()) return;
+    benchStop(clock, out, "user_store_open", rows, rows);
+
+    User user;
+    clock = benchStart();
+    for (long i = 0; i < BENCH_LOOKUPS; i++) {
+        memset(&user, 0, sizeof(User));
+        benchUserName(rngBounded(rng, rows), user.username, sizeof(user.username));
+        benchSink += loadUser(&user);
+    }
+    benchStop(clock, out, "user_lookup", rows, BENCH_LOOKUPS);
+
+    clock = benchStart();
+    for (long i = 0; i < BENCH_UPDATES; i++) {
+        memset(&user, 0, sizeof(User));
+        benchUserName(rngBounded(rng, rows), user.username, sizeof(user.username));
+        UserRecord *rec = userStoreFind(user.username);
+        user = rec->user;
+        user.balance++;
+        user.games_played++;
+        updateUser(&user);
+    }
+    benchStop(clock, out, "user_update", rows, BENCH_UPDATES);
+
+    userStoreClose();
+    userStore.binaryMode = binaryMode;
+    userStore.journalMode = journalMode;
+}
+
+static void benchEngine(FILE *out, Rng *rng) {
+    int result;
+    char color[20];
+    BenchClock clock = benchStart();
+    for (long i = 0; i < BENCH_SPINS; i++) {
+        spinRoulette(&result, color);
+        benchSink += result;
+    }
+    benchStop(clock, out, "spin", 0, BENCH_SPINS);
+
+    // One benchmark per bet type, each over random valid selections and pockets.
+    enum { SAMPLES = 4096 };
+    static const char *names[BET_TYPE_COUNT + 1] = {
+        NULL, "settle_single", "settle_even_odd", "settle_red_black", "settle_high_low",
+        "settle_dozen", "settle_column", "settle_split", "settle_street", "settle_corner",
+    };
+    Bet bets[SAMPLES];
+    int pockets[SAMPLES];
+    for (int type = 1; type <= BET_TYPE_COUNT; type++) {
+        for (int i = 0; i < SAMPLES; i++) {
+            int sel;
+            do {
+                sel = (int)rngBounded(rng, POCKET_COUNT + SPLIT_COUNT);
+            } while (!validBetSelection(type, sel));
+            bets[i] = (Bet){ type, sel, MIN_BET };
+            pockets[i] = (int)rngBounded(rng, POCKET_COUNT);
+        }
+
+        User user;
+        memset(&user, 0, sizeof(User));
+        clock = benchStart();
+        for (long i = 0; i < BENCH_SETTLES; i++) {
+            benchSink += settleBet(&user, &bets[i % SAMPLES], pockets[i % SAMPLES]);
+        }
+        benchStop(clock, out, names[type], 0, BENCH_SETTLES);
+    }
+}
+
+static void benchHistory(FILE *out, Rng *rng) {
+    unlink(HISTORY_FILENAME);
+    if (!historyStoreOpen()) return;
+
+    User user;
+    memset(&user, 0, sizeof(User));
+    BenchClock clock = benchStart();
+    for (long i = 0; i < BENCH_HISTORY; i++) {
+        benchUserName(rngBounded(rng, BENCH_HISTORY_USERS), user.username, sizeof(user.username));
+        Bet bet = { BET_RED_BLACK, 1, MIN_BET };
+        int pocket = (int)rngBounded(rng, POCKET_COUNT);
+        addGameHistory(user, &bet, pocket, betMultiplier(bet.type, bet.selection, pocket) * bet.amount);
+    }
+    benchStop(clock, out, "history_append", BENCH_HISTORY, BENCH_HISTORY);
+
+    // Deep pages fall outside the in-memory ring and are read from disk.
+    GameHistory page[HISTORY_PAGE_SIZE];
+    int perUser = BENCH_HISTORY / BENCH_HISTORY_USERS;
+    clock = benchStart();
+    for (long i = 0; i < BENCH_HISTORY; i++) {
+        benchUserName(rngBounded(rng, BENCH_HISTORY_USERS), user.username, sizeof(user.username));
+        int offset = (int)rngBounded(rng, perUser / HISTORY_PAGE_SIZE) * HISTORY_PAGE_SIZE;
+        benchSink += historyQuery(user.username, 0, offset, HISTORY_PAGE_SIZE, page);
+    }
+    benchStop(clock, out, "history_page", BENCH_HISTORY, BENCH_HISTORY);
+
+    historyStoreClose();
+}
+
+/* Run every benchmark for each comma-separated row count in `sizes`,
+ * appending results to outPath. Works in a temporary directory so real
+ * user and history files are never touched. */
+int runBenchmarks(const char *sizes, const char *outPath) {
+    FILE *out = fopen(outPath, "a");
+    if (!out) {
+        perror(RED "Error opening benchmark output" RESET);
+        return 0;
+    }
+    char cwd[4096], dir[] = "/tmp/roulette-bench-XXXXXX";
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir) != 0) {
+        perror(RED "Error creating benchmark directory" RESET);
+        fclose(out);
+        return 0;
+    }
+
+    Rng rng;
+    rngSeed(&rng, 42);
+    spinSourceSeed(&gameSpins, 42);
+    printf(BOLD CYAN "====== Benchmarks ======\n" RESET);
+    printf(YELLOW "%-22s %9s %9s %12s %12s\n" RESET, "benchmark", "rows", "ops", "ns/op", "allocs/op");
+
+    const char *p = sizes;
+    while (*p) {
+        char *end;
+        long rows = strtol(p, &end, 10);
+        if (end == p || rows <= 0) {
+            printf(RED BOLD "Invalid row count in '%s'\n" RESET, sizes);
+            break;
+        }
+        benchUserStore(out, rows, &rng);
+        p = *end == ',' ? end + 1 : end;
+    }
+    benchEngine(out, &rng);
+    benchHistory(out, &rng);
+
+    unlink(FILENAME);
+    unlink(FILENAME ".tmp");
+    unlink(BINARY_FILENAME);
+    unlink(JOURNAL_FILENAME);
+    unlink(HISTORY_FILENAME);
+    if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+        perror(RED "Error removing benchmark directory" RESET);
+    }
+    printf(GREEN "Results appended to %s\n" RESET, outPath);
+    return fclose(out) == 0;
+}
+
+/* ====== GAME HISTORY STORE ======
+ * Every game is appended to HISTORY_FILENAME as a fixed 128-byte record.
+ * The newest HISTORY_RING_SIZE records also stay in a ring buffer, and each
+ * user has an in-memory list of their record numbers, so inserts are O(1)
+ * and a page of a user's history is a handful of reads. */
+
+static HistoryUserIndex *historyIndexFind(const char *username, bool create) {
+    unsigned int mask = historyStore.indexCapacity - 1;
+    unsigned int slot = hashUsername(username) & mask;
+    while (historyStore.index[slot]) {
+        if (strcmp(historyStore.index[slot]->username, username) == 0) {
+            return historyStore.index[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (!create) return NULL;
+
+    if ((historyStore.userCount + 1) * 10 > historyStore.indexCapacity * 7) {
+        HistoryUserIndex **old = historyStore.index;
+        int oldCapacity = historyStore.indexCapacity;
+        historyStore.indexCapacity *= 2;
+        historyStore.index = xcalloc(historyStore.indexCapacity, sizeof(HistoryUserIndex *));
+        mask = historyStore.indexCapacity - 1;
+        for (int i = 0; i < oldCapacity; i++) {
+            if (!old[i]) continue;
+            unsigned int s2 = hashUsername(old[i]->username) & mask;
+            while (historyStore.index[s2]) s2 = (s2 + 1) & mask;
+            historyStore.index[s2] = old[i];
+        }
+        free(old);
+        slot = hashUsername(username) & mask;
+        while (historyStore.index[slot]) slot = (slot + 1) & mask;
+    }
+
+    HistoryUserIndex *entry = xcalloc(1, sizeof(HistoryUserIndex));
+    strncpy(entry->username, username, sizeof(entry->username) - 1);
+    historyStore.index[slot] = entry;
+    historyStore.userCount++;
+    return entry;
+}
+
+static void historyIndexRecord(const GameHistory *h, long recordNumber) {
+    HistoryUserIndex *entry = historyIndexFind(h->username, true);
+    if (entry->count == entry->capacity) {
+        entry->capacity = entry->capacity ? entry->capacity * 2 : 16;
+        entry->records = xrealloc(entry->records, entry->capacity * sizeof(long));
+        entry->epochs = xrealloc(entry->epochs, entry->capacity * sizeof(int64_t));
+    }
+    entry->records[entry->count] = recordNumber;
+    entry->epochs[entry->count] = h->epoch;
+    entry->count++;
+    historyStore.ring[recordNumber % HISTORY_RING_SIZE] = *h;
+}
+
+int historyStoreOpen(void) {
+    historyStore.indexCapacity = USER_INDEX_MIN_CAPACITY;
+    historyStore.index = xcalloc(historyStore.indexCapacity, sizeof(HistoryUserIndex *));
+
+    historyStore.fd = open(HISTORY_FILENAME, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (historyStore.fd < 0) {
+        perror(RED "Error opening game history" RESET);
+        return 0;
+    }
+
+    // One sequential pass rebuilds the per-user index and refills the ring.
+    enum { BLOCK = 512 };
+    GameHistory *block = xmalloc(BLOCK * sizeof(GameHistory));
+    ssize_t got;
+    off_t pos = 0;
+    while ((got = pread(historyStore.fd, block, BLOCK * sizeof(GameHistory), pos)) > 0) {
+        int n = got / sizeof(GameHistory);
+        METRIC_COUNT(METRIC_HISTORY_BYTES_READ, got);
+        for (int i = 0; i < n; i++) {
+            historyIndexRecord(&block[i], historyStore.recordCount++);
+        }
+        pos += (off_t)n * sizeof(GameHistory);
+        if (got % sizeof(GameHistory)) break;
+    }
+    free(block);
+
+    // Drop a torn record left by a crash so appends stay aligned.
+    if (ftruncate(historyStore.fd, (off_t)historyStore.recordCount * sizeof(GameHistory)) != 0) {
+        perror(RED "Error trimming game history" RESET);
+    }
+    return 1;
+}
+
+void historyStoreClose(void) {
+    if (historyStore.fd >= 0) {
+        fdatasync(historyStore.fd);
+        close(historyStore.fd);
+    }
+    for (int i = 0; i < historyStore.indexCapacity; i++) {
+        HistoryUserIndex *entry = historyStore.index[i];
+        if (!entry) continue;
+        free(entry->records);
+        free(entry->epochs);
+        free(entry);
+    }
+    free(historyStore.index);
+    historyStore.index = NULL;
+    historyStore.indexCapacity = 0;
+    historyStore.fd = -1;
+}
+
+static bool historyRead(long recordNumber, GameHistory *out) {
+    if (recordNumber >= historyStore.recordCount - HISTORY_RING_SIZE) {
+        *out = historyStore.ring[recordNumber % HISTORY_RING_SIZE];
+        return true;
+    }
+    if (pread(historyStore.fd, out, sizeof(GameHistory),
+              (off_t)recordNumber * sizeof(GameHistory)) != sizeof(GameHistory)) {
+        return false;
+    }
+    METRIC_COUNT(METRIC_HISTORY_BYTES_READ, sizeof(GameHistory));
+    return true;
+}
+
+int historyCountFor(const char *username) {
+    pthread_mutex_lock(&historyStore.lock);
+    HistoryUserIndex *entry = historyStore.index ? historyIndexFind(username, false) : NULL;
+    int count = entry ? entry->count : 0;
+    pthread_mutex_unlock(&historyStore.lock);
+    return count;
+}
+
+/* Copy up to `limit` of the user's games into out, newest first, skipping
+ * the `offset` newest ones. With before > 0 only games played before that
+ * epoch second are considered. Returns the number of records copied. */
+int historyQuery(const char *username, int64_t before, int offset, int limit, GameHistory *out) {
+    METRIC_BEGIN(start);
+    pthread_mutex_lock(&historyStore.lock);
+    HistoryUserIndex *entry = historyStore.index ? historyIndexFind(username, false) : NULL;
+    if (!entry) {
+        pthread_mutex_unlock(&historyStore.lock);
+        METRIC_END(METRIC_HISTORY_QUERY, start);
+        return 0;
+    }
+
+    int end = entry->count; // one past the newest eligible record
+    if (before > 0) {
+        int lo = 0, hi = entry->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (entry->epochs[mid] < before) lo = mid + 1;
+            else hi = mid;
+        }
+        end = lo;
+    }
+
+    int copied = 0;
+    for (int i = end - 1 - offset; i >= 0 && copied < limit; i--) {
+        if (historyRead(entry->records[i], &out[copied])) {
+            copied++;
+        }
+    }
+    pthread_mutex_unlock(&historyStore.lock);
+    METRIC_END(METRIC_HISTORY_QUERY, start);
+    return copied;
+}
+
+void addGameHistory(User user, const Bet *bet, int res, int payout) {
+    GameHistory h;
+    memset(&h, 0, sizeof(GameHistory));
+
+    time_t now = time(NULL);
+    h.epoch = now;
+    strftime(h.timestamp, sizeof(h.timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    strncpy(h.username, user.username, sizeof(h.username));
+    betLabel(bet->type, bet->selection, h.game_type, sizeof(h.game_type));
+    h.bet_type = (uint8_t)bet->type;
+    h.selection = (uint8_t)bet->selection;
+    h.bet_amount = bet->amount;
+    h.result = res;
+    h.payout = payout;
+
+    METRIC_BEGIN(start);
+    pthread_mutex_lock(&historyStore.lock);
+    // Appenders share the lock; an import holds it exclusively, see importHistory.
+    if (historyStore.fd >= 0 && fileLock(historyStore.fd, F_RDLCK, 0, 0)) {
+        if (write(historyStore.fd, &h, sizeof(h)) != sizeof(h)) {
+            perror(RED "Error writing game history" RESET);
+        } else {
+            METRIC_COUNT(METRIC_HISTORY_BYTES_WRITTEN, sizeof(h));
+        }
+        fileUnlock(historyStore.fd, 0, 0);
+    }
+    if (historyStore.index) {
+        historyIndexRecord(&h, historyStore.recordCount++);
+    }
+    pthread_mutex_unlock(&historyStore.lock);
+    METRIC_END(METRIC_HISTORY_APPEND, start);
+}
+
+// Prompt for the selection that goes with a bet type; returns false on invalid input.
+static bool readBetSelection(int betType, int *betNum) {
+    switch (betType) {
+        case BET_SINGLE:
+            printWheel();
+            printf(BOLD BLUE "Enter the number you want to bet on (0-36): " RESET);
+            if (scanf("%d", betNum) != 1 || *betNum < 0 || *betNum > 36) {
+                printf(RED "Invalid number! Please enter a number between 0 and 36.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_EVEN_ODD:
+            printf(BOLD BLUE "1) Even 2) Odd: " RESET);
+            if (scanf("%d", betNum) != 1 || (*betNum != 1 && *betNum != 2)) {
+                printf(RED "Invalid choice! Please select 1 for Even or 2 for Odd.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_RED_BLACK:
+            printf(BOLD BLUE "1) Red 2) Black: " RESET);
+            if (scanf("%d", betNum) != 1 || (*betNum != 1 && *betNum != 2)) {
                 printf(RED "Invalid choice! Please select 1 for Red or 2 for Black.\n" RESET);
                 clearInputBuffer();
-                return;
+                return false;
+            }
+            break;
+        case BET_HIGH_LOW:
+            printf(BOLD BLUE "1) 1-18 2) 19-36: " RESET);
+            if (scanf("%d", betNum) != 1 || (*betNum != 1 && *betNum != 2)) {
+                printf(RED "Invalid choice! Please select 1 for 1-18 or 2 for 19-36.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_DOZEN:
+            printf(BOLD BLUE "1) 1st Dozen (1-12)\n2) 2nd Dozen (13-24)\n3) 3rd Dozen (25-36)\nEnter your dozen selection: " RESET);
+            if (scanf("%d", betNum) != 1 || *betNum < 1 || *betNum > 3) {
+                printf(RED "Invalid dozen selection! Please enter 1, 2, or 3.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_COLUMN:
+            printf(BOLD BLUE "1) 1st Column (1,4,7...)\n2) 2nd Column (2,5,8...)\n3) 3rd Column (3,6,9...)\nEnter your column selection: " RESET);
+            if (scanf("%d", betNum) != 1 || *betNum < 1 || *betNum > 3) {
+                printf(RED "Invalid column selection! Please enter 1, 2, or 3.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_SPLIT: {
+            int a, b;
+            printWheel();
+            printf(BOLD BLUE "Enter two adjacent numbers (e.g. 17 20): " RESET);
+            if (scanf("%d %d", &a, &b) != 2 || (*betNum = splitSelection(a, b)) < 0) {
+                printf(RED "Invalid split! The numbers must be next to each other on the layout.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        }
+        case BET_STREET:
+            printf(BOLD BLUE "Enter the street (1 = 1-3, 2 = 4-6, ... 12 = 34-36): " RESET);
+            if (scanf("%d", betNum) != 1 || !validBetSelection(BET_STREET, *betNum)) {
+                printf(RED "Invalid street! Please enter a number between 1 and 12.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+        case BET_CORNER:
+            printf(BOLD BLUE "Enter the lowest number of the corner (e.g. 1 for 1-2-4-5): " RESET);
+            if (scanf("%d", betNum) != 1 || !validBetSelection(BET_CORNER, *betNum)) {
+                printf(RED "Invalid corner! The lowest number must be 1-32 and not in the 3rd column.\n" RESET);
+                clearInputBuffer();
+                return false;
+            }
+            break;
+    }
+    clearInputBuffer();
+    return true;
+}
+
+void playRoulette(User *user) {
+    if (user->balance < MIN_BET) {
+        printf(RED "Minimum bet is $10. Balance too low. Please top up or try again later.\n" RESET);
+        return;
+    }
+
+    Bet slip[MAX_SLIP_BETS];
+    int slipCount = 0;
+    int staked = 0;
+
+    printf(WHITE "\nYour Current Balance: $" GREEN "%d" RESET "\n", user->balance);
+
+    // Fill the bet slip; everything on it is settled against a single spin.
+    while (slipCount < MAX_SLIP_BETS && user->balance - staked >= MIN_BET) {
+        int betType, betNum = 0, betAmt;
+
+        printf(BOLD YELLOW "\n--- Bet Slip: %d bet(s), $%d staked ---\n" RESET, slipCount, staked);
+        printf(WHITE "1) Single Number\n2) Even/Odd\n3) Red/Black\n"
+               "4) High/Low (1-18/19-36)\n5) Dozens (1-12, 13-24, 25-36)\n6) Columns\n"
+               "7) Split\n8) Street\n9) Corner\n");
+        printf(slipCount ? GREEN "0) Spin the wheel\n" : RED "0) Cancel\n");
+        printf(BOLD CYAN "Enter your bet type choice: " RESET);
+        if (scanf("%d", &betType) != 1 || betType < 0 || betType > BET_TYPE_COUNT) {
+            if (feof(stdin)) return;
+            printf(RED "Invalid bet type! Please enter a number between 0 and %d.\n" RESET, BET_TYPE_COUNT);
+            clearInputBuffer();
+            continue;
+        }
+        clearInputBuffer();
+        if (betType == 0) break;
+
+        if (!readBetSelection(betType, &betNum)) {
+            if (feof(stdin)) return;
+            continue;
+        }
+
+        int maxAmt = user->balance - staked < MAX_BET ? user->balance - staked : MAX_BET;
+        printf(BOLD YELLOW "Enter your bet amount ($%d-$%d): " RESET, MIN_BET, maxAmt);
+        if (scanf("%d", &betAmt) != 1 || betAmt < MIN_BET || betAmt > maxAmt) {
+            printf(RED "Invalid bet amount! Must be between $10 and $1000 and not exceed your remaining balance.\n" RESET);
+            clearInputBuffer();
+            if (feof(stdin)) return;
+            continue;
+        }
+        clearInputBuffer();
+
+        slip[slipCount++] = (Bet){ betType, betNum, betAmt };
+        staked += betAmt;
+    }
+
+    if (slipCount == 0) {
+        printf(YELLOW "No bets placed.\n" RESET);
+        return;
+    }
+
+    int result;
+    char color[20];
+    spinRoulette(&result, color);
+    BetBatch batch;
+    betBatchInit(&batch);
+    for (int i = 0; i < slipCount; i++) {
+        betBatchAdd(&batch, &slip[i], 0);
+    }
+    settleBatch(&batch, result, user);
+    for (int i = 0; i < slipCount; i++) {
+        addGameHistory(*user, &slip[i], result, batch.payout[i]);
+    }
+
+    METRIC_BEGIN(renderStart);
+    printf(CYAN "\nSpinning the wheel...\n" RESET);
+    printf(BOLD WHITE "Ball lands on: " MAGENTA "%d (%s)\n" RESET, result, color);
+    char proof[96];
+    if (spinProof(&gameSpins, proof, sizeof(proof))) printf(CYAN "Proof: %s\n" RESET, proof);
+
+    int totalWon = 0;
+    for (int i = 0; i < slipCount; i++) {
+        char gameType[30];
+        betLabel(slip[i].type, slip[i].selection, gameType, sizeof(gameType));
+        if (batch.payout[i]) {
+            printf(GREEN "  %-16s $%-5d won $%d\n" RESET, gameType, slip[i].amount, batch.payout[i]);
+        } else {
+            printf(RED "  %-16s $%-5d lost\n" RESET, gameType, slip[i].amount);
+        }
+        totalWon += batch.payout[i] ? batch.payout[i] + slip[i].amount : 0;
+    }
+    betBatchFree(&batch);
+
+    if (totalWon > staked) {
+        printf(GREEN BOLD "\n*** YOU WON $%d! Your new balance: $%d ***\n" RESET, totalWon - staked, user->balance);
+    } else {
+        printf(RED BOLD "\n--- YOU LOST $%d. Your new balance: $%d ---\n" RESET, staked - totalWon, user->balance);
+    }
+    fflush(stdout);
+    METRIC_END(METRIC_RENDER, renderStart);
+
+    updateUser(user);
+}
+
+void showGameHistory(const char* username) {
+    GameHistory page[HISTORY_PAGE_SIZE];
+    int total = historyCountFor(username);
+    int offset = 0;
+
+    while (1) {
+        printf(BOLD CYAN "\n====== Your Game History ======\n" RESET);
+        if (total == 0) {
+            printf(YELLOW "No game history found for %s.\n" RESET, username);
+            printf(BOLD CYAN "===============================\n" RESET);
+            return;
+        }
+
+        printf(YELLOW "%-20s %-15s %-8s %-5s %s\n" RESET, "Time", "Type", "Bet", "Result", "Payout");
+        int n = historyQuery(username, 0, offset, HISTORY_PAGE_SIZE, page);
+        for (int i = 0; i < n; i++) {
+            printf(WHITE "%-20s %-15s $" GREEN "%-7d" RESET " %-5d $" MAGENTA "%d\n" RESET, 
+                     page[i].timestamp,
+                     page[i].game_type, 
+                     page[i].bet_amount,
+                     page[i].result, 
+                     page[i].payout);
+        }
+        printf(BOLD CYAN "=== Games %d-%d of %d ===\n" RESET, offset + 1, offset + n, total);
+        if (total <= HISTORY_PAGE_SIZE) return;
+
+        char nav[8] = "";
+        printf(CYAN "n) Next page  p) Previous page  q) Back: " RESET);
+        getInput(nav, sizeof(nav));
+        if (nav[0] == 'n' && offset + HISTORY_PAGE_SIZE < total) {
+            offset += HISTORY_PAGE_SIZE;
+        } else if (nav[0] == 'p' && offset > 0) {
+            offset -= HISTORY_PAGE_SIZE;
+        } else if (nav[0] != 'n' && nav[0] != 'p') {
+            return;
+        }
+    }
+}
+
+void displayStats(User user) {
+    float winRate = user.games_played ? 
+                    (float)user.games_won / user.games_played * 100 : 0;
+    printf(BOLD MAGENTA "\n=== Your Statistics ===\n" RESET
+           WHITE "Username: %s\n"
+           "Current Balance: $" GREEN "%d\n" RESET
+           WHITE "Games Played: %d\n"
+           "Games Won: %d\n"
+           "Win Percentage: " YELLOW "%.1f%%\n" RESET
+           WHITE "Highest Single Win: $" MAGENTA "%d\n" RESET
+           BOLD MAGENTA "=======================\n" RESET, 
+           user.username, user.balance, user.games_played,
+           user.games_won, winRate, user.highest_win);
+
+    PlayerAnalytics stats;
+    if (analyticsForUser(user.username, &stats)) {
+        const AnalyticsTotals *t = &stats.totals;
+        printf(WHITE "Return to Player: " YELLOW "%.1f%%" RESET WHITE " of $%lld wagered\n"
+               "Net Result: %s$%lld\n" RESET
+               WHITE "Largest Drawdown: $%lld\n"
+               "Longest Streaks: %lld wins, %lld losses\n" RESET,
+               t->wagered ? 100.0 * t->returned / t->wagered : 0, (long long)t->wagered,
+               t->net < 0 ? RED "-" : GREEN, t->net < 0 ? -(long long)t->net : (long long)t->net,
+               (long long)t->drawdown, (long long)stats.streaks.longestWin, (long long)stats.streaks.longestLoss);
+    }
+
+    static const char *boardNames[BOARD_COUNT] = { "Richest", "Biggest Win", "Win Rate" };
+    for (int kind = 0; kind < BOARD_COUNT; kind++) {
+        uint32_t size;
+        int rank = leaderboardRank(kind, user.username, &size);
+        if (rank) {
+            printf(WHITE "%s Rank: " CYAN "#%d" RESET WHITE " of %u\n" RESET, boardNames[kind], rank, size);
+        } else {
+            printf(WHITE "%s Rank: " YELLOW "play %d games to qualify\n" RESET, boardNames[kind], LEADERBOARD_MIN_GAMES);
+        }
+    }
+}
+
+void showLeaderboards(const char *username) {
+    char input[16];
+    printf(BOLD MAGENTA "\n=== Leaderboards ===\n" RESET
+           WHITE "1) Richest\n2) Biggest Single Win\n3) Best Win Rate (min %d games)\n" RESET
+           BOLD CYAN "Enter your choice: " RESET, LEADERBOARD_MIN_GAMES);
+    getInput(input, sizeof(input));
+    int kind = atoi(input) - 1;
+    if (kind < 0 || kind >= BOARD_COUNT) {
+        printf(RED BOLD "Invalid choice!\n" RESET);
+        return;
+    }
+
+    UserRecord *rows[LEADERBOARD_TOP];
+    int64_t scores[LEADERBOARD_TOP];
+    int n = leaderboardTop(kind, LEADERBOARD_TOP, rows, scores);
+    printf(BOLD YELLOW "\n|======|==================|============|\n");
+    printf("| %-4s | %-16s | %-10s |\n", "Rank", "Username", kind == BOARD_WIN_RATE ? "Win %" : "Amount");
+    printf("|======|==================|============|\n" RESET);
+    for (int i = 0; i < n; i++) {
+        const char *color = strcmp(rows[i]->user.username, username) == 0 ? GREEN : WHITE;
+        if (kind == BOARD_WIN_RATE) {
+            printf("%s| %-4d | %-16s | %9.2f%% |\n" RESET, color, i + 1, rows[i]->user.username, scores[i] / 10000.0);
+        } else {
+            printf("%s| %-4d | %-16s | $%-9lld |\n" RESET, color, i + 1, rows[i]->user.username, (long long)scores[i]);
+        }
+    }
+    printf(BOLD YELLOW "|======|==================|============|\n" RESET);
+
+    uint32_t size;
+    int rank = leaderboardRank(kind, username, &size);
+    if (rank) {
+        printf(WHITE "Your rank: " CYAN "#%d" RESET WHITE " of %u\n" RESET, rank, size);
+    } else {
+        printf(YELLOW "You are not on this board yet.\n" RESET);
+    }
+}
+
+void changePassword(User *user) {
+    char current[PASSWORD_LENGTH], newPass[PASSWORD_LENGTH], confirm[PASSWORD_LENGTH];
+    
+    printf(BOLD YELLOW "\n--- Change Password ---\n" RESET);
+    printf(CYAN "Enter your current password: " RESET);
+    getInput(current, sizeof(current));
+    
+    if (!verifyPassword(current, user->password)) {
+        printf(RED BOLD "Incorrect current password! Password change failed.\n" RESET);
+        return;
+    }
+    
+    printf(CYAN "Enter new password (minimum 6 characters): " RESET);
+    getInput(newPass, sizeof(newPass));
+    
+    if (strlen(newPass) < 6) {
+        printf(RED BOLD "Password too short! Minimum 6 characters required.\n" RESET);
+        return;
+    }
+    
+    printf(CYAN "Confirm new password: " RESET);
+    getInput(confirm, sizeof(confirm));
+    
+    if (strcmp(newPass, confirm) != 0) {
+        printf(RED BOLD "Passwords do not match! Password change failed.\n" RESET);
+        return;
+    }
+    
+    hashPassword(newPass); 
+    strcpy(user->password, newPass);
+    updateUser(user);
+    printf(GREEN BOLD "Password changed successfully!\n" RESET);
+}
+
+/* ====== HISTORY ANALYTICS ======
+ * Risk and compliance figures over every record in HISTORY_FILENAME: RTP,
+ * the spread of results, drawdown, streaks and the bet type mix, globally
+ * and per player. Everything is counted per bet, in the order bets were
+ * recorded; a bet's net result is its winnings, or minus its stake.
+ *
+ * The file is mapped and cut into one contiguous range per thread. Every
+ * aggregate is a single-pass summary that merges exactly:
+ *   - sums;
+ *   - Welford's mean and M2, combined with Chan's formula;
+ *   - drawdown, as the net result plus its highest and lowest running totals;
+ *   - streaks, as the runs at either end of a range plus the longest runs
+ *     inside it.
+ * Merging the ranges in file order therefore gives the same answer as one
+ * thread reading the whole file. Quantiles come from a log-bucketed sketch
+ * that is accurate to within 1% of the value. */
+
+static const double sketchGamma = 1.02 / 0.98; // (1 + a) / (1 - a) for 1% accuracy
+
+typedef struct {
+    const GameHistory *records;
+    long first, last; // range scanned by this worker
+    int threads;      // workers whose ranges were merged into this one
+    AnalyticsTotals totals;
+    AnalyticsTotals byType[BET_TYPE_COUNT + 1];
+    QuantileSketch betNet; // net result per bet
+    PlayerAnalytics *players; // open addressing by username
+    int playerCount;
+    int playerCapacity;
+} Analytics;
+
+static void sketchAdd(QuantileSketch *s, int64_t value) {
+    s->count++;
+    if (value == 0) {
+        s->zeros++;
+        return;
+    }
+    double magnitude = value < 0 ? -(double)value : (double)value;
+    int k = (int)ceil(log(magnitude) / log(sketchGamma));
+    if (k < 0) k = 0;
+    if (k >= SKETCH_BINS) k = SKETCH_BINS - 1;
+    (value < 0 ? s->negative : s->positive)[k]++;
+}
+
+static void sketchMerge(QuantileSketch *into, const QuantileSketch *from) {
+    into->count += from->count;
+    into->zeros += from->zeros;
+    for (int k = 0; k < SKETCH_BINS; k++) {
+        into->positive[k] += from->positive[k];
+        into->negative[k] += from->negative[k];
+    }
+}
+
+static double sketchQuantile(const QuantileSketch *s, double q) {
+    if (s->count == 0) return 0;
+    int64_t rank = (int64_t)(q * (s->count - 1)), seen = 0;
+    // Midpoint of the bucket, within 1% of any value in it.
+    for (int k = SKETCH_BINS - 1; k >= 0; k--) {
+        seen += s->negative[k];
+        if (seen > rank) return -2 * pow(sketchGamma, k) / (sketchGamma + 1);
+    }
+    seen += s->zeros;
+    if (seen > rank) return 0;
+    for (int k = 0; k < SKETCH_BINS; k++) {
+        seen += s->positive[k];
+        if (seen > rank) return 2 * pow(sketchGamma, k) / (sketchGamma + 1);
+    }
+    return 0;
+}
+
+static void totalsAdd(AnalyticsTotals *t, const GameHistory *h) {
+    int64_t net = h->payout ? h->payout : -(int64_t)h->bet_amount;
+    t->bets++;
+    t->wins += h->payout != 0;
+    t->wagered += h->bet_amount;
+    t->returned += h->payout ? h->payout + h->bet_amount : 0;
+    double delta = net - t->mean;
+    t->mean += delta / t->bets;
+    t->m2 += delta * (net - t->mean);
+    t->net += net;
+    if (t->net > t->peak) t->peak = t->net;
+    if (t->net < t->trough) t->trough = t->net;
+    if (t->peak - t->net > t->drawdown) t->drawdown = t->peak - t->net;
+}
+
+// Append the bets summarized by `from` after those in `into`.
+static void totalsMerge(AnalyticsTotals *into, const AnalyticsTotals *from) {
+    if (from->bets == 0) return;
+    int64_t bets = into->bets + from->bets;
+    double delta = from->mean - into->mean;
+    into->m2 += from->m2 + delta * delta * ((double)into->bets * from->bets / bets);
+    into->mean += delta * from->bets / bets;
+    into->bets = bets;
+    into->wins += from->wins;
+    into->wagered += from->wagered;
+    into->returned += from->returned;
+
+    int64_t fall = into->peak - (into->net + from->trough);
+    if (from->drawdown > into->drawdown) into->drawdown = from->drawdown;
+    if (fall > into->drawdown) into->drawdown = fall;
+    if (into->net + from->peak > into->peak) into->peak = into->net + from->peak;
+    if (into->net + from->trough < into->trough) into->trough = into->net + from->trough;
+    into->net += from->net;
+}
+
+static void streaksAdd(AnalyticsStreaks *s, int64_t before, bool win) {
+    if (before == 0) {
+        s->firstWin = win;
+        s->leading = 1;
+    } else if (s->leading == before && win == s->firstWin) {
+        s->leading++;
+    }
+    s->trailing = before > 0 && win == s->lastWin ? s->trailing + 1 : 1;
+    s->lastWin = win;
+    int64_t *longest = win ? &s->longestWin : &s->longestLoss;
+    if (s->trailing > *longest) *longest = s->trailing;
+}
+
+// `count` and `fromCount` are the bets behind each summary.
+static void streaksMerge(AnalyticsStreaks *into, int64_t count, const AnalyticsStreaks *from, int64_t fromCount) {
+    if (fromCount == 0) return;
+    if (count == 0) {
+        *into = *from;
+        return;
+    }
+    int64_t joined = into->lastWin == from->firstWin ? into->trailing + from->leading : 0;
+    if (from->longestWin > into->longestWin) into->longestWin = from->longestWin;
+    if (from->longestLoss > into->longestLoss) into->longestLoss = from->longestLoss;
+    int64_t *longest = from->firstWin ? &into->longestWin : &into->longestLoss;
+    if (joined > *longest) *longest = joined;
+
+    if (joined && into->leading == count) into->leading = count + from->leading;
+    into->trailing = joined && from->trailing == fromCount ? fromCount + into->trailing : from->trailing;
+    into->lastWin = from->lastWin;
+}
+
+static PlayerAnalytics *analyticsPlayer(Analytics *a, const char *username) {
+    if ((a->playerCount + 1) * 10 > a->playerCapacity * 7) {
+        PlayerAnalytics *old = a->players;
+        int oldCapacity = a->playerCapacity;
+        a->playerCapacity = oldCapacity ? oldCapacity * 2 : 1024;
+        a->players = xcalloc(a->playerCapacity, sizeof(PlayerAnalytics));
+        for (int i = 0; i < oldCapacity; i++) {
+            if (!old[i].username[0]) continue;
+            unsigned int slot = hashUsername(old[i].username) & (a->playerCapacity - 1);
+            while (a->players[slot].username[0]) slot = (slot + 1) & (a->playerCapacity - 1);
+            a->players[slot] = old[i];
+        }
+        free(old);
+    }
+
+    unsigned int mask = a->playerCapacity - 1;
+    unsigned int slot = hashUsername(username) & mask;
+    while (a->players[slot].username[0]) {
+        if (strcmp(a->players[slot].username, username) == 0) return &a->players[slot];
+        slot = (slot + 1) & mask;
+    }
+    strncpy(a->players[slot].username, username, sizeof(a->players[slot].username) - 1);
+    a->playerCount++;
+    return &a->players[slot];
+}
+
+static void playerAdd(PlayerAnalytics *p, const GameHistory *h) {
+    streaksAdd(&p->streaks, p->totals.bets, h->payout != 0);
+    totalsAdd(&p->totals, h);
+}
+
+static void *analyticsWorker(void *arg) {
+    Analytics *a = arg;
+    char username[50];
+    PlayerAnalytics *player = NULL;
+    for (long i = a->first; i < a->last; i++) {
+        const GameHistory *h = &a->records[i];
+        totalsAdd(&a->totals, h);
+        totalsAdd(&a->byType[h->bet_type <= BET_TYPE_COUNT ? h->bet_type : 0], h);
+        sketchAdd(&a->betNet, h->payout ? h->payout : -(int64_t)h->bet_amount);
+
+        // A slip's bets are recorded together, so consecutive records are often one player's.
+        if (!player || strncmp(h->username, username, sizeof(username)) != 0) {
+            memcpy(username, h->username, sizeof(username));
+            username[sizeof(username) - 1] = '\0';
+            player = analyticsPlayer(a, username);
+        }
+        playerAdd(player, h);
+    }
+    return NULL;
+}
+
+static void analyticsFree(Analytics *a) {
+    free(a->players);
+    a->players = NULL;
+    a->playerCount = a->playerCapacity = 0;
+}
+
+// Append the records scanned by `from` after those scanned by `into`.
+static void analyticsMerge(Analytics *into, const Analytics *from) {
+    totalsMerge(&into->totals, &from->totals);
+    for (int t = 0; t <= BET_TYPE_COUNT; t++) totalsMerge(&into->byType[t], &from->byType[t]);
+    sketchMerge(&into->betNet, &from->betNet);
+    for (int i = 0; i < from->playerCapacity; i++) {
+        const PlayerAnalytics *p = &from->players[i];
+        if (!p->username[0]) continue;
+        PlayerAnalytics *q = analyticsPlayer(into, p->username);
+        streaksMerge(&q->streaks, q->totals.bets, &p->streaks, p->totals.bets);
+        totalsMerge(&q->totals, &p->totals);
+    }
+}
+
+/* Scan the whole history file with `threads` threads. Records appended while
+ * the scan runs are left out. */
+static bool analyzeHistory(const char *path, int threads, Analytics *out) {
+    memset(out, 0, sizeof(Analytics));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(RED "Error opening game history" RESET);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    long count = st.st_size / sizeof(GameHistory);
+    out->threads = 1;
+    if (count == 0) {
+        close(fd);
+        return true;
+    }
+    const GameHistory *records = mmap(NULL, count * sizeof(GameHistory), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (records == MAP_FAILED) {
+        perror(RED "Error mapping game history" RESET);
+        return false;
+    }
+    madvise((void *)records, count * sizeof(GameHistory), MADV_SEQUENTIAL);
+    METRIC_COUNT(METRIC_HISTORY_BYTES_READ, count * sizeof(GameHistory));
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SIM_THREADS) threads = MAX_SIM_THREADS;
+    if (threads > count) threads = (int)count;
+    Analytics *parts = xcalloc(threads, sizeof(Analytics));
+    pthread_t *tids = xmalloc(threads * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++) {
+        parts[t].records = records;
+        parts[t].first = count * t / threads;
+        parts[t].last = count * (t + 1) / threads;
+    }
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, analyticsWorker, &parts[t]) != 0) {
+            perror(RED "Error starting analytics thread" RESET);
+            exit(1);
+        }
+    }
+    analyticsWorker(&parts[0]);
+    *out = parts[0];
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        analyticsMerge(out, &parts[t]);
+        analyticsFree(&parts[t]);
+    }
+    out->records = NULL;
+    out->first = 0;
+    out->last = count;
+    out->threads = threads;
+
+    free(parts);
+    free(tids);
+    munmap((void *)records, count * sizeof(GameHistory));
+    return true;
+}
+
+/* One player's figures, from their games in the history store. Returns false
+ * when they have not played. */
+bool analyticsForUser(const char *username, PlayerAnalytics *out) {
+    memset(out, 0, sizeof(PlayerAnalytics));
+    pthread_mutex_lock(&historyStore.lock);
+    HistoryUserIndex *entry = historyStore.index ? historyIndexFind(username, false) : NULL;
+    for (int i = 0; entry && i < entry->count; i++) {
+        GameHistory h;
+        if (historyRead(entry->records[i], &h)) playerAdd(out, &h);
+    }
+    pthread_mutex_unlock(&historyStore.lock);
+    return out->totals.bets > 0;
+}
+
+static double totalsRtp(const AnalyticsTotals *t) {
+    return t->wagered ? 100.0 * t->returned / t->wagered : 0;
+}
+
+static double totalsStddev(const AnalyticsTotals *t) {
+    return t->bets > 1 ? sqrt(t->m2 / (t->bets - 1)) : 0;
+}
+
+static int comparePlayersByNet(const void *a, const void *b) {
+    const PlayerAnalytics *x = *(PlayerAnalytics *const *)a, *y = *(PlayerAnalytics *const *)b;
+    return (y->totals.net > x->totals.net) - (y->totals.net < x->totals.net);
+}
+
+static void analyticsReport(FILE *out, const Analytics *a, double seconds) {
+    static const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+    static const char *typeNames[BET_TYPE_COUNT + 1] = {
+        "Unknown", "Single Number", "Even/Odd", "Red/Black", "High/Low",
+        "Dozen", "Column", "Split", "Street", "Corner",
+    };
+    const AnalyticsTotals *t = &a->totals;
+    fprintf(out, BOLD CYAN "\n====== History Analytics: %ld bets, %d players ======\n" RESET,
+            a->last, a->playerCount);
+    if (t->bets == 0) {
+        fprintf(out, YELLOW "No games recorded yet.\n" RESET);
+        return;
+    }
+    fprintf(out, WHITE "Wagered $%lld, returned $%lld, player net $%lld\n"
+            "RTP " YELLOW "%.2f%%" WHITE ", house edge %.2f%%, win rate %.2f%%\n"
+            "Net per bet: mean %.2f, stddev %.2f\n"
+            "Largest fall in players' combined net: $%lld\n" RESET,
+            (long long)t->wagered, (long long)t->returned, (long long)t->net, totalsRtp(t), 100 - totalsRtp(t),
+            100.0 * t->wins / t->bets, t->mean, totalsStddev(t), (long long)t->drawdown);
+
+    fprintf(out, YELLOW "\n%-16s %10s %8s %8s %10s\n" RESET, "Bet type", "Bets", "Share", "RTP", "Stddev");
+    for (int type = 0; type <= BET_TYPE_COUNT; type++) {
+        const AnalyticsTotals *bt = &a->byType[type];
+        if (bt->bets == 0) continue;
+        fprintf(out, "%-16s %10lld %7.2f%% %7.2f%% %10.2f\n", typeNames[type], (long long)bt->bets,
+                100.0 * bt->wagered / t->wagered, totalsRtp(bt), totalsStddev(bt));
+    }
+
+    // Players by net result, biggest winners first: the house's exposure.
+    PlayerAnalytics **players = xmalloc(a->playerCount * sizeof(PlayerAnalytics *));
+    QuantileSketch *playerNet = xcalloc(1, sizeof(QuantileSketch));
+    int n = 0;
+    for (int i = 0; i < a->playerCapacity; i++) {
+        if (!a->players[i].username[0]) continue;
+        players[n++] = &a->players[i];
+        sketchAdd(playerNet, a->players[i].totals.net);
+    }
+    qsort(players, n, sizeof(PlayerAnalytics *), comparePlayersByNet);
+
+    fprintf(out, YELLOW "\n%-8s %12s %12s\n" RESET, "Quantile", "Net per bet", "Net/player");
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(out, "p%-7g %12.0f %12.0f\n", quantiles[q] * 100, sketchQuantile(&a->betNet, quantiles[q]),
+                sketchQuantile(playerNet, quantiles[q]));
+    }
+
+    fprintf(out, YELLOW "\n%-16s %8s %8s %10s %9s %10s %6s %6s\n" RESET, "Player", "Bets", "RTP", "Net",
+            "Stddev", "Drawdown", "Win", "Loss");
+    for (int i = 0; i < n && i < ANALYTICS_TOP_PLAYERS; i++) {
+        const PlayerAnalytics *p = players[i];
+        fprintf(out, "%-16s %8lld %7.2f%% %10lld %9.2f %10lld %6lld %6lld\n", p->username,
+                (long long)p->totals.bets, totalsRtp(&p->totals), (long long)p->totals.net, totalsStddev(&p->totals),
+                (long long)p->totals.drawdown, (long long)p->streaks.longestWin, (long long)p->streaks.longestLoss);
+    }
+    fprintf(out, CYAN "\nScanned in %.3fs with %d thread%s (%.0f MB/s)\n" RESET, seconds, a->threads,
+            a->threads == 1 ? "" : "s", a->last * sizeof(GameHistory) / 1e6 / (seconds > 0 ? seconds : 1e-9));
+    free(playerNet);
+    free(players);
+}
+
+int runAnalytics(int threads) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Analytics *a = xmalloc(sizeof(Analytics));
+    if (!analyzeHistory(HISTORY_FILENAME, threads, a)) {
+        free(a);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    analyticsReport(stdout, a, seconds);
+    analyticsFree(a);
+    free(a);
+    return 1;
+}
+
+/* ====== HISTORY EXPORT ======
+ * --export-history writes HISTORY_FILENAME as a compact columnar file for
+ * offline analysis, and --import-history appends one back. Each chunk's
+ * columns are encoded for the values in them:
+ *   - usernames and game types are replaced by dictionary ids;
+ *   - timestamps are stored as epoch deltas;
+ *   - pockets are packed into 6 bits.
+ * A chunk carries only the dictionary entries new to it. The writer
+ * therefore keeps one chunk of rows in memory, and the reader decodes one
+ * chunk at a time. Timestamp strings are not stored: the importer rebuilds
+ * them from the epoch in local time, as addGameHistory formats them. */
+
+static void columnReserve(ColumnBuffer *c, size_t extra) {
+    if (c->len + extra <= c->cap) return;
+    c->cap = c->cap * 2 > c->len + extra ? c->cap * 2 : c->len + extra + 4096;
+    c->data = xrealloc(c->data, c->cap);
+}
+
+static void columnPutVarint(ColumnBuffer *c, uint64_t value) {
+    columnReserve(c, 10);
+    while (value >= 0x80) {
+        c->data[c->len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    c->data[c->len++] = (uint8_t)value;
+}
+
+static bool columnGetVarint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Small magnitudes of either sign become small varints.
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void dictionaryInit(ColumnDictionary *d, size_t entrySize) {
+    memset(d, 0, sizeof(ColumnDictionary));
+    d->entrySize = entrySize;
+}
+
+static void dictionaryFree(ColumnDictionary *d) {
+    free(d->entries);
+    free(d->slots);
+    dictionaryInit(d, d->entrySize);
+}
+
+static const void *dictionaryAt(const ColumnDictionary *d, int id) {
+    return d->entries + (size_t)id * d->entrySize;
+}
+
+static int dictionaryAppend(ColumnDictionary *d, const void *entry) {
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity ? d->capacity * 2 : 256;
+        d->entries = xrealloc(d->entries, (size_t)d->capacity * d->entrySize);
+    }
+    memcpy(d->entries + (size_t)d->count * d->entrySize, entry, d->entrySize);
+    return d->count++;
+}
+
+static unsigned int dictionaryHash(const ColumnDictionary *d, const void *entry) {
+    const uint8_t *bytes = entry;
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < d->entrySize; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The id of `entry`, adding it if it is new.
+static int dictionaryIntern(ColumnDictionary *d, const void *entry) {
+    if ((d->count + 1) * 10 > d->slotCapacity * 7) {
+        free(d->slots);
+        d->slotCapacity = d->slotCapacity ? d->slotCapacity * 2 : 1024;
+        d->slots = xcalloc(d->slotCapacity, sizeof(int));
+        for (int id = 0; id < d->count; id++) {
+            unsigned int slot = dictionaryHash(d, dictionaryAt(d, id)) & (d->slotCapacity - 1);
+            while (d->slots[slot]) slot = (slot + 1) & (d->slotCapacity - 1);
+            d->slots[slot] = id + 1;
+        }
+    }
+    unsigned int mask = d->slotCapacity - 1;
+    unsigned int slot = dictionaryHash(d, entry) & mask;
+    while (d->slots[slot]) {
+        if (memcmp(dictionaryAt(d, d->slots[slot] - 1), entry, d->entrySize) == 0) return d->slots[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+    d->slots[slot] = dictionaryAppend(d, entry) + 1;
+    return d->count - 1;
+}
+
+bool historyColumnsCreate(HistoryColumnsWriter *w, const char *path) {
+    memset(w, 0, sizeof(HistoryColumnsWriter));
+    w->path = path;
+    snprintf(w->tmpPath, sizeof(w->tmpPath), "%s.tmp", path);
+    w->out = fopen(w->tmpPath, "wb");
+    if (!w->out) {
+        perror(RED "Error creating history export" RESET);
+        return false;
+    }
+    setvbuf(w->out, NULL, _IOFBF, 1 << 20);
+    dictionaryInit(&w->names, sizeof(((GameHistory *)0)->username));
+    dictionaryInit(&w->gameTypes, sizeof(HistoryGameType));
+
+    HistoryColumnsHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_COLUMNS_MAGIC, sizeof(header.magic));
+    header.version = HISTORY_COLUMNS_VERSION;
+    header.chunkRows = HISTORY_CHUNK_ROWS;
+    fwrite(&header, sizeof(header), 1, w->out);
+    return true;
+}
+
+static void historyColumnsFlush(HistoryColumnsWriter *w) {
+    ColumnBuffer *pockets = &w->columns[HISTORY_COLUMN_POCKET];
+    columnReserve(pockets, 8);
+    for (; w->bitCount > 0; w->bitCount -= 8, w->bits >>= 8) {
+        pockets->data[pockets->len++] = (uint8_t)w->bits;
+    }
+    w->bitCount = 0;
+    w->bits = 0;
+
+    ColumnBuffer *names = &w->columns[HISTORY_COLUMN_NAMES];
+    for (int id = w->namesWritten; id < w->names.count; id++) {
+        const char *name = dictionaryAt(&w->names, id);
+        size_t len = strnlen(name, w->names.entrySize);
+        columnReserve(names, len + 1);
+        names->data[names->len++] = (uint8_t)len;
+        memcpy(names->data + names->len, name, len);
+        names->len += len;
+    }
+    ColumnBuffer *gameTypes = &w->columns[HISTORY_COLUMN_GAME_TYPES];
+    for (int id = w->gameTypesWritten; id < w->gameTypes.count; id++) {
+        const HistoryGameType *type = dictionaryAt(&w->gameTypes, id);
+        size_t len = strnlen(type->label, sizeof(type->label));
+        columnReserve(gameTypes, len + 3);
+        gameTypes->data[gameTypes->len++] = type->betType;
+        gameTypes->data[gameTypes->len++] = type->selection;
+        gameTypes->data[gameTypes->len++] = (uint8_t)len;
+        memcpy(gameTypes->data + gameTypes->len, type->label, len);
+        gameTypes->len += len;
+    }
+
+    HistoryChunkHeader header;
+    memset(&header, 0, sizeof(header));
+    header.rows = w->rows;
+    header.newNames = w->names.count - w->namesWritten;
+    header.newGameTypes = w->gameTypes.count - w->gameTypesWritten;
+    for (int c = 0; c < HISTORY_COLUMN_COUNT; c++) header.bytes[c] = (uint32_t)w->columns[c].len;
+    fwrite(&header, sizeof(header), 1, w->out);
+    for (int c = 0; c < HISTORY_COLUMN_COUNT; c++) {
+        fwrite(w->columns[c].data, 1, w->columns[c].len, w->out);
+        w->columns[c].len = 0;
+    }
+    w->namesWritten = w->names.count;
+    w->gameTypesWritten = w->gameTypes.count;
+    w->rows = 0;
+    w->lastEpoch = 0;
+}
+
+void historyColumnsAppend(HistoryColumnsWriter *w, const GameHistory *h) {
+    if (h->result < 0 || h->result >= 64) {
+        // Not a pocket; such a record can only come from a damaged file.
+        w->failed = true;
+        return;
+    }
+    char name[sizeof(h->username)] = { 0 };
+    memcpy(name, h->username, strnlen(h->username, sizeof(name) - 1));
+    HistoryGameType type;
+    memset(&type, 0, sizeof(type));
+    memcpy(type.label, h->game_type, strnlen(h->game_type, sizeof(type.label) - 1));
+    type.betType = h->bet_type;
+    type.selection = h->selection;
+
+    columnPutVarint(&w->columns[HISTORY_COLUMN_USER], dictionaryIntern(&w->names, name));
+    columnPutVarint(&w->columns[HISTORY_COLUMN_GAME], dictionaryIntern(&w->gameTypes, &type));
+    columnPutVarint(&w->columns[HISTORY_COLUMN_EPOCH], zigzag(h->epoch - w->lastEpoch));
+    columnPutVarint(&w->columns[HISTORY_COLUMN_AMOUNT], zigzag(h->bet_amount));
+    columnPutVarint(&w->columns[HISTORY_COLUMN_PAYOUT], zigzag(h->payout));
+    w->lastEpoch = h->epoch;
+
+    w->bits |= (uint64_t)h->result << w->bitCount;
+    w->bitCount += 6;
+    ColumnBuffer *pockets = &w->columns[HISTORY_COLUMN_POCKET];
+    columnReserve(pockets, 1);
+    for (; w->bitCount >= 8; w->bitCount -= 8, w->bits >>= 8) {
+        pockets->data[pockets->len++] = (uint8_t)w->bits;
+    }
+
+    w->totalRows++;
+    if (++w->rows == HISTORY_CHUNK_ROWS) historyColumnsFlush(w);
+}
+
+// Write the last chunk and the end marker, then move the file into place.
+bool historyColumnsFinish(HistoryColumnsWriter *w) {
+    if (w->rows > 0) historyColumnsFlush(w);
+    HistoryChunkHeader end;
+    memset(&end, 0, sizeof(end));
+    fwrite(&end, sizeof(end), 1, w->out);
+
+    bool ok = !w->failed && fflush(w->out) == 0 && fsync(fileno(w->out)) == 0;
+    ok = fclose(w->out) == 0 && ok;
+    if (ok && rename(w->tmpPath, w->path) != 0) {
+        perror(RED "Error writing history export" RESET);
+        ok = false;
+    } else if (!ok) {
+        if (w->failed) printf(RED BOLD "Game history holds a damaged record; export abandoned.\n" RESET);
+        else perror(RED "Error writing history export" RESET);
+    }
+    if (!ok) unlink(w->tmpPath);
+
+    for (int c = 0; c < HISTORY_COLUMN_COUNT; c++) free(w->columns[c].data);
+    dictionaryFree(&w->names);
+    dictionaryFree(&w->gameTypes);
+    return ok;
+}
+
+bool historyColumnsOpen(HistoryColumnsReader *r, const char *path) {
+    memset(r, 0, sizeof(HistoryColumnsReader));
+    r->in = fopen(path, "rb");
+    if (!r->in) {
+        perror(RED "Error opening history export" RESET);
+        return false;
+    }
+    setvbuf(r->in, NULL, _IOFBF, 1 << 20);
+    HistoryColumnsHeader header;
+    if (fread(&header, sizeof(header), 1, r->in) != 1 ||
+        memcmp(header.magic, HISTORY_COLUMNS_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != HISTORY_COLUMNS_VERSION || header.chunkRows > HISTORY_CHUNK_ROWS) {
+        printf(RED BOLD "%s is not a history export!\n" RESET, path);
+        fclose(r->in);
+        return false;
+    }
+    dictionaryInit(&r->names, sizeof(((GameHistory *)0)->username));
+    dictionaryInit(&r->gameTypes, sizeof(HistoryGameType));
+    r->rows = xmalloc(HISTORY_CHUNK_ROWS * sizeof(GameHistory));
+    r->stampMinute = -1;
+    return true;
+}
+
+// "%Y-%m-%d %H:%M:%S" in local time, calling localtime once a minute.
+static void historyColumnsStamp(HistoryColumnsReader *r, int64_t epoch, char *out) {
+    time_t minute = (time_t)(epoch - ((epoch % 60) + 60) % 60);
+    if (minute != r->stampMinute) {
+        struct tm tm;
+        localtime_r(&minute, &tm);
+        strftime(r->stampPrefix, sizeof(r->stampPrefix), "%Y-%m-%d %H:%M:", &tm);
+        r->stampMinute = minute;
+    }
+    int second = (int)(epoch - minute);
+    size_t len = strnlen(r->stampPrefix, sizeof(((GameHistory *)0)->timestamp) - 3);
+    memcpy(out, r->stampPrefix, len);
+    out[len] = (char)('0' + second / 10);
+    out[len + 1] = (char)('0' + second % 10);
+    out[len + 2] = '\0';
+}
+
+static bool historyColumnsDecode(HistoryColumnsReader *r, const HistoryChunkHeader *header) {
+    const uint8_t *p[HISTORY_COLUMN_COUNT], *end[HISTORY_COLUMN_COUNT];
+    const uint8_t *at = r->chunk;
+    for (int c = 0; c < HISTORY_COLUMN_COUNT; c++) {
+        p[c] = at;
+        at += header->bytes[c];
+        end[c] = at;
+    }
+
+    for (uint32_t i = 0; i < header->newNames; i++) {
+        char name[sizeof(((GameHistory *)0)->username)] = { 0 };
+        const uint8_t **q = &p[HISTORY_COLUMN_NAMES];
+        if (*q >= end[HISTORY_COLUMN_NAMES] || **q >= sizeof(name) || end[HISTORY_COLUMN_NAMES] - *q < 1 + **q) return false;
+        memcpy(name, *q + 1, **q);
+        *q += 1 + **q;
+        dictionaryAppend(&r->names, name);
+    }
+    for (uint32_t i = 0; i < header->newGameTypes; i++) {
+        HistoryGameType type;
+        memset(&type, 0, sizeof(type));
+        const uint8_t **q = &p[HISTORY_COLUMN_GAME_TYPES];
+        if (end[HISTORY_COLUMN_GAME_TYPES] - *q < 3 || (*q)[2] >= sizeof(type.label) ||
+            end[HISTORY_COLUMN_GAME_TYPES] - *q < 3 + (*q)[2]) {
+            return false;
+        }
+        type.betType = (*q)[0];
+        type.selection = (*q)[1];
+        memcpy(type.label, *q + 3, (*q)[2]);
+        *q += 3 + (*q)[2];
+        dictionaryAppend(&r->gameTypes, &type);
+    }
+
+    int64_t epoch = 0;
+    uint64_t bits = 0;
+    int bitCount = 0;
+    for (uint32_t i = 0; i < header->rows; i++) {
+        GameHistory *h = &r->rows[i];
+        uint64_t user, game, delta, amount, payout;
+        if (!columnGetVarint(&p[HISTORY_COLUMN_USER], end[HISTORY_COLUMN_USER], &user) || user >= (uint64_t)r->names.count ||
+            !columnGetVarint(&p[HISTORY_COLUMN_GAME], end[HISTORY_COLUMN_GAME], &game) || game >= (uint64_t)r->gameTypes.count ||
+            !columnGetVarint(&p[HISTORY_COLUMN_EPOCH], end[HISTORY_COLUMN_EPOCH], &delta) ||
+            !columnGetVarint(&p[HISTORY_COLUMN_AMOUNT], end[HISTORY_COLUMN_AMOUNT], &amount) ||
+            !columnGetVarint(&p[HISTORY_COLUMN_PAYOUT], end[HISTORY_COLUMN_PAYOUT], &payout)) {
+            return false;
+        }
+        while (bitCount < 6) {
+            if (p[HISTORY_COLUMN_POCKET] >= end[HISTORY_COLUMN_POCKET]) return false;
+            bits |= (uint64_t)*p[HISTORY_COLUMN_POCKET]++ << bitCount;
+            bitCount += 8;
+        }
+
+        const HistoryGameType *type = dictionaryAt(&r->gameTypes, (int)game);
+        memset(h, 0, sizeof(GameHistory));
+        memcpy(h->username, dictionaryAt(&r->names, (int)user), sizeof(h->username));
+        memcpy(h->game_type, type->label, sizeof(type->label));
+        h->bet_type = type->betType;
+        h->selection = type->selection;
+        epoch += unzigzag(delta);
+        h->epoch = epoch;
+        historyColumnsStamp(r, epoch, h->timestamp);
+        h->bet_amount = (int)unzigzag(amount);
+        h->payout = (int)unzigzag(payout);
+        h->result = (int)(bits & 63);
+        bits >>= 6;
+        bitCount -= 6;
+    }
+    return true;
+}
+
+/* The next chunk's rows, or NULL at the end of the file or on damage, which
+ * sets `failed`. The rows stay valid until the next call. */
+const GameHistory *historyColumnsNext(HistoryColumnsReader *r, int *count) {
+    HistoryChunkHeader header;
+    if (r->failed || fread(&header, sizeof(header), 1, r->in) != 1) {
+        r->failed = true; // no end marker: truncated
+        return NULL;
+    }
+    if (header.rows == 0) return NULL;
+
+    size_t total = 0;
+    for (int c = 0; c < HISTORY_COLUMN_COUNT; c++) total += header.bytes[c];
+    if (header.rows > HISTORY_CHUNK_ROWS || total > (size_t)HISTORY_CHUNK_ROWS * 64 + (1 << 24)) {
+        r->failed = true;
+        return NULL;
+    }
+    if (total > r->chunkCap) {
+        r->chunkCap = total;
+        r->chunk = xrealloc(r->chunk, r->chunkCap);
+    }
+    if (fread(r->chunk, 1, total, r->in) != total || !historyColumnsDecode(r, &header)) {
+        r->failed = true;
+        return NULL;
+    }
+    *count = (int)header.rows;
+    return r->rows;
+}
+
+void historyColumnsClose(HistoryColumnsReader *r) {
+    fclose(r->in);
+    dictionaryFree(&r->names);
+    dictionaryFree(&r->gameTypes);
+    free(r->chunk);
+    free(r->rows);
+}
+
+int exportHistory(const char *path) {
+    int fd = open(HISTORY_FILENAME, O_RDONLY);
+    if (fd < 0) {
+        perror(RED "Error opening game history" RESET);
+        return 0;
+    }
+    HistoryColumnsWriter *w = xmalloc(sizeof(HistoryColumnsWriter));
+    if (!historyColumnsCreate(w, path)) {
+        free(w);
+        close(fd);
+        return 0;
+    }
+
+    enum { BLOCK = 4096 };
+    GameHistory *block = xmalloc(BLOCK * sizeof(GameHistory));
+    ssize_t got;
+    off_t pos = 0;
+    while ((got = pread(fd, block, BLOCK * sizeof(GameHistory), pos)) > 0) {
+        int n = got / sizeof(GameHistory);
+        METRIC_COUNT(METRIC_HISTORY_BYTES_READ, got);
+        for (int i = 0; i < n; i++) historyColumnsAppend(w, &block[i]);
+        pos += (off_t)n * sizeof(GameHistory);
+        if (got % sizeof(GameHistory)) break;
+    }
+    free(block);
+    close(fd);
+
+    long long rows = w->totalRows;
+    bool ok = historyColumnsFinish(w);
+    free(w);
+    struct stat st;
+    if (ok && stat(path, &st) == 0) {
+        printf(GREEN "Exported %lld games to %s: %lld bytes, %.1f per game (%.1fx smaller)\n" RESET, rows, path,
+               (long long)st.st_size, rows ? (double)st.st_size / rows : 0,
+               st.st_size ? (double)pos / st.st_size : 0);
+    }
+    return ok;
+}
+
+/* Append an export to HISTORY_FILENAME, all of it or (on damage) none of it.
+ * The file is locked for the whole import so running instances hold their
+ * games back until it is done, and a rollback only ever cuts imported rows. */
+int importHistory(const char *path) {
+    HistoryColumnsReader r;
+    if (!historyColumnsOpen(&r, path)) return 0;
+    int fd = open(HISTORY_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0 && !fileLock(fd, F_WRLCK, 0, 0)) {
+        close(fd);
+        historyColumnsClose(&r);
+        return 0;
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(RED "Error opening game history" RESET);
+        if (fd >= 0) close(fd);
+        historyColumnsClose(&r);
+        return 0;
+    }
+
+    long long rows = 0;
+    bool ok = true;
+    const GameHistory *chunk;
+    int count;
+    while (ok && (chunk = historyColumnsNext(&r, &count))) {
+        size_t bytes = (size_t)count * sizeof(GameHistory);
+        if (write(fd, chunk, bytes) != (ssize_t)bytes) {
+            perror(RED "Error writing game history" RESET);
+            ok = false;
+        }
+        METRIC_COUNT(METRIC_HISTORY_BYTES_WRITTEN, bytes);
+        rows += count;
+    }
+    if (r.failed) {
+        printf(RED BOLD "%s is truncated or damaged; nothing was imported.\n" RESET, path);
+        ok = false;
+    }
+    if (!ok && ftruncate(fd, st.st_size) != 0) {
+        perror(RED "Error rolling back game history" RESET);
+    }
+    if (ok && fdatasync(fd) != 0) {
+        perror(RED "Error writing game history" RESET);
+        ok = false;
+    }
+    close(fd);
+    historyColumnsClose(&r);
+    if (ok) printf(GREEN "Imported %lld games from %s\n" RESET, rows, path);
+    return ok;
+}
+
+/* ====== SESSIONS ======
+ * A session is one logged-in player: their User, the record it commits to
+ * and an opaque random token. Idle sessions expire through timer wheels of
+ * one-second slots, one wheel per thread that drives sessions, so touching a
+ * session on every command and expiring any number of them are O(1) each
+ * and take no lock. A session due more than a lap ahead stays in its slot
+ * until the wheel comes round to it again.
+ *
+ * Expiry writes the session back to the user store instead of ending the
+ * process. A server session whose connection drops is parked on the shared
+ * wheel in the session table, where it can be resumed by token or by
+ * logging in again until it expires. */
+
+static int sessionSlot(time_t when) {
+    return (int)(when & (SESSION_WHEEL_SLOTS - 1));
+}
+
+void sessionWheelInsert(SessionWheel *wheel, Session *session) {
+    // An overdue session goes in the next slot the wheel visits.
+    session->slot = sessionSlot(session->expires < wheel->now ? wheel->now : session->expires);
+    session->prev = NULL;
+    session->next = wheel->slots[session->slot];
+    if (session->next) session->next->prev = session;
+    wheel->slots[session->slot] = session;
+    wheel->count++;
+}
+
+void sessionWheelRemove(SessionWheel *wheel, Session *session) {
+    if (session->slot < 0) return;
+    if (session->prev) session->prev->next = session->next;
+    else wheel->slots[session->slot] = session->next;
+    if (session->next) session->next->prev = session->prev;
+    session->prev = session->next = NULL;
+    session->slot = -1;
+    wheel->count--;
+}
+
+// Push the session's expiry out to a full timeout from now.
+void sessionTouch(SessionWheel *wheel, Session *session, time_t now) {
+    if (session->slot >= 0 && session->expires == now + INACTIVITY_TIMEOUT) return;
+    sessionWheelRemove(wheel, session);
+    session->expires = now + INACTIVITY_TIMEOUT;
+    sessionWheelInsert(wheel, session);
+}
+
+/* Unlink every session due by `now` and return them chained through `next`.
+ * Each second since the last call visits one slot; after a gap of more than
+ * a lap, every slot is visited once. */
+Session *sessionWheelAdvance(SessionWheel *wheel, time_t now) {
+    time_t from = wheel->now;
+    if (from == 0 || now - from >= SESSION_WHEEL_SLOTS) from = now - SESSION_WHEEL_SLOTS + 1;
+
+    Session *expired = NULL;
+    for (time_t t = from; t <= now && wheel->count > 0; t++) {
+        Session *session = wheel->slots[sessionSlot(t)];
+        while (session) {
+            Session *next = session->next;
+            if (session->expires <= now) {
+                sessionWheelRemove(wheel, session);
+                session->next = expired;
+                expired = session;
             }
+            session = next;
+        }
+    }
+    if (now >= wheel->now) wheel->now = now + 1;
+    return expired;
+}
+
+static Session **sessionBucket(const char *token) {
+    return &sessions.buckets[hashUsername(token) & (sessions.bucketCount - 1)];
+}
+
+static void sessionTableGrow(void) {
+    Session **old = sessions.buckets;
+    size_t oldCount = sessions.bucketCount;
+    sessions.bucketCount = oldCount ? oldCount * 2 : 64;
+    sessions.buckets = xcalloc(sessions.bucketCount, sizeof(Session *));
+    for (size_t i = 0; i < oldCount; i++) {
+        for (Session *session = old[i], *next; session; session = next) {
+            next = session->hashNext;
+            Session **bucket = sessionBucket(session->token);
+            session->hashNext = *bucket;
+            *bucket = session;
+        }
+    }
+    free(old);
+}
+
+Session *sessionCreate(const User *user, UserRecord *rec) {
+    Session *session = xcalloc(1, sizeof(Session));
+    uint8_t raw[SESSION_TOKEN_BYTES];
+    randomBytes(raw, sizeof(raw));
+    for (int i = 0; i < SESSION_TOKEN_BYTES; i++) {
+        snprintf(session->token + 2 * i, 3, "%02x", raw[i]);
+    }
+    session->user = *user;
+    session->rec = rec;
+    session->slot = -1;
+
+    pthread_mutex_lock(&sessions.lock);
+    if (sessions.count >= sessions.bucketCount) sessionTableGrow();
+    Session **bucket = sessionBucket(session->token);
+    session->hashNext = *bucket;
+    *bucket = session;
+    sessions.count++;
+    if (rec) rec->session = session;
+    pthread_mutex_unlock(&sessions.lock);
+    return session;
+}
+
+// Commit whatever the session holds that the store does not have yet.
+static void sessionFlush(Session *session) {
+    UserRecord *rec = session->rec;
+    if (rec && !rec->deleted && memcmp(&rec->user, &session->user, sizeof(User)) != 0) {
+        userStoreCommit(rec, &session->user);
+    }
+}
+
+// Flush a session whose connection dropped and keep it until it expires.
+void sessionPark(Session *session) {
+    sessionFlush(session);
+    pthread_mutex_lock(&sessions.lock);
+    session->owner = NULL;
+    session->parked = true;
+    sessionWheelInsert(&sessions.parked, session);
+    pthread_mutex_unlock(&sessions.lock);
+}
+
+static void sessionUnparkLocked(Session *session) {
+    sessionWheelRemove(&sessions.parked, session);
+    session->parked = false;
+}
+
+// Take back a parked session by its token. NULL if there is none to resume.
+Session *sessionResume(const char *token) {
+    pthread_mutex_lock(&sessions.lock);
+    Session *session = sessions.bucketCount ? *sessionBucket(token) : NULL;
+    while (session && strcmp(session->token, token) != 0) session = session->hashNext;
+    if (session && session->parked) sessionUnparkLocked(session);
+    else session = NULL;
+    pthread_mutex_unlock(&sessions.lock);
+    return session;
+}
+
+/* For a player who lost the token along with the connection: copy out the
+ * token and password hash of the user's parked session, so the password can
+ * be checked without the lock and the session then taken back with
+ * sessionResume. False if the user has no parked session. */
+bool sessionParkedCredentials(UserRecord *rec, char *token, char *stored) {
+    pthread_mutex_lock(&sessions.lock);
+    Session *session = rec->session;
+    bool parked = session && session->parked;
+    if (parked) {
+        memcpy(token, session->token, sizeof(session->token));
+        memcpy(stored, session->user.password, PASSWORD_LENGTH);
+    }
+    pthread_mutex_unlock(&sessions.lock);
+    return parked;
+}
+
+void sessionExpireParked(time_t now) {
+    pthread_mutex_lock(&sessions.lock);
+    Session *expired = sessionWheelAdvance(&sessions.parked, now);
+    for (Session *session = expired; session; session = session->next) session->parked = false;
+    pthread_mutex_unlock(&sessions.lock);
+
+    for (Session *session = expired, *next; session; session = next) {
+        next = session->next;
+        sessionEnd(session);
+    }
+}
+
+// Flush and free a session. It must already be off every wheel.
+void sessionEnd(Session *session) {
+    sessionFlush(session);
+    UserRecord *rec = session->rec;
+
+    pthread_mutex_lock(&sessions.lock);
+    Session **link = sessionBucket(session->token);
+    while (*link != session) link = &(*link)->hashNext;
+    *link = session->hashNext;
+    sessions.count--;
+    if (rec && rec->session == session) rec->session = NULL;
+    pthread_mutex_unlock(&sessions.lock);
+
+    if (rec) __atomic_store_n(&rec->online, false, __ATOMIC_RELEASE);
+    free(session);
+}
+
+// End every parked session; the threads driving the others have stopped.
+void sessionTableClose(void) {
+    for (int slot = 0; slot < SESSION_WHEEL_SLOTS; slot++) {
+        while (sessions.parked.slots[slot]) {
+            Session *session = sessions.parked.slots[slot];
+            sessionUnparkLocked(session);
+            sessionEnd(session);
+        }
+    }
+    free(sessions.buckets);
+    sessions.buckets = NULL;
+    sessions.bucketCount = sessions.count = 0;
+}
+
+/* ====== TABLE SERVER ======
+ * Players connect over TCP or a Unix socket and speak a line protocol.
+ * Players sit at shared tables; bets placed during a round go on the
+ * player's slip and every table spins once per round, settling all of its
+ * slips together through settleBatch.
+ *
+ *   REGISTER <user> <password>     LOGIN <user> <password>
+ *   JOIN <table>                   LEAVE
+ *   BET <type> <selection> <amt>   (split selection may be given as 17-20)
+ *   BALANCE                        HISTORY [page]
+ *   RANK                           RESUME <token>
+ *   QUIT
+ *
+ * Replies start with OK or ERR; table broadcasts start with EVENT. A login
+ * hands out a session token; if the connection drops without QUIT, RESUME
+ * with that token (or logging in again) picks the session back up until it
+ * has been idle for INACTIVITY_TIMEOUT. Idle connected players are sent
+ * EVENT EXPIRED and disconnected.
+ *
+ * Work is split into shards, each a thread with its own epoll loop. Shard 0
+ * is the lobby: it accepts connections and handles logins. The worker shards
+ * each own a fixed subset of the tables, and a client belongs to exactly one
+ * shard at a time, moving between them through a mailbox when it joins or
+ * leaves a table. A seated player's state is therefore only ever touched by
+ * its table's thread, and spins and settlement run without locks.
+ *
+ * Password checks and hashes take tens of milliseconds of scrypt, so the
+ * lobby hands them to LOGIN_WORKERS threads. It still does everything that
+ * reads or changes users and sessions itself: the client leaves the lobby's
+ * epoll set while its KDF runs and comes back through the lobby's mailbox
+ * with the result, and its later commands wait in its input buffer. Failed
+ * logins back off per user and per connection, and a full queue is refused,
+ * so guessing passwords can neither stall the lobby nor tie up the KDF
+ * threads for long. */
+
+typedef struct Shard Shard;
+
+typedef struct {
+    int fd;
+    Shard *owner;
+    Shard *handoff;     // set by a command that moves the client to another shard
+    char in[CLIENT_LINE_MAX];
+    int inLen;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    bool wantWrite;
+    bool closing;
+    bool quitting;      // end the session on close instead of parking it
+    Session *session;   // NULL until logged in
+    int table;          // 0 when not seated
+    int joining;        // table to sit at once the owning shard adopts the client
+    Bet slip[MAX_SLIP_BETS];
+    int slipCount;
+    int staked;
+    struct LoginJob *login; // KDF work in flight for a LOGIN or REGISTER, NULL if none
+    uint8_t loginFailures;  // failed logins in a row on this connection
+    time_t loginRetryAt;    // no login from this connection before this
+} Client;
+
+// A login or registration waiting on, or back from, a KDF thread.
+typedef struct LoginJob {
+    struct LoginJob *next;
+    Client *client;
+    bool registering;
+    User user;          // the row as loaded; for a login, password holds the stored hash
+    char password[PASSWORD_LENGTH]; // as typed
+    char token[2 * SESSION_TOKEN_BYTES + 1]; // parked session to take back, "" if none
+    bool verified;      // password matched user.password
+    char hashed[PASSWORD_LENGTH]; // new hash for a registration or rehash, "" if none
+} LoginJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    LoginJob *head, *tail;
+    int queued;
+    bool stopping;
+    pthread_t threads[LOGIN_WORKERS];
+} LoginPool;
+
+typedef struct {
+    Client **players;
+    int playerCount;
+    int playerCapacity;
+    long round;
+    time_t nextSpin;
+} Table;
+
+typedef struct Server Server;
+
+struct Shard {
+    Server *srv;
+    int id;
+    int epollFd;
+    int timerFd;        // one-second ticks for rounds and session expiry
+    int wakeFd;         // eventfd signalled when the mailbox has clients
+    pthread_t thread;
+    SpinSource spins;
+    Client **clients;   // indexed by fd
+    int clientCapacity;
+    pthread_mutex_t mailLock;
+    Client **mail;
+    int mailCount;
+    int mailCapacity;
+    SessionWheel sessions; // sessions of the clients this shard owns
+};
+
+struct Server {
+    int listenFd;
+    int roundSeconds;
+    int workerCount;
+    Shard *shards;      // shards[0] is the lobby, 1..workerCount own the tables
+    Table tables[MAX_TABLES + 1];
+    LoginPool logins;
+};
+
+static volatile sig_atomic_t serverStopping;
+
+static void serverSignal(int sig) {
+    (void)sig;
+    serverStopping = 1;
+}
+
+static Shard *tableShard(Server *srv, int table) {
+    return &srv->shards[1 + (table - 1) % srv->workerCount];
+}
+
+static void clientWatch(Client *c, int op) {
+    struct epoll_event ev = { .events = EPOLLIN | (c->wantWrite ? EPOLLOUT : 0), .data.fd = c->fd };
+    epoll_ctl(c->owner->epollFd, op, c->fd, &ev);
+}
+
+static void clientFlush(Client *c) {
+    size_t sent = 0;
+    while (sent < c->outLen) {
+        ssize_t n = write(c->fd, c->out + sent, c->outLen - sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->closing = true;
             break;
-        case 4:
-            printf(BOLD BLUE "1) 1-18 2) 19-36: " RESET);
-            if (scanf("%d", &betNum) != 1 || (betNum != 1 && betNum != 2)) {
-                printf(RED "Invalid choice! Please select 1 for 1-18 or 2 for 19-36.\n" RESET);
-                clearInputBuffer();
-                return;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->outLen - sent);
+    c->outLen -= sent;
+
+    bool want = c->outLen > 0;
+    if (want != c->wantWrite) {
+        c->wantWrite = want;
+        clientWatch(c, EPOLL_CTL_MOD);
+    }
+}
+
+static void clientSend(Client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void clientSend(Client *c, const char *fmt, ...) {
+    char line[CLIENT_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+    if (c->outLen + len > c->outCap) {
+        c->outCap = (c->outLen + len) * 2;
+        c->out = xrealloc(c->out, c->outCap);
+    }
+    memcpy(c->out + c->outLen, line, len);
+    c->outLen += len;
+    clientFlush(c);
+}
+
+static void shardTrack(Shard *sh, Client *c) {
+    if (c->fd >= sh->clientCapacity) {
+        int cap = sh->clientCapacity ? sh->clientCapacity : 64;
+        while (cap <= c->fd) cap *= 2;
+        sh->clients = xrealloc(sh->clients, cap * sizeof(Client *));
+        memset(sh->clients + sh->clientCapacity, 0, (cap - sh->clientCapacity) * sizeof(Client *));
+        sh->clientCapacity = cap;
+    }
+    sh->clients[c->fd] = c;
+    c->owner = sh;
+    clientWatch(c, EPOLL_CTL_ADD);
+}
+
+// Stop watching a client that is about to leave the shard.
+static void shardRelease(Shard *from, Client *c) {
+    epoll_ctl(from->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    from->clients[c->fd] = NULL;
+    if (c->session) sessionWheelRemove(&from->sessions, c->session);
+}
+
+// Put a client no thread is watching in a shard's mailbox. Any thread may call this.
+static void shardPost(Shard *to, Client *c) {
+    pthread_mutex_lock(&to->mailLock);
+    if (to->mailCount == to->mailCapacity) {
+        to->mailCapacity = to->mailCapacity ? to->mailCapacity * 2 : 16;
+        to->mail = xrealloc(to->mail, to->mailCapacity * sizeof(Client *));
+    }
+    to->mail[to->mailCount++] = c;
+    pthread_mutex_unlock(&to->mailLock);
+
+    uint64_t one = 1;
+    if (write(to->wakeFd, &one, sizeof(one)) < 0) perror(RED "Error waking shard" RESET);
+}
+
+// Give the client to another shard. The caller must not touch it afterwards.
+static void shardHandoff(Shard *from, Client *c, Shard *to) {
+    shardRelease(from, c);
+    c->handoff = NULL;
+    shardPost(to, c);
+}
+
+static void loginJobFree(LoginJob *job) {
+    explicit_bzero(job, sizeof(*job)); // plaintext password
+    free(job);
+}
+
+static void *loginWorker(void *arg) {
+    Server *srv = arg;
+    LoginPool *pool = &srv->logins;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->head && !pool->stopping) pthread_cond_wait(&pool->ready, &pool->lock);
+        if (pool->stopping) break;
+        LoginJob *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) pool->tail = NULL;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job->registering) {
+            memcpy(job->hashed, job->password, PASSWORD_LENGTH);
+            hashPassword(job->hashed);
+        } else {
+            job->verified = verifyPassword(job->password, job->user.password);
+            if (job->verified && passwordNeedsRehash(job->user.password)) {
+                memcpy(job->hashed, job->password, PASSWORD_LENGTH);
+                hashPassword(job->hashed);
             }
+        }
+        shardPost(&srv->shards[0], job->client);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void loginPoolStart(Server *srv) {
+    LoginPool *pool = &srv->logins;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    for (int i = 0; i < LOGIN_WORKERS; i++) {
+        if (pthread_create(&pool->threads[i], NULL, loginWorker, srv) != 0) {
+            perror(RED "Error starting login thread" RESET);
+            exit(1);
+        }
+    }
+}
+
+// Jobs still queued go back to the lobby unfinished, for shardDestroy to close.
+static void loginPoolStop(Server *srv) {
+    LoginPool *pool = &srv->logins;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < LOGIN_WORKERS; i++) pthread_join(pool->threads[i], NULL);
+
+    for (LoginJob *job = pool->head; job; job = job->next) shardPost(&srv->shards[0], job->client);
+    pool->head = pool->tail = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+}
+
+// Hand a client with a pending login to the KDF threads. Only the lobby queues jobs.
+static void loginSubmit(Shard *lobby, Client *c) {
+    LoginPool *pool = &lobby->srv->logins;
+    shardRelease(lobby, c);
+    c->login->client = c;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) pool->tail->next = c->login;
+    else pool->head = c->login;
+    pool->tail = c->login;
+    pool->queued++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static bool loginPoolFull(LoginPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    bool full = pool->queued >= LOGIN_QUEUE_MAX;
+    pthread_mutex_unlock(&pool->lock);
+    return full;
+}
+
+static void tableLeave(Server *srv, Client *c) {
+    if (!c->table) return;
+    Table *t = &srv->tables[c->table];
+    for (int i = 0; i < t->playerCount; i++) {
+        if (t->players[i] == c) {
+            t->players[i] = t->players[--t->playerCount];
             break;
-        case 5:
-            printf(BOLD BLUE "1) 1st Dozen (1-12)\n2) 2nd Dozen (13-24)\n3) 3rd Dozen (25-36)\nEnter your dozen selection: " RESET);
-            if (scanf("%d", &betNum) != 1 || betNum < 1 || betNum > 3) {
-                printf(RED "Invalid dozen selection! Please enter 1, 2, or 3.\n" RESET);
-                clearInputBuffer();
-                return;
+        }
+    }
+    // Stakes on an unspun slip were never taken from the balance.
+    c->slipCount = 0;
+    c->staked = 0;
+    c->table = 0;
+}
+
+static void tableJoin(Server *srv, Client *c, int id) {
+    Table *t = &srv->tables[id];
+    if (t->playerCount == t->playerCapacity) {
+        t->playerCapacity = t->playerCapacity ? t->playerCapacity * 2 : 8;
+        t->players = xrealloc(t->players, t->playerCapacity * sizeof(Client *));
+    }
+    if (t->playerCount == 0) {
+        t->nextSpin = time(NULL) + srv->roundSeconds;
+    }
+    t->players[t->playerCount++] = c;
+    c->table = id;
+    clientSend(c, "OK JOINED %d players %d spin_in %ld\n", id, t->playerCount, (long)(t->nextSpin - time(NULL)));
+}
+
+// Spin a table once and settle every player's slip against the same pocket.
+static void tableSpin(Shard *sh, int id) {
+    Server *srv = sh->srv;
+    Table *t = &srv->tables[id];
+    t->nextSpin = time(NULL) + srv->roundSeconds;
+    t->round++;
+
+    METRIC_BEGIN(spinStart);
+    int pocket = spinNext(&sh->spins);
+    METRIC_END(METRIC_SPIN, spinStart);
+    const char *color = pocket == 0 ? "green" : isRedNumber(pocket) ? "red" : "black";
+    char proof[96];
+    if (!spinProof(&sh->spins, proof, sizeof(proof))) proof[0] = '\0';
+    for (int p = 0; p < t->playerCount; p++) {
+        clientSend(t->players[p], "EVENT SPIN %d %s round %ld%s%s\n", pocket, color, t->round,
+                   proof[0] ? " proof " : "", proof);
+    }
+
+    User *users = xmalloc(t->playerCount * sizeof(User));
+    BetBatch batch;
+    betBatchInit(&batch);
+    for (int p = 0; p < t->playerCount; p++) {
+        users[p] = t->players[p]->session->user;
+        for (int b = 0; b < t->players[p]->slipCount; b++) {
+            betBatchAdd(&batch, &t->players[p]->slip[b], p);
+        }
+    }
+    settleBatch(&batch, pocket, users);
+
+    int k = 0;
+    for (int p = 0; p < t->playerCount; p++) {
+        Client *c = t->players[p];
+        if (c->slipCount == 0) continue;
+
+        int returned = 0;
+        for (int b = 0; b < c->slipCount; b++, k++) {
+            addGameHistory(users[p], &c->slip[b], pocket, batch.payout[k]);
+            returned += batch.payout[k] ? batch.payout[k] + c->slip[b].amount : 0;
+        }
+        Session *session = c->session;
+        session->user = users[p];
+        session->user.last_active = time(NULL);
+        userStoreCommit(session->rec, &session->user);
+        clientSend(c, "EVENT RESULT staked %d returned %d balance %d\n", c->staked, returned, session->user.balance);
+        c->slipCount = 0;
+        c->staked = 0;
+    }
+    betBatchFree(&batch);
+    free(users);
+
+    for (int p = 0; p < t->playerCount; p++) {
+        clientSend(t->players[p], "EVENT BETS_OPEN table %d next_spin_in %d\n", id, srv->roundSeconds);
+    }
+}
+
+static void clientClose(Shard *sh, Client *c) {
+    tableLeave(sh->srv, c);
+    if (c->session) {
+        sessionWheelRemove(&sh->sessions, c->session);
+        c->session->owner = NULL;
+        if (c->quitting) sessionEnd(c->session);
+        else sessionPark(c->session);
+    }
+    epoll_ctl(sh->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    sh->clients[c->fd] = NULL;
+    if (c->login) loginJobFree(c->login);
+    free(c->out);
+    free(c);
+}
+
+static void clientAttach(Client *c, Session *session) {
+    c->session = session;
+    session->owner = c;
+    sessionTouch(&c->owner->sessions, session, time(NULL));
+    clientSend(c, "OK WELCOME %s balance %d token %s\n", session->user.username, session->user.balance,
+               session->token);
+}
+
+// Refuse a login while the connection or the user backs off after failures.
+static bool loginThrottled(Client *c, UserRecord *rec) {
+    time_t now = time(NULL);
+    time_t retryAt = c->loginRetryAt;
+    if (rec && rec->loginRetryAt > retryAt) retryAt = rec->loginRetryAt;
+    if (now >= retryAt) return false;
+    clientSend(c, "ERR too many failed logins, retry in %ld seconds\n", (long)(retryAt - now));
+    return true;
+}
+
+// Past LOGIN_FREE_FAILURES failures in a row, each one doubles the wait before the next try.
+static void loginFailed(uint8_t *failures, time_t *retryAt) {
+    if (*failures < UINT8_MAX) (*failures)++;
+    if (*failures <= LOGIN_FREE_FAILURES) return;
+    int shift = *failures - LOGIN_FREE_FAILURES - 1;
+    long delay = shift < 16 ? 1L << shift : LOGIN_MAX_DELAY;
+    *retryAt = time(NULL) + (delay < LOGIN_MAX_DELAY ? delay : LOGIN_MAX_DELAY);
+}
+
+/* Logins and registrations only run on the lobby shard, the one thread that
+ * adds users. This checks everything but the password and leaves the KDF
+ * work in c->login; clientProcessLines then hands the client to the KDF
+ * threads and loginFinish completes the login once it is back. */
+static void handleLogin(Client *c, const char *username, const char *password, bool registering) {
+    User user;
+    memset(&user, 0, sizeof(User));
+    if (strlen(username) >= sizeof(user.username) || strlen(password) >= PASSWORD_LENGTH) {
+        clientSend(c, "ERR username or password too long\n");
+        return;
+    }
+    memcpy(user.username, username, strlen(username) + 1);
+
+    UserRecord *rec = userStoreFind(user.username);
+    if (loginThrottled(c, rec)) return;
+    if (loginPoolFull(&c->owner->srv->logins)) {
+        clientSend(c, "ERR server busy, try again\n");
+        return;
+    }
+    LoginJob *job = xcalloc(1, sizeof(LoginJob));
+    job->registering = registering;
+    memcpy(job->password, password, strlen(password) + 1);
+
+    // Only the lobby marks users online, so this cannot go stale before
+    // loadUser reloads the row. A seated player's row must not be reloaded
+    // under them: it is the base their next commit is compared against.
+    if (rec && __atomic_load_n(&rec->online, __ATOMIC_ACQUIRE)) {
+        if (registering || !sessionParkedCredentials(rec, job->token, job->user.password)) {
+            clientSend(c, registering ? "ERR user exists\n" : "ERR already logged in\n");
+            loginJobFree(job);
+            return;
+        }
+        memcpy(job->user.username, user.username, sizeof(user.username));
+    } else if (registering) {
+        if (loadUser(&user)) {
+            clientSend(c, "ERR user exists\n");
+            loginJobFree(job);
+            return;
+        }
+        if (strlen(password) < 6) {
+            clientSend(c, "ERR password too short, minimum 6 characters\n");
+            loginJobFree(job);
+            return;
+        }
+        job->user = user;
+    } else {
+        // With no password given, loadUser reloads the row without checking one.
+        if (loadUser(&user) != 1) {
+            clientSend(c, "ERR unknown user\n");
+            loginFailed(&c->loginFailures, &c->loginRetryAt);
+            loginJobFree(job);
+            return;
+        }
+        job->user = user;
+    }
+    c->login = job;
+}
+
+static void loginSucceeded(Client *c, UserRecord *rec, Session *session) {
+    c->loginFailures = 0;
+    c->loginRetryAt = 0;
+    rec->loginFailures = 0;
+    rec->loginRetryAt = 0;
+    clientAttach(c, session);
+}
+
+// Complete a login back from the KDF threads, on the lobby thread.
+static void loginFinish(Client *c) {
+    LoginJob *job = c->login;
+    c->login = NULL;
+    UserRecord *rec = userStoreFind(job->user.username);
+    bool online = rec && __atomic_load_n(&rec->online, __ATOMIC_ACQUIRE);
+    bool offline = false;
+
+    if (job->registering) {
+        // Another connection may have registered the name while this one hashed.
+        User user = job->user;
+        if (loadUser(&user)) {
+            clientSend(c, "ERR user exists\n");
+        } else {
+            memcpy(user.password, job->hashed, PASSWORD_LENGTH);
+            user.balance = STARTING_BALANCE;
+            user.last_active = time(NULL);
+            if (!saveUser(user)) {
+                clientSend(c, "ERR user exists\n");
+            } else {
+                rec = userStoreFind(user.username);
+                __atomic_store_n(&rec->online, true, __ATOMIC_RELEASE);
+                clientAttach(c, sessionCreate(&user, rec));
             }
+        }
+    } else if (!rec || rec->deleted) {
+        clientSend(c, "ERR unknown user\n");
+    } else if (!job->verified) {
+        loginFailed(&c->loginFailures, &c->loginRetryAt);
+        loginFailed(&rec->loginFailures, &rec->loginRetryAt);
+        clientSend(c, "ERR incorrect password\n");
+    } else if (job->token[0]) {
+        // The parked session may have expired while the password was checked.
+        Session *session = sessionResume(job->token);
+        if (session) loginSucceeded(c, rec, session);
+        else handleLogin(c, job->user.username, job->password, false);
+    } else if (online || strcmp(rec->user.password, job->user.password) != 0) {
+        // Someone logged in or changed the password meanwhile: check again.
+        handleLogin(c, job->user.username, job->password, false);
+    } else if (!__atomic_compare_exchange_n(&rec->online, &offline, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        clientSend(c, "ERR already logged in\n");
+    } else {
+        User user = rec->user;
+        if (job->hashed[0]) memcpy(user.password, job->hashed, PASSWORD_LENGTH); // Move to the current hasher.
+        user.last_active = time(NULL);
+        userStoreCommit(rec, &user);
+        loginSucceeded(c, rec, sessionCreate(&user, rec));
+    }
+    loginJobFree(job);
+}
+
+// A typed bet selection; a split may also be given as its two numbers, e.g. 17-20.
+static int parseBetSelection(int type, const char *arg) {
+    int a, b;
+    if (type == BET_SPLIT && sscanf(arg, "%d-%d", &a, &b) == 2) {
+        return splitSelection(a, b);
+    }
+    return atoi(arg);
+}
+
+static void handleBet(Client *c, int type, const char *selArg, int amount) {
+    int sel = parseBetSelection(type, selArg);
+    if (type < 1 || type > BET_TYPE_COUNT || !validBetSelection(type, sel)) {
+        clientSend(c, "ERR invalid bet\n");
+    } else if (amount < MIN_BET || amount > MAX_BET || c->staked + amount > c->session->user.balance) {
+        clientSend(c, "ERR amount must be %d-%d and within your balance\n", MIN_BET, MAX_BET);
+    } else if (c->slipCount == MAX_SLIP_BETS) {
+        clientSend(c, "ERR slip is full\n");
+    } else {
+        c->slip[c->slipCount++] = (Bet){ type, sel, amount };
+        c->staked += amount;
+        char label[30];
+        betLabel(type, sel, label, sizeof(label));
+        clientSend(c, "OK BET %s %d staked %d spin_in %ld\n", label, amount, c->staked,
+                   (long)(c->owner->srv->tables[c->table].nextSpin - time(NULL)));
+    }
+}
+
+static void handleCommand(Shard *sh, Client *c, char *line) {
+    Server *srv = sh->srv;
+    char cmd[16] = "", arg1[64] = "", arg2[64] = "";
+    int arg3 = 0;
+    int argc = sscanf(line, "%15s %63s %63s %d", cmd, arg1, arg2, &arg3);
+    if (argc < 1) return;
+    for (char *p = cmd; *p; p++) *p = toupper((unsigned char)*p);
+    if (c->session) sessionTouch(&sh->sessions, c->session, time(NULL));
+
+    if (strcmp(cmd, "QUIT") == 0) {
+        clientSend(c, "OK BYE\n");
+        c->closing = true;
+        c->quitting = true;
+    } else if (strcmp(cmd, "RESUME") == 0) {
+        Session *session = NULL;
+        if (c->session) clientSend(c, "ERR already logged in\n");
+        else if (argc < 2) clientSend(c, "ERR usage: RESUME <token>\n");
+        else if (!(session = sessionResume(arg1))) clientSend(c, "ERR no such session\n");
+        else clientAttach(c, session);
+    } else if (strcmp(cmd, "LOGIN") == 0 || strcmp(cmd, "REGISTER") == 0) {
+        if (c->session) clientSend(c, "ERR already logged in\n");
+        else if (argc < 3) clientSend(c, "ERR usage: %s <user> <password>\n", cmd);
+        else handleLogin(c, arg1, arg2, cmd[0] == 'R');
+    } else if (!c->session) {
+        clientSend(c, "ERR login first\n");
+    } else if (strcmp(cmd, "BALANCE") == 0) {
+        clientSend(c, "OK BALANCE %d staked %d\n", c->session->user.balance, c->staked);
+    } else if (strcmp(cmd, "RANK") == 0) {
+        // 0 means not ranked, e.g. too few games for the win rate board.
+        uint32_t size[BOARD_COUNT];
+        int rank[BOARD_COUNT];
+        for (int kind = 0; kind < BOARD_COUNT; kind++) {
+            rank[kind] = leaderboardRank(kind, c->session->user.username, &size[kind]);
+        }
+        clientSend(c, "OK RANK richest %d/%u biggest_win %d/%u win_rate %d/%u\n",
+                   rank[BOARD_RICHEST], size[BOARD_RICHEST], rank[BOARD_BIGGEST_WIN], size[BOARD_BIGGEST_WIN],
+                   rank[BOARD_WIN_RATE], size[BOARD_WIN_RATE]);
+    } else if (strcmp(cmd, "JOIN") == 0) {
+        int id = atoi(arg1);
+        if (id < 1 || id > MAX_TABLES) {
+            clientSend(c, "ERR table must be 1-%d\n", MAX_TABLES);
+            return;
+        }
+        tableLeave(srv, c);
+        if (tableShard(srv, id) == sh) {
+            tableJoin(srv, c, id);
+        } else {
+            c->joining = id;
+            c->handoff = tableShard(srv, id);
+        }
+    } else if (strcmp(cmd, "LEAVE") == 0) {
+        tableLeave(srv, c);
+        clientSend(c, "OK LEFT\n");
+        if (sh != &srv->shards[0]) c->handoff = &srv->shards[0];
+    } else if (strcmp(cmd, "BET") == 0) {
+        if (!c->table) clientSend(c, "ERR join a table first\n");
+        else if (argc < 4) clientSend(c, "ERR usage: BET <type> <selection> <amount>\n");
+        else handleBet(c, atoi(arg1), arg2, arg3);
+    } else if (strcmp(cmd, "HISTORY") == 0) {
+        GameHistory page[HISTORY_PAGE_SIZE];
+        int pageNo = argc >= 2 ? atoi(arg1) : 1;
+        int n = historyQuery(c->session->user.username, 0, (pageNo > 0 ? pageNo - 1 : 0) * HISTORY_PAGE_SIZE,
+                             HISTORY_PAGE_SIZE, page);
+        clientSend(c, "OK HISTORY %d of %d\n", n, historyCountFor(c->session->user.username));
+        for (int i = 0; i < n; i++) {
+            clientSend(c, "%s|%s|%d|%d|%d\n", page[i].timestamp, page[i].game_type,
+                       page[i].bet_amount, page[i].result, page[i].payout);
+        }
+    } else {
+        clientSend(c, "ERR unknown command\n");
+    }
+}
+
+/* Run every complete buffered line. Returns false if a command handed the
+ * client to another shard or to the KDF threads, after which it is theirs. */
+static bool clientProcessLines(Shard *sh, Client *c) {
+    char *start = c->in, *nl;
+    while (!c->closing && !c->handoff && !c->login && (nl = memchr(start, '\n', c->in + c->inLen - start))) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+        handleCommand(sh, c, start);
+        start = nl + 1;
+    }
+    c->inLen -= start - c->in;
+    memmove(c->in, start, c->inLen);
+
+    if (c->login && !c->closing) {
+        loginSubmit(sh, c);
+        return false;
+    }
+    if (c->handoff && !c->closing) {
+        shardHandoff(sh, c, c->handoff);
+        return false;
+    }
+    return true;
+}
+
+static bool clientRead(Shard *sh, Client *c) {
+    while (!c->closing) {
+        ssize_t n = read(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen);
+        if (n == 0) {
+            c->closing = true;
             break;
-        case 6:
-            printf(BOLD BLUE "1) 1st Column (1,4,7...)\n2) 2nd Column (2,5,8...)\n3) 3rd Column (3,6,9...)\nEnter your column selection: " RESET);
-            if (scanf("%d", &betNum) != 1 || betNum < 1 || betNum > 3) {
-                printf(RED "Invalid column selection! Please enter 1, 2, or 3.\n" RESET);
-                clearInputBuffer();
-                return;
-            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->closing = true;
             break;
+        }
+        c->inLen += n;
+        if (!clientProcessLines(sh, c)) return false;
+        if (c->inLen == (int)sizeof(c->in)) {
+            clientSend(c, "ERR line too long\n");
+            c->closing = true;
+        }
     }
-    clearInputBuffer();
+    return true;
+}
 
-    printf(BOLD YELLOW "Enter your bet amount ($10-$1000): " RESET);
-    if (scanf("%d", &betAmt) != 1 || betAmt < 10 || betAmt > 1000 || betAmt > user->balance) {
-        printf(RED "Invalid bet amount! Must be between $10 and $1000 and not exceed your balance.\n" RESET);
-        clearInputBuffer();
-        return;
+// Take ownership of clients handed over by other shards.
+static void shardAdoptMail(Shard *sh) {
+    uint64_t count;
+    if (read(sh->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror(RED "Error reading shard mailbox" RESET);
     }
-    clearInputBuffer();
 
-    user->balance -= betAmt;
-    user->games_played++;
-    
-    int result;
-    char color[20];
-    spinRoulette(&result, color);
-    printf(CYAN "\nSpinning the wheel...\n" RESET);
-    printf(BOLD WHITE "Ball lands on: " MAGENTA "%d (%s)\n" RESET, result, color);
+    pthread_mutex_lock(&sh->mailLock);
+    Client **mail = sh->mail;
+    int mailCount = sh->mailCount;
+    sh->mail = NULL;
+    sh->mailCount = sh->mailCapacity = 0;
+    pthread_mutex_unlock(&sh->mailLock);
 
-    int won = 0;
-    
-    bool isRedResult = false;
-    if (result != 0) {
-        for (int i = 0; i < sizeof(redNumbers)/sizeof(redNumbers[0]); i++) {
-            if (result == redNumbers[i]) {
-                isRedResult = true;
-                break;
-            }
+    for (int i = 0; i < mailCount; i++) {
+        Client *c = mail[i];
+        shardTrack(sh, c);
+        if (c->session) sessionWheelInsert(&sh->sessions, c->session);
+        if (c->login) loginFinish(c); // back from the KDF threads
+        if (c->joining) {
+            tableJoin(sh->srv, c, c->joining);
+            c->joining = 0;
         }
+        // Commands that arrived behind the hand-off are still buffered.
+        if (clientProcessLines(sh, c)) clientFlush(c);
     }
+    free(mail);
+}
 
-    switch (betType) {
-        case 1: if (betNum == result) { won = 35; strcpy(gameType, "Single Number"); } break;
-        case 2: 
-            if (result != 0) {
-                if ((betNum == 1 && result % 2 == 0) || (betNum == 2 && result % 2 != 0)) {
-                    won = 1; strcpy(gameType, (betNum == 1) ? "Even" : "Odd");
-                }
-            }
+static void serverAccept(Shard *lobby) {
+    while (1) {
+        int fd = accept4(lobby->srv->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror(RED "accept" RESET);
+            return;
+        }
+        Client *c = xcalloc(1, sizeof(Client));
+        c->fd = fd;
+        shardTrack(lobby, c);
+        clientSend(c, "OK ROULETTE tables %d round %d\n", MAX_TABLES, lobby->srv->roundSeconds);
+    }
+}
+
+static void shardTick(Shard *sh) {
+    uint64_t expirations;
+    if (read(sh->timerFd, &expirations, sizeof(expirations)) < 0) return;
+
+    Server *srv = sh->srv;
+    time_t now = time(NULL);
+    for (int t = 1; t <= MAX_TABLES; t++) {
+        Table *table = &srv->tables[t];
+        if (tableShard(srv, t) != sh || table->playerCount == 0 || now < table->nextSpin) continue;
+
+        bool anyBets = false;
+        for (int p = 0; p < table->playerCount && !anyBets; p++) {
+            anyBets = table->players[p]->slipCount > 0;
+        }
+        if (anyBets) {
+            tableSpin(sh, t);
+        } else {
+            table->nextSpin = now + srv->roundSeconds; // Nothing to settle this round.
+        }
+    }
+
+    for (Session *session = sessionWheelAdvance(&sh->sessions, now), *next; session; session = next) {
+        next = session->next;
+        Client *c = session->owner;
+        clientSend(c, "EVENT EXPIRED idle for %d seconds\n", INACTIVITY_TIMEOUT);
+        c->closing = true;
+        c->quitting = true;
+    }
+    if (sh->id == 0) sessionExpireParked(now);
+}
+
+static void *shardLoop(void *arg) {
+    Shard *sh = arg;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    while (!serverStopping) {
+        // The timeout bounds how long a shard takes to notice shutdown.
+        int n = epoll_wait(sh->epollFd, events, SERVER_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(RED "epoll_wait" RESET);
             break;
-        case 3: 
-            if (result != 0) {
-                if ((betNum == 1 && isRedResult) || (betNum == 2 && !isRedResult)) {
-                    won = 1; strcpy(gameType, (betNum == 1) ? "Red" : "Black");
-                }
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (sh->id == 0 && fd == sh->srv->listenFd) {
+                serverAccept(sh);
+            } else if (fd == sh->timerFd) {
+                shardTick(sh);
+            } else if (fd == sh->wakeFd) {
+                shardAdoptMail(sh);
+            } else if (fd < sh->clientCapacity && sh->clients[fd]) {
+                Client *c = sh->clients[fd];
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) c->closing = true;
+                if (!c->closing && (events[i].events & EPOLLIN) && !clientRead(sh, c)) continue;
+                if (!c->closing && (events[i].events & EPOLLOUT)) clientFlush(c);
             }
+        }
+        // Close finished clients outside the event scan so table broadcasts
+        // never touch a freed client.
+        for (int fd = 0; fd < sh->clientCapacity; fd++) {
+            if (sh->clients[fd] && sh->clients[fd]->closing) clientClose(sh, sh->clients[fd]);
+        }
+    }
+    return NULL;
+}
+
+static bool shardInit(Server *srv, Shard *sh, int id) {
+    sh->srv = srv;
+    sh->id = id;
+    sh->timerFd = -1;
+    pthread_mutex_init(&sh->mailLock, NULL);
+    sh->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    sh->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->epollFd < 0 || sh->wakeFd < 0) {
+        perror(RED "Error creating shard" RESET);
+        return false;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = sh->wakeFd };
+    epoll_ctl(sh->epollFd, EPOLL_CTL_ADD, sh->wakeFd, &ev);
+
+    if (id == 0) {
+        ev.data.fd = srv->listenFd;
+        epoll_ctl(sh->epollFd, EPOLL_CTL_ADD, srv->listenFd, &ev);
+    }
+    sh->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = { .it_interval = { 1, 0 }, .it_value = { 1, 0 } };
+    timerfd_settime(sh->timerFd, 0, &tick, NULL);
+    ev.data.fd = sh->timerFd;
+    epoll_ctl(sh->epollFd, EPOLL_CTL_ADD, sh->timerFd, &ev);
+
+    // Each shard spins from its own stream of the game generator.
+    char label[24];
+    snprintf(label, sizeof(label), "shard-%d", id);
+    spinSourceFork(&sh->spins, &gameSpins, id, label);
+    return true;
+}
+
+static void shardDestroy(Shard *sh) {
+    for (int fd = 0; fd < sh->clientCapacity; fd++) {
+        if (!sh->clients[fd]) continue;
+        sh->clients[fd]->quitting = true;
+        clientClose(sh, sh->clients[fd]);
+    }
+    for (int i = 0; i < sh->mailCount; i++) {
+        sh->mail[i]->owner = sh;
+        sh->mail[i]->quitting = true;
+        shardTrack(sh, sh->mail[i]);
+        clientClose(sh, sh->mail[i]);
+    }
+    free(sh->mail);
+    free(sh->clients);
+    close(sh->epollFd);
+    close(sh->wakeFd);
+    if (sh->timerFd >= 0) close(sh->timerFd);
+    spinSourceClose(&sh->spins);
+    pthread_mutex_destroy(&sh->mailLock);
+}
+
+// "unix:/path" listens on a Unix socket, anything else is a TCP port.
+static int serverListen(const char *address) {
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror(RED "Error binding Unix socket" RESET);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(address)),
+                                    .sin_addr.s_addr = htonl(INADDR_ANY) };
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror(RED "Error binding TCP port" RESET);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror(RED "Error listening" RESET);
+        return -1;
+    }
+    return fd;
+}
+
+int runServer(const char *address, int roundSeconds, int workers) {
+    Server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.roundSeconds = roundSeconds > 0 ? roundSeconds : DEFAULT_ROUND_SECONDS;
+    srv.workerCount = workers < 1 ? 1 : workers > MAX_TABLES ? MAX_TABLES : workers;
+
+    srv.listenFd = serverListen(address);
+    if (srv.listenFd < 0) return 0;
+    leaderboardBuild(); // RANK replies come straight from the boards.
+
+    struct sigaction sa = { .sa_handler = serverSignal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    srv.shards = xcalloc(srv.workerCount + 1, sizeof(Shard));
+    for (int i = 0; i <= srv.workerCount; i++) {
+        if (!shardInit(&srv, &srv.shards[i], i)) return 0;
+    }
+    for (int i = 1; i <= srv.workerCount; i++) {
+        if (pthread_create(&srv.shards[i].thread, NULL, shardLoop, &srv.shards[i]) != 0) {
+            perror(RED "Error starting shard thread" RESET);
+            exit(1);
+        }
+    }
+    loginPoolStart(&srv);
+
+    printf(GREEN BOLD "Roulette server listening on %s (round %ds, %d worker shard(s))\n" RESET,
+           address, srv.roundSeconds, srv.workerCount);
+    fflush(stdout);
+
+    shardLoop(&srv.shards[0]);
+    serverStopping = 1;
+    for (int i = 1; i <= srv.workerCount; i++) {
+        pthread_join(srv.shards[i].thread, NULL);
+    }
+    loginPoolStop(&srv);
+
+    printf(YELLOW "\nServer shutting down...\n" RESET);
+    for (int i = 0; i <= srv.workerCount; i++) {
+        shardDestroy(&srv.shards[i]);
+    }
+    sessionTableClose();
+    for (int t = 1; t <= MAX_TABLES; t++) {
+        free(srv.tables[t].players);
+    }
+    free(srv.shards);
+    close(srv.listenFd);
+    if (strncmp(address, "unix:", 5) == 0) unlink(address + 5);
+    return 1;
+}
+
+/* ====== USER LISTING ======
+ * "View all users" shows one page at a time. Sorted pages come from a
+ * bounded min-heap over the in-memory records, so page p costs one pass and
+ * O(n log (p + 1) * USER_PAGE_SIZE) comparisons instead of a full sort; only
+ * the rows on the page are read from disk. */
+
+static double userWinRate(const User *user) {
+    return user->games_played ? (double)user->games_won / user->games_played : 0.0;
+}
+
+// Positive if a ranks ahead of b. Ties go to the alphabetically first name.
+static int userRankCompare(const User *a, const User *b, UserSort sort) {
+    switch (sort) {
+        case USER_SORT_BALANCE:
+            if (a->balance != b->balance) return a->balance > b->balance ? 1 : -1;
             break;
-        case 4: 
-            if (result != 0) {
-                if ((betNum == 1 && result >= 1 && result <= 18) || (betNum == 2 && result >= 19 && result <= 36)) {
-                    won = 1; strcpy(gameType, (betNum == 1) ? "Low (1-18)" : "High (19-36)");
-                }
-            }
+        case USER_SORT_GAMES:
+            if (a->games_played != b->games_played) return a->games_played > b->games_played ? 1 : -1;
             break;
-        case 5: 
-            if (result != 0) {
-                 if ((betNum == 1 && result >= 1 && result <= 12) ||
-                    (betNum == 2 && result >= 13 && result <= 24) ||
-                    (betNum == 3 && result >= 25 && result <= 36)) {
-                    won = 2; snprintf(gameType, sizeof(gameType), "Dozens %d-%d", (betNum-1)*12+1, betNum*12);
-                }
-            }
+        case USER_SORT_WIN_RATE: {
+            double ra = userWinRate(a), rb = userWinRate(b);
+            if (ra != rb) return ra > rb ? 1 : -1;
             break;
-        case 6: 
-            if (result != 0) {
-                if ((betNum == 1 && result % 3 == 1) || (betNum == 2 && result % 3 == 2) || (betNum == 3 && result % 3 == 0)) {
-                    won = 2; snprintf(gameType, sizeof(gameType), "Column %d", betNum);
-                }
-            }
+        }
+        case USER_SORT_NONE:
             break;
     }
+    return strcmp(b->username, a->username);
+}
 
-    int payout = won * betAmt;
-    if (won) {
-        user->balance += payout + betAmt;
-        user->games_won++;
-        if (payout > user->highest_win) user->highest_win = payout;
-        printf(GREEN BOLD "\n*** YOU WON $%d! Your new balance: $%d ***\n" RESET, payout, user->balance);
-    } else {
-        printf(RED BOLD "\n--- YOU LOST $%d. Your new balance: $%d ---\n" RESET, betAmt, user->balance);
+static bool userListMatches(const UserListQuery *query, const UserRecord *rec) {
+    if (rec->deleted) return false;
+    if (query->adminsOnly && !rec->user.isAdmin) return false;
+    return query->nameContains[0] == '\0' || strstr(rec->user.username, query->nameContains) != NULL;
+}
+
+// Min-heap on rank: the root is the worst of the records kept so far.
+static void userHeapSiftDown(UserRecord **heap, int size, int i, UserSort sort) {
+    while (1) {
+        int worst = i, left = 2 * i + 1, right = left + 1;
+        if (left < size && userRankCompare(&heap[left]->user, &heap[worst]->user, sort) < 0) worst = left;
+        if (right < size && userRankCompare(&heap[right]->user, &heap[worst]->user, sort) < 0) worst = right;
+        if (worst == i) return;
+        UserRecord *tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
     }
+}
 
-    addGameHistory(*user, gameType, betAmt, result, payout);
-    updateUser(*user);
+static void userHeapSiftUp(UserRecord **heap, int i, UserSort sort) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (userRankCompare(&heap[i]->user, &heap[parent]->user, sort) >= 0) return;
+        UserRecord *tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
 }
 
-void showGameHistory(const char* username) {
-    printf(BOLD CYAN "\n====== Your Game History ======\n" RESET);
-    printf(YELLOW "%-20s %-15s %-8s %-5s %s\n" RESET, "Time", "Type", "Bet", "Result", "Payout");
-    int found = 0;
-    for (int i = historyCount-1; i >= 0; i--) {
-        if (strcmp(gameHistory[i].username, username) == 0) {
-            printf(WHITE "%-20s %-15s $" GREEN "%-7d" RESET " %-5d $" MAGENTA "%d\n" RESET, 
-                     gameHistory[i].timestamp,
-                     gameHistory[i].game_type, 
-                     gameHistory[i].bet_amount,
-                     gameHistory[i].result, 
-                     gameHistory[i].payout);
-            found = 1;
+/* Fill rows with page `page` of the matching users and return how many it
+ * holds; *total is set to the number of matching users. */
+static int userListPage(const UserListQuery *query, int page, UserRecord **rows, int *total) {
+    int first = page * USER_PAGE_SIZE;
+    int shown = 0;
+    *total = 0;
+
+    if (query->sort == USER_SORT_NONE) {
+        for (int i = 0; i < userStore.count; i++) {
+            UserRecord *rec = userStoreAt(i);
+            if (!userListMatches(query, rec)) continue;
+            if (*total >= first && shown < USER_PAGE_SIZE) rows[shown++] = rec;
+            (*total)++;
+        }
+        return shown;
+    }
+
+    int limit = first + USER_PAGE_SIZE;
+    UserRecord **heap = xmalloc((size_t)limit * sizeof(UserRecord *));
+    int size = 0;
+    for (int i = 0; i < userStore.count; i++) {
+        UserRecord *rec = userStoreAt(i);
+        if (!userListMatches(query, rec)) continue;
+        (*total)++;
+        if (size < limit) {
+            heap[size] = rec;
+            userHeapSiftUp(heap, size++, query->sort);
+        } else if (userRankCompare(&rec->user, &heap[0]->user, query->sort) > 0) {
+            heap[0] = rec;
+            userHeapSiftDown(heap, size, 0, query->sort);
+        }
+    }
+
+    // Popping the worst record each time fills the page from its end.
+    if (size > first) {
+        shown = size - first;
+        while (size > first) {
+            rows[size - first - 1] = heap[0];
+            heap[0] = heap[--size];
+            userHeapSiftDown(heap, size, 0, query->sort);
         }
     }
-    if (!found) printf(YELLOW "No game history found for %s.\n" RESET, username);
-    printf(BOLD CYAN "===============================\n" RESET);
+    free(heap);
+    return shown;
 }
 
-void displayStats(User user) {
-    float winRate = user.games_played ? 
-                    (float)user.games_won / user.games_played * 100 : 0;
-    printf(BOLD MAGENTA "\n=== Your Statistics ===\n" RESET
-           WHITE "Username: %s\n"
-           "Current Balance: $" GREEN "%d\n" RESET
-           WHITE "Games Played: %d\n"
-           "Games Won: %d\n"
-           "Win Percentage: " YELLOW "%.1f%%\n" RESET
-           WHITE "Highest Single Win: $" MAGENTA "%d\n" RESET
-           BOLD MAGENTA "=======================\n" RESET, 
-           user.username, user.balance, user.games_played,
-           user.games_won, winRate, user.highest_win);
+static void viewUsersMenu(void) {
+    UserListQuery query;
+    char input[64];
+    memset(&query, 0, sizeof(query));
+
+    printf(WHITE "Sort by: 1) Registration order  2) Balance  3) Games played  4) Win rate\n" RESET
+           BOLD CYAN "Enter your choice: " RESET);
+    getInput(input, sizeof(input));
+    query.sort = (UserSort)atoi(input);
+    if (query.sort < USER_SORT_NONE || query.sort > USER_SORT_WIN_RATE) {
+        query.sort = USER_SORT_NONE;
+    }
+    printf(CYAN "Only names containing (blank for all): " RESET);
+    getInput(query.nameContains, sizeof(query.nameContains));
+    printf(CYAN "Admins only? (y/n): " RESET);
+    getInput(input, sizeof(input));
+    query.adminsOnly = (input[0] == 'y' || input[0] == 'Y');
+
+    UserRecord *rows[USER_PAGE_SIZE];
+    int page = 0;
+    while (1) {
+        int total;
+        userStoreRefresh(); // Users may have registered in another terminal.
+        int shown = userListPage(&query, page, rows, &total);
+        int pages = (total + USER_PAGE_SIZE - 1) / USER_PAGE_SIZE;
+
+        printf(BOLD YELLOW "\n|==================|==========|=======|========|=======|\n");
+        printf("| %-16s | %-8s | %-5s | %-6s | Admin |\n", "Username", "Balance", "Games", "Win %");
+        printf("|==================|==========|=======|========|=======|\n" RESET);
+        for (int i = 0; i < shown; i++) {
+            User user_read;
+            if (!userStoreReadRow(rows[i], &user_read)) continue;
+            printf(WHITE "| %-16s | $" GREEN "%-7d" RESET WHITE " | %-5d | %5.1f%% | %-5s |\n" RESET,
+                   user_read.username, user_read.balance, user_read.games_played,
+                   100.0 * userWinRate(&user_read),
+                   user_read.isAdmin ? GREEN "Yes" : RED "No"); // Color for Admin status
+        }
+        printf(BOLD YELLOW "|==================|==========|=======|========|=======|\n" RESET);
+        printf(WHITE "Page %d of %d (%d user%s)\n" RESET, pages ? page + 1 : 0, pages, total, total == 1 ? "" : "s");
+
+        printf(BOLD CYAN "n) Next  p) Previous  q) Back: " RESET);
+        getInput(input, sizeof(input));
+        if (input[0] == 'n' || input[0] == 'N') {
+            if (page + 1 < pages) page++;
+        } else if (input[0] == 'p' || input[0] == 'P') {
+            if (page > 0) page--;
+        } else {
+            return;
+        }
+    }
+}
+
+// Add the usernames in `text`, separated by commas or whitespace, to the filter.
+static void bulkAddNames(BulkFilter *filter, char *text, int *capacity) {
+    char *save;
+    for (char *name = strtok_r(text, ", \t\r\n", &save); name; name = strtok_r(NULL, ", \t\r\n", &save)) {
+        if (filter->nameCount == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            filter->names = xrealloc(filter->names, (size_t)*capacity * sizeof(filter->names[0]));
+        }
+        snprintf(filter->names[filter->nameCount++], sizeof(filter->names[0]), "%s", name);
+    }
 }
 
-void changePassword(User *user) {
-    char current[PASSWORD_LENGTH], newPass[PASSWORD_LENGTH], confirm[PASSWORD_LENGTH];
-    
-    printf(BOLD YELLOW "\n--- Change Password ---\n" RESET);
-    printf(CYAN "Enter your current password: " RESET);
-    getInput(current, sizeof(current));
-    
-    if (!verifyPassword(current, user->password)) {
-        printf(RED BOLD "Incorrect current password! Password change failed.\n" RESET);
+static void bulkMenu(User *currentAdmin) {
+    int action, selection;
+    char input[4096];
+
+    printf(WHITE "Action: 1) Reset balance  2) Promote to admin  3) Delete\n" RESET
+           BOLD CYAN "Enter your choice: " RESET);
+    getInput(input, sizeof(input));
+    action = atoi(input);
+    if (action < BULK_RESET || action > BULK_DELETE) {
+        printf(RED BOLD "Invalid action!\n" RESET);
         return;
     }
-    
-    printf(CYAN "Enter new password (minimum 6 characters): " RESET);
-    getInput(newPass, sizeof(newPass));
-    
-    if (strlen(newPass) < 6) {
-        printf(RED BOLD "Password too short! Minimum 6 characters required.\n" RESET);
+
+    printf(WHITE "Select users by: 1) Username list  2) File of usernames  3) Balance below  4) Inactive for N days\n" RESET
+           BOLD CYAN "Enter your choice: " RESET);
+    getInput(input, sizeof(input));
+    selection = atoi(input);
+
+    BulkFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.keep = currentAdmin->username;
+    int capacity = 0;
+    switch (selection) {
+        case 1:
+            printf(CYAN "Usernames (comma or space separated): " RESET);
+            getInput(input, sizeof(input));
+            bulkAddNames(&filter, input, &capacity);
+            break;
+        case 2: {
+            printf(CYAN "File of usernames: " RESET);
+            getInput(input, sizeof(input));
+            FILE *list = fopen(input, "r");
+            if (!list) {
+                printf(RED BOLD "Cannot open '%s'!\n" RESET, input);
+                return;
+            }
+            while (fgets(input, sizeof(input), list)) {
+                bulkAddNames(&filter, input, &capacity);
+            }
+            fclose(list);
+            break;
+        }
+        case 3:
+            printf(CYAN "Balance below: $" RESET);
+            getInput(input, sizeof(input));
+            filter.balanceBelowSet = true;
+            filter.balanceBelow = atoi(input);
+            break;
+        case 4: {
+            printf(CYAN "Inactive for at least how many days: " RESET);
+            getInput(input, sizeof(input));
+            int days = atoi(input);
+            if (days <= 0) {
+                printf(RED BOLD "Enter a positive number of days!\n" RESET);
+                return;
+            }
+            filter.inactiveBefore = time(NULL) - (time_t)days * 24 * 60 * 60;
+            break;
+        }
+        default:
+            printf(RED BOLD "Invalid selection!\n" RESET);
+            return;
+    }
+    if ((selection == 1 || selection == 2) && filter.nameCount == 0) {
+        printf(RED BOLD "No usernames given!\n" RESET);
+        free(filter.names);
         return;
     }
-    
-    printf(CYAN "Confirm new password: " RESET);
-    getInput(confirm, sizeof(confirm));
-    
-    if (strcmp(newPass, confirm) != 0) {
-        printf(RED BOLD "Passwords do not match! Password change failed.\n" RESET);
+    qsort(filter.names, filter.nameCount, sizeof(filter.names[0]), compareUsernames);
+
+    static const char *actionNames[] = { "", "reset the balance of", "promote", "delete" };
+    printf(YELLOW "This will %s every selected user. Continue? (y/n): " RESET, actionNames[action]);
+    getInput(input, sizeof(input));
+    if (input[0] != 'y' && input[0] != 'Y') {
+        printf(YELLOW "Cancelled.\n" RESET);
+        free(filter.names);
         return;
     }
-    
-    encryptPassword(newPass); 
-    strcpy(user->password, newPass);
-    updateUser(*user);
-    printf(GREEN BOLD "Password changed successfully!\n" RESET);
-}
 
-void checkTimeout(time_t lastActivity) {
-    if (difftime(time(NULL), lastActivity) > INACTIVITY_TIMEOUT) {
-        printf(YELLOW BOLD "\nSession expired due to inactivity. Logging out...\n" RESET);
-        exit(0);
+    int affected = userStoreBulkApply((BulkAction)action, &filter);
+    free(filter.names);
+    if (affected < 0) {
+        printf(RED BOLD "Bulk operation failed!\n" RESET);
+        return;
     }
+
+    // Our session copy must start from the rewritten record, or its next commit would undo the change.
+    UserRecord *self = userStoreFind(currentAdmin->username);
+    if (self) *currentAdmin = self->user;
+    printf(GREEN BOLD "Updated %d user%s.\n" RESET, affected, affected == 1 ? "" : "s");
 }
 
 void adminMenu(User *currentAdmin) {
@@ -532,7 +7569,6 @@ void adminMenu(User *currentAdmin) {
 
     int choice;
     char targetUsername[50];
-    User users[MAX_USERS];
     
     while (1) {
         printf(BOLD BLUE "\n|=======================|\n");
@@ -541,7 +7577,10 @@ void adminMenu(User *currentAdmin) {
         printf(WHITE "1) Reset user balance\n"
                "2) View all users\n"
                "3) Promote to admin\n"
-               RED "4) Return to Main Menu\n" RESET
+               "4) Show metrics\n"
+               "5) Bulk operations\n"
+               "6) Player analytics\n"
+               RED "7) Return to Main Menu\n" RESET
                BOLD CYAN "Enter your choice: " RESET);
 
         if (scanf("%d", &choice) != 1) {
@@ -556,244 +7595,545 @@ void adminMenu(User *currentAdmin) {
                 printf(CYAN "Enter username to reset balance for: " RESET);
                 getInput(targetUsername, sizeof(targetUsername));
 
-                FILE *file = fopen(FILENAME, "r");
-                if (!file) {
-                    printf(RED BOLD "Error opening user database!\n" RESET);
-                    break;
-                }
-
-                int count = 0;
-                int found = 0;
-                int adminFlag;
-                char encrypted_pw_from_file[PASSWORD_LENGTH];
-
-                while (fscanf(file, "%49s %19s %d %d %d %d %d", 
-                                users[count].username, encrypted_pw_from_file,
-                                &users[count].balance, &users[count].games_played,
-                                &users[count].games_won, &users[count].highest_win,
-                                &adminFlag) == 7) {
-                    users[count].isAdmin = (adminFlag == 1);
-                    strcpy(users[count].password, encrypted_pw_from_file);
-                    
-                    if (strcmp(users[count].username, targetUsername) == 0) {
-                        users[count].balance = STARTING_BALANCE;
-                        found = 1;
-                    }
-                    count++;
-                }
-                fclose(file);
-
-                if (!found) {
+                userStoreRefresh(); // The user may have registered in another terminal.
+                UserRecord *rec = userStoreFind(targetUsername);
+                if (!rec) {
                     printf(RED BOLD "User '%s' not found!\n" RESET, targetUsername);
                     break;
                 }
 
-                file = fopen(FILENAME, "w");
-                if (!file) {
-                    printf(RED BOLD "Error saving changes!\n" RESET);
-                    break;
-                }
-
-                for (int i = 0; i < count; i++) {
-                    fprintf(file, "%s %s %d %d %d %d %d\n", 
-                            users[i].username, users[i].password,
-                            users[i].balance, users[i].games_played,
-                            users[i].games_won, users[i].highest_win,
-                            users[i].isAdmin ? 1 : 0);
+                if (strcmp(currentAdmin->username, targetUsername) == 0) {
+                    // Our own session holds a copy of this user; commit through it.
+                    currentAdmin->balance = STARTING_BALANCE;
+                    updateUser(currentAdmin);
+                } else {
+                    userStoreReload(rec);
+                    User target = rec->user;
+                    target.balance = STARTING_BALANCE;
+                    userStoreCommit(rec, &target);
                 }
-                fclose(file);
 
                 printf(GREEN BOLD "Successfully reset %s's balance to $%d\n" RESET, 
                             targetUsername, STARTING_BALANCE);
                 break;
             }
 
-            case 2: {
-                FILE *file = fopen(FILENAME, "r");
-                if (!file) {
-                    printf(RED BOLD "Error opening user database!\n" RESET);
-                    break;
-                }
-
-                printf(BOLD YELLOW "\n|==================|==========|=======|=======|\n");
-                printf("| %-16s | %-8s | %-5s | Admin |\n", "Username", "Balance", "Games");
-                printf("|==================|==========|=======|=======|\n" RESET);
-
-                User user_read;
-                char encrypted_pw_from_file[PASSWORD_LENGTH];
-                int adminFlag;
-                
-                while (fscanf(file, "%49s %19s %d %d %d %d %d", 
-                                user_read.username, encrypted_pw_from_file,
-                                &user_read.balance, &user_read.games_played,
-                                &user_read.games_won, &user_read.highest_win,
-                                &adminFlag) == 7) {
-                    printf(WHITE "| %-16s | $" GREEN "%-7d" RESET WHITE " | %-5d | %-5s |\n" RESET, 
-                                user_read.username, user_read.balance,
-                                user_read.games_played, 
-                                adminFlag ? GREEN "Yes" : RED "No"); // Color for Admin status
-                }
-                fclose(file);
-
-                printf(BOLD YELLOW "|==================|==========|=======|=======|\n" RESET);
+            case 2:
+                viewUsersMenu();
                 break;
-            }
 
             case 3: {
                 printf(CYAN "Enter username to promote to admin: " RESET);
                 getInput(targetUsername, sizeof(targetUsername));
 
-                FILE *file = fopen(FILENAME, "r");
-                if (!file) {
-                    printf(RED BOLD "Error opening user database!\n" RESET);
-                    break;
-                }
-
-                int count = 0;
-                int found = 0;
-                int adminFlag;
-                char encrypted_pw_from_file[PASSWORD_LENGTH];
-
-                while (fscanf(file, "%49s %19s %d %d %d %d %d", 
-                                users[count].username, encrypted_pw_from_file,
-                                &users[count].balance, &users[count].games_played,
-                                &users[count].games_won, &users[count].highest_win,
-                                &adminFlag) == 7) {
-                    users[count].isAdmin = (adminFlag == 1);
-                    strcpy(users[count].password, encrypted_pw_from_file);
-                    
-                    if (strcmp(users[count].username, targetUsername) == 0) {
-                        users[count].isAdmin = 1;
-                        found = 1;
-                    }
-                    count++;
-                }
-                fclose(file);
-
-                if (!found) {
+                userStoreRefresh(); // The user may have registered in another terminal.
+                UserRecord *rec = userStoreFind(targetUsername);
+                if (!rec) {
                     printf(RED BOLD "User '%s' not found!\n" RESET, targetUsername);
                     break;
                 }
 
-                file = fopen(FILENAME, "w");
-                if (!file) {
-                    printf(RED BOLD "Error saving changes!\n" RESET);
-                    break;
-                }
-
-                for (int i = 0; i < count; i++) {
-                    fprintf(file, "%s %s %d %d %d %d %d\n", 
-                            users[i].username, users[i].password,
-                            users[i].balance, users[i].games_played,
-                            users[i].games_won, users[i].highest_win,
-                            users[i].isAdmin ? 1 : 0);
+                if (strcmp(currentAdmin->username, targetUsername) != 0) {
+                    userStoreReload(rec);
+                    User target = rec->user;
+                    target.isAdmin = 1;
+                    userStoreCommit(rec, &target);
                 }
-                fclose(file);
 
                 printf(GREEN BOLD "%s is now an admin!\n" RESET, targetUsername);
                 break;
             }
 
             case 4:
+                metricsReport(stdout);
+                break;
+
+            case 5:
+                bulkMenu(currentAdmin);
+                break;
+
+            case 6:
+                runAnalytics((int)sysconf(_SC_NPROCESSORS_ONLN));
+                break;
+
+            case 7:
                 printf(YELLOW "Returning to main menu...\n" RESET);
                 return;
 
             default:
-                printf(RED BOLD "Invalid choice! Please select 1-4.\n" RESET);
+                printf(RED BOLD "Invalid choice! Please select 1-7.\n" RESET);
         }
     }
 }
 
-int main() {
-    srand(time(NULL));
-    User user;
-    int choice;
-    time_t lastActivity = time(NULL);
+/* ====== SCRIPT DRIVER ======
+ * --script runs a file of commands ("-" for stdin) straight against the
+ * engine and the stores, without prompts or colors, for load tests and for
+ * reproducing incidents. Commands follow the table server's protocol where
+ * they overlap. Any number of players can be logged in at once, and AS
+ * picks the one later commands act for:
+ *
+ *   REGISTER <user> <password>     LOGIN <user> <password>
+ *   AS <user>                      LOGOUT
+ *   BET <type> <selection> <amt>   SPIN
+ *   BALANCE                        HISTORY [page]
+ *   RANK                           ADMIN RESET|PROMOTE|DELETE <user>...
+ *
+ * SPIN settles every logged-in player's slip against one pocket from the
+ * --seed stream. Replies start with OK or ERR; lines starting with '#' are
+ * comments.
+ *
+ * --record writes a session log: the seed, then every command with its
+ * offset in milliseconds and the replies it got. --replay runs a log again,
+ * starting from copies of the same user and history files, and checks every
+ * reply byte for byte. It runs as fast as it can, or at --speed times the
+ * recorded pace. */
 
-    memset(&user, 0, sizeof(User));
+typedef struct {
+    Session *session;
+    Bet slip[MAX_SLIP_BETS];
+    int slipCount;
+    int staked;
+} DriverPlayer;
 
-    printf(BOLD CYAN "====== Welcome To Team 16 Roulette Casino ======\n" RESET);
-    printf(BOLD YELLOW "1) Login\n2) Register\n" RED "3) Exit\n" RESET
-           BOLD CYAN "Enter your choice: " RESET);
-    if (scanf("%d", &choice) != 1) {
-        printf(RED BOLD "Invalid choice! Please enter a number.\n" RESET);
-        clearInputBuffer();
-        return 1;
+typedef struct {
+    DriverPlayer **players; // in login order, which is also settlement order
+    int playerCount;
+    int playerCapacity;
+    DriverPlayer *current;
+    char *reply;            // replies to the command being run
+    size_t replyLen;
+    size_t replyCap;
+} Driver;
+
+static void driverReply(Driver *d, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void driverReply(Driver *d, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (d->replyLen + len + 1 > d->replyCap) {
+        d->replyCap = (d->replyLen + len + 1) * 2;
+        d->reply = xrealloc(d->reply, d->replyCap);
     }
-    clearInputBuffer();
+    va_start(ap, fmt);
+    vsnprintf(d->reply + d->replyLen, len + 1, fmt, ap);
+    va_end(ap);
+    d->replyLen += len;
+}
 
-    if (choice == 3) {
-        printf(YELLOW "Exiting program. Goodbye!\n" RESET);
-        return 0;
+static DriverPlayer *driverFind(const char *username) {
+    UserRecord *rec = userStoreFind(username);
+    return rec && rec->session ? rec->session->owner : NULL;
+}
+
+static void driverLogout(Driver *d, DriverPlayer *player) {
+    for (int i = 0; i < d->playerCount; i++) {
+        if (d->players[i] == player) {
+            memmove(&d->players[i], &d->players[i + 1], (d->playerCount - i - 1) * sizeof(DriverPlayer *));
+            d->playerCount--;
+            break;
+        }
     }
+    if (d->current == player) d->current = NULL;
+    sessionEnd(player->session);
+    free(player);
+}
 
-    printf(BOLD BLUE "Username: " RESET);
-    getInput(user.username, sizeof(user.username));
+static void driverLogin(Driver *d, const char *username, const char *password, bool registering) {
+    User user;
+    memset(&user, 0, sizeof(User));
+    if (strlen(username) >= sizeof(user.username) || strlen(password) >= PASSWORD_LENGTH) {
+        driverReply(d, "ERR username or password too long\n");
+        return;
+    }
+    memcpy(user.username, username, strlen(username) + 1);
+    if (driverFind(username)) {
+        driverReply(d, registering ? "ERR user exists\n" : "ERR already logged in\n");
+        return;
+    }
 
-    if (choice == 1) { // Login
-        printf(BOLD BLUE "Password: " RESET);
-        getInput(user.password, sizeof(user.password));
-        
+    if (registering) {
+        if (loadUser(&user)) {
+            driverReply(d, "ERR user exists\n");
+            return;
+        }
+        if (strlen(password) < 6) {
+            driverReply(d, "ERR password too short, minimum 6 characters\n");
+            return;
+        }
+        memcpy(user.password, password, strlen(password) + 1);
+        hashPassword(user.password);
+        user.balance = STARTING_BALANCE;
+        user.last_active = time(NULL);
+        if (!saveUser(user)) {
+            driverReply(d, "ERR user exists\n");
+            return;
+        }
+    } else {
+        memcpy(user.password, password, strlen(password) + 1);
         int found = loadUser(&user);
-        
-        if (found == -1) {
-            printf(RED BOLD "Incorrect password!\n" RESET);
-            return 1;
-        } else if (!found) {
-            printf(RED BOLD "User '%s' not found! Please register.\n" RESET, user.username);
-            return 1;
+        if (found != 1) {
+            driverReply(d, found == -1 ? "ERR incorrect password\n" : "ERR unknown user\n");
+            return;
         }
+        updateUser(&user); // Records the login as activity.
+    }
 
-        printf(GREEN BOLD "\nWelcome back, %s! Enjoy the game!\n" RESET, user.username);
+    DriverPlayer *player = xcalloc(1, sizeof(DriverPlayer));
+    player->session = sessionCreate(&user, userStoreFind(user.username));
+    player->session->owner = player;
+    if (d->playerCount == d->playerCapacity) {
+        d->playerCapacity = d->playerCapacity ? d->playerCapacity * 2 : 16;
+        d->players = xrealloc(d->players, d->playerCapacity * sizeof(DriverPlayer *));
+    }
+    d->players[d->playerCount++] = player;
+    d->current = player;
+    driverReply(d, "OK WELCOME %s balance %d\n", user.username, user.balance);
+}
 
-    } else if (choice == 2) { // Register
-        User temp_check_user;
-        strcpy(temp_check_user.username, user.username);
-        temp_check_user.password[0] = '\0'; 
-        if (loadUser(&temp_check_user)) {
-            printf(RED BOLD "User '%s' already exists! Please login instead.\n" RESET, user.username);
-            return 1;
+static void driverBet(Driver *d, int type, const char *selArg, int amount) {
+    DriverPlayer *player = d->current;
+    int sel = parseBetSelection(type, selArg);
+    if (type < 1 || type > BET_TYPE_COUNT || !validBetSelection(type, sel)) {
+        driverReply(d, "ERR invalid bet\n");
+    } else if (amount < MIN_BET || amount > MAX_BET || player->staked + amount > player->session->user.balance) {
+        driverReply(d, "ERR amount must be %d-%d and within your balance\n", MIN_BET, MAX_BET);
+    } else if (player->slipCount == MAX_SLIP_BETS) {
+        driverReply(d, "ERR slip is full\n");
+    } else {
+        player->slip[player->slipCount++] = (Bet){ type, sel, amount };
+        player->staked += amount;
+        char label[30];
+        betLabel(type, sel, label, sizeof(label));
+        driverReply(d, "OK BET %s %d staked %d\n", label, amount, player->staked);
+    }
+}
+
+// Settle every open slip against one spin, the way a server table does.
+static void driverSpin(Driver *d) {
+    BetBatch batch;
+    betBatchInit(&batch);
+    User *users = xmalloc((d->playerCount ? d->playerCount : 1) * sizeof(User));
+    for (int p = 0; p < d->playerCount; p++) {
+        users[p] = d->players[p]->session->user;
+        for (int b = 0; b < d->players[p]->slipCount; b++) {
+            betBatchAdd(&batch, &d->players[p]->slip[b], p);
         }
+    }
+    if (batch.count == 0) {
+        driverReply(d, "ERR no bets placed\n");
+        betBatchFree(&batch);
+        free(users);
+        return;
+    }
 
-        printf(BOLD BLUE "Enter Password (min 6 characters): " RESET);
-        getInput(user.password, sizeof(user.password));
-        
-        if (strlen(user.password) < 6) {
-            printf(RED BOLD "Password too short! Minimum 6 characters required.\n" RESET);
-            return 1;
+    METRIC_BEGIN(spinStart);
+    int pocket = spinWheel();
+    METRIC_END(METRIC_SPIN, spinStart);
+    settleBatch(&batch, pocket, users);
+    char proof[96];
+    if (!spinProof(&gameSpins, proof, sizeof(proof))) proof[0] = '\0';
+    driverReply(d, "OK SPIN %d %s%s%s\n", pocket, pocket == 0 ? "green" : isRedNumber(pocket) ? "red" : "black",
+                proof[0] ? " proof " : "", proof);
+
+    int k = 0;
+    for (int p = 0; p < d->playerCount; p++) {
+        DriverPlayer *player = d->players[p];
+        if (player->slipCount == 0) continue;
+
+        int returned = 0;
+        for (int b = 0; b < player->slipCount; b++, k++) {
+            addGameHistory(users[p], &player->slip[b], pocket, batch.payout[k]);
+            returned += batch.payout[k] ? batch.payout[k] + player->slip[b].amount : 0;
         }
-        
-        user.isAdmin = 0;
-        if (strcmp(user.username, "admin") == 0) {
-            printf(YELLOW "You are registering as 'admin'. Enter admin activation code: " RESET);
-            char code[50];
-            getInput(code, sizeof(code));
-            if (isAdminPassword(code)) {
-                user.isAdmin = 1;
-                printf(GREEN BOLD "Admin privileges granted upon registration!\n" RESET);
-            } else {
-                printf(YELLOW "Incorrect admin code. Registering as a standard account.\n" RESET);
-            }
+        Session *session = player->session;
+        session->user = users[p];
+        session->user.last_active = time(NULL);
+        userStoreCommit(session->rec, &session->user);
+        driverReply(d, "RESULT %s staked %d returned %d balance %d\n", session->user.username, player->staked,
+                    returned, session->user.balance);
+        player->slipCount = 0;
+        player->staked = 0;
+    }
+    betBatchFree(&batch);
+    free(users);
+}
+
+static void driverAdmin(Driver *d, const char *args) {
+    Session *admin = d->current->session;
+    if (!admin->user.isAdmin) {
+        driverReply(d, "ERR admin privileges required\n");
+        return;
+    }
+
+    char text[1024];
+    snprintf(text, sizeof(text), "%s", args);
+    char *save = NULL;
+    char *word = strtok_r(text, " \t", &save);
+    BulkAction action = 0;
+    if (word && strcasecmp(word, "RESET") == 0) action = BULK_RESET;
+    else if (word && strcasecmp(word, "PROMOTE") == 0) action = BULK_PROMOTE;
+    else if (word && strcasecmp(word, "DELETE") == 0) action = BULK_DELETE;
+    if (!action) {
+        driverReply(d, "ERR usage: ADMIN RESET|PROMOTE|DELETE <user>...\n");
+        return;
+    }
+
+    BulkFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.keep = admin->user.username;
+    int capacity = 0;
+    bulkAddNames(&filter, save, &capacity);
+    if (filter.nameCount == 0) {
+        driverReply(d, "ERR no usernames given\n");
+        return;
+    }
+    qsort(filter.names, filter.nameCount, sizeof(filter.names[0]), compareUsernames);
+
+    userStoreRefresh(); // Users may have registered in another process.
+    int affected = userStoreBulkApply(action, &filter);
+    free(filter.names);
+    if (affected < 0) {
+        driverReply(d, "ERR bulk operation failed\n");
+        return;
+    }
+
+    // Logged-in players must continue from their rewritten records, and deleted ones are gone.
+    for (int p = d->playerCount - 1; p >= 0; p--) {
+        Session *session = d->players[p]->session;
+        if (session->rec->deleted) driverLogout(d, d->players[p]);
+        else session->user = session->rec->user;
+    }
+    driverReply(d, "OK ADMIN %d\n", affected);
+}
+
+static void driverCommand(Driver *d, const char *line) {
+    char cmd[16] = "", arg1[64] = "", arg2[64] = "";
+    int arg3 = 0, argStart = 0;
+    int argc = sscanf(line, "%15s%n %63s %63s %d", cmd, &argStart, arg1, arg2, &arg3);
+    if (argc < 1) return;
+    for (char *p = cmd; *p; p++) *p = toupper((unsigned char)*p);
+
+    if (strcmp(cmd, "LOGIN") == 0 || strcmp(cmd, "REGISTER") == 0) {
+        if (argc < 3) driverReply(d, "ERR usage: %s <user> <password>\n", cmd);
+        else driverLogin(d, arg1, arg2, cmd[0] == 'R');
+    } else if (strcmp(cmd, "AS") == 0) {
+        DriverPlayer *player = argc >= 2 ? driverFind(arg1) : NULL;
+        if (!player) {
+            driverReply(d, "ERR not logged in\n");
+            return;
         }
-        
-        user.balance = STARTING_BALANCE;
-        user.games_played = 0;
-        user.games_won = 0;
-        user.highest_win = 0;
-        
-        encryptPassword(user.password);
-        saveUser(user);
-        printf(GREEN BOLD "\nRegistered successfully! Starting balance: $" CYAN "%d\n" RESET, STARTING_BALANCE);
+        d->current = player;
+        driverReply(d, "OK AS %s\n", arg1);
+    } else if (strcmp(cmd, "SPIN") == 0) {
+        driverSpin(d);
+    } else if (!d->current) {
+        driverReply(d, "ERR login first\n");
+    } else if (strcmp(cmd, "LOGOUT") == 0) {
+        driverLogout(d, d->current);
+        driverReply(d, "OK BYE\n");
+    } else if (strcmp(cmd, "BALANCE") == 0) {
+        driverReply(d, "OK BALANCE %d staked %d\n", d->current->session->user.balance, d->current->staked);
+    } else if (strcmp(cmd, "BET") == 0) {
+        if (argc < 4) driverReply(d, "ERR usage: BET <type> <selection> <amount>\n");
+        else driverBet(d, atoi(arg1), arg2, arg3);
+    } else if (strcmp(cmd, "HISTORY") == 0) {
+        // No timestamps, so a replay gives the same reply.
+        const char *username = d->current->session->user.username;
+        GameHistory page[HISTORY_PAGE_SIZE];
+        int pageNo = argc >= 2 ? atoi(arg1) : 1;
+        int n = historyQuery(username, 0, (pageNo > 0 ? pageNo - 1 : 0) * HISTORY_PAGE_SIZE,
+                             HISTORY_PAGE_SIZE, page);
+        driverReply(d, "OK HISTORY %d of %d\n", n, historyCountFor(username));
+        for (int i = 0; i < n; i++) {
+            driverReply(d, "%s|%d|%d|%d\n", page[i].game_type, page[i].bet_amount, page[i].result, page[i].payout);
+        }
+    } else if (strcmp(cmd, "RANK") == 0) {
+        const char *username = d->current->session->user.username;
+        uint32_t size[BOARD_COUNT];
+        int rank[BOARD_COUNT];
+        for (int kind = 0; kind < BOARD_COUNT; kind++) {
+            rank[kind] = leaderboardRank(kind, username, &size[kind]);
+        }
+        driverReply(d, "OK RANK richest %d/%u biggest_win %d/%u win_rate %d/%u\n",
+                    rank[BOARD_RICHEST], size[BOARD_RICHEST], rank[BOARD_BIGGEST_WIN], size[BOARD_BIGGEST_WIN],
+                    rank[BOARD_WIN_RATE], size[BOARD_WIN_RATE]);
+    } else if (strcmp(cmd, "ADMIN") == 0) {
+        driverAdmin(d, line + argStart);
     } else {
-        printf(RED BOLD "Invalid initial choice! Please select 1, 2, or 3.\n" RESET);
-        return 1;
+        driverReply(d, "ERR unknown command\n");
+    }
+}
+
+static void driverClose(Driver *d) {
+    while (d->playerCount > 0) driverLogout(d, d->players[d->playerCount - 1]);
+    free(d->players);
+    free(d->reply);
+}
+
+static int64_t driverMillis(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Strip the line ending; returns false for blank lines and comments.
+static bool driverLine(char *line) {
+    line[strcspn(line, "\r\n")] = '\0';
+    const char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    return *p && *p != '#';
+}
+
+int runScript(const char *path, const char *recordPath, uint64_t seed) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror(RED "Error opening script" RESET);
+        return 0;
+    }
+    FILE *log = NULL;
+    if (recordPath) {
+        log = fopen(recordPath, "w");
+        if (!log) {
+            perror(RED "Error creating session log" RESET);
+            if (in != stdin) fclose(in);
+            return 0;
+        }
+        if (!gameSpins.engine->seedable) {
+            fprintf(stderr, YELLOW "Warning: --rng %s cannot be seeded, so this log will not replay\n" RESET,
+                    gameSpins.engine->name);
+        }
+        fprintf(log, "# roulette session log\nSEED %llu\nUSERS %d\n", (unsigned long long)seed, userStore.count);
     }
 
-    displayRules();
+    Driver d;
+    memset(&d, 0, sizeof(d));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        if (!driverLine(line)) continue;
+        d.replyLen = 0;
+        if (log) fprintf(log, "> %lld %s\n", (long long)driverMillis(&start), line);
+        driverCommand(&d, line);
+        fwrite(d.reply, 1, d.replyLen, stdout);
+
+        if (log) {
+            for (char *r = d.reply, *end = d.reply + d.replyLen; r < end;) {
+                char *nl = memchr(r, '\n', end - r);
+                fprintf(log, "< %.*s\n", (int)(nl - r), r);
+                r = nl + 1;
+            }
+        }
+    }
+    driverClose(&d);
+    if (in != stdin) fclose(in);
+    if (log && fclose(log) != 0) {
+        perror(RED "Error writing session log" RESET);
+        return 0;
+    }
+    return 1;
+}
+
+int runReplay(const char *logPath, double speed) {
+    if (!gameSpins.engine->seedable) {
+        fprintf(stderr, RED "Cannot replay with --rng %s: its spins cannot be reproduced from a seed\n" RESET,
+                gameSpins.engine->name);
+        return 0;
+    }
+    FILE *log = fopen(logPath, "r");
+    if (!log) {
+        perror(RED "Error opening session log" RESET);
+        return 0;
+    }
+
+    Driver d;
+    memset(&d, 0, sizeof(d));
+    char *expected = NULL;
+    size_t expectedLen = 0, expectedCap = 0;
+    char line[1100], command[1100] = "";
+    long lineNo = 0, commandLine = 0, commands = 0;
+    int64_t lastAt = 0;
+    bool ok = true, running = false;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (ok) {
+        bool more = fgets(line, sizeof(line), log) != NULL;
+        lineNo++;
+        if (more) line[strcspn(line, "\n")] = '\0';
+
+        // A command's replies end where the next command or the log does.
+        if (running && (!more || line[0] == '>')) {
+            if (d.replyLen != expectedLen || memcmp(d.reply, expected, expectedLen) != 0) {
+                printf(RED BOLD "Replay diverged at line %ld: %s\n" RESET, commandLine, command);
+                printf("--- recorded\n%.*s--- replayed\n%.*s", (int)expectedLen, expected, (int)d.replyLen, d.reply);
+                ok = false;
+            }
+            running = false;
+        }
+        if (!more || !ok) break;
+
+        unsigned long long seed;
+        int users;
+        long long at;
+        int offset = 0;
+        if (sscanf(line, "SEED %llu", &seed) == 1) {
+            spinSourceSeed(&gameSpins, seed);
+        } else if (sscanf(line, "USERS %d", &users) == 1) {
+            if (users != userStore.count) {
+                fprintf(stderr, YELLOW "Warning: the log was recorded with %d users, there are %d now\n" RESET,
+                        users, userStore.count);
+            }
+        } else if (sscanf(line, "> %lld %n", &at, &offset) == 1 && offset > 0) {
+            if (speed > 0) {
+                int64_t due = (int64_t)(at / speed), now = driverMillis(&start);
+                if (due > now) usleep((useconds_t)(due - now) * 1000);
+            }
+            snprintf(command, sizeof(command), "%s", line + offset);
+            commandLine = lineNo;
+            d.replyLen = 0;
+            expectedLen = 0;
+            driverCommand(&d, command);
+            running = true;
+            commands++;
+            lastAt = at;
+        } else if (strncmp(line, "< ", 2) == 0) {
+            size_t len = strlen(line + 2);
+            if (expectedLen + len + 1 > expectedCap) {
+                expectedCap = (expectedLen + len + 1) * 2;
+                expected = xrealloc(expected, expectedCap);
+            }
+            memcpy(expected + expectedLen, line + 2, len);
+            expected[expectedLen + len] = '\n';
+            expectedLen += len + 1;
+        }
+    }
+
+    double seconds = driverMillis(&start) / 1000.0;
+    if (ok) {
+        printf(GREEN BOLD "Replayed %ld commands in %.3fs" RESET, commands, seconds);
+        if (seconds > 0 && lastAt > 0) printf(" (%.1fx the recorded pace)", lastAt / 1000.0 / seconds);
+        printf("\n");
+    }
+    driverClose(&d);
+    free(expected);
+    fclose(log);
+    return ok;
+}
+
+/* Run the main menu for a logged-in player. Returns true when they choose to
+ * exit and false when the session expires first; either way it is left for
+ * the caller to end. */
+static bool playSession(SessionWheel *wheel, Session *session) {
+    User *user = &session->user;
+    int choice;
 
     while (1) {
-        checkTimeout(lastActivity);
-        lastActivity = time(NULL);
+        if (sessionWheelAdvance(wheel, time(NULL))) return false;
 
         printf(BOLD CYAN "\n====== Main Menu ======\n" RESET);
         printf(YELLOW "1) Play Roulette\n"
@@ -801,35 +8141,303 @@ int main() {
                "3) View Statistics\n"
                "4) View Game History\n"
                "5) Change Password\n" RESET);
-        if (user.isAdmin) printf(MAGENTA "6) Admin Menu\n" RESET);
+        if (user->isAdmin) printf(MAGENTA "6) Admin Menu\n" RESET);
+        printf(YELLOW "7) Leaderboards\n" RESET);
         printf(RED "0) Exit\n" RESET BOLD CYAN "Enter your choice: " RESET);
+        fflush(stdout);
 
+        if (!waitForInput(session->expires)) continue;
         if (scanf("%d", &choice) != 1) {
             printf(RED BOLD "Invalid choice! Please enter a number.\n" RESET);
             clearInputBuffer();
             continue;
         }
         clearInputBuffer();
+        sessionTouch(wheel, session, time(NULL));
 
         switch (choice) {
-            case 1: playRoulette(&user); break;
-            case 2: printf(WHITE "\nYour Current Balance: $" GREEN "%d\n" RESET, user.balance); break;
-            case 3: displayStats(user); break;
-            case 4: showGameHistory(user.username); break;
-            case 5: changePassword(&user); break;
+            case 1: playRoulette(user); break;
+            case 2: printf(WHITE "\nYour Current Balance: $" GREEN "%d\n" RESET, user->balance); break;
+            case 3: displayStats(*user); break;
+            case 4: showGameHistory(user->username); break;
+            case 5: changePassword(user); break;
             case 6: 
-                if (user.isAdmin) {
-                    adminMenu(&user); 
+                if (user->isAdmin) {
+                    adminMenu(user); 
                 } else {
                     printf(RED BOLD "Admin privileges required for this option.\n" RESET);
                 }
                 break;
+            case 7: showLeaderboards(user->username); break;
             case 0: 
                 printf(GREEN BOLD "\nThank you for playing, %s! Your final balance: $" CYAN "%d\n" RESET, 
-                       user.username, user.balance);
-                return 0;
+                       user->username, user->balance);
+                return true;
             default: printf(RED BOLD "Invalid choice! Please select a valid option from the menu.\n" RESET);
         }
     }
+}
+
+int main(int argc, char *argv[]) {
+    long long simulateSpins = 0;
+    const char *mixSpec = NULL;
+    uint64_t seed = (uint64_t)time(NULL);
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *serverAddress = NULL;
+    int roundSeconds = DEFAULT_ROUND_SECONDS;
+    int workers = threads;
+    bool reportMetrics = false;
+    bool analytics = false;
+    bool selfTest = false;
+    const char *exportPath = NULL;
+    const char *importPath = NULL;
+    bool color = isatty(STDOUT_FILENO) && !getenv("NO_COLOR");
+    bool asyncOutput = false;
+    const char *unknownOption = NULL;
+    const char *scriptPath = NULL;
+    const char *recordPath = NULL;
+    const char *replayPath = NULL;
+    double replaySpeed = 0;
+    const char *benchSizes = NULL;
+    const char *benchOut = "bench.jsonl";
+    const SpinEngine *engine = spinEngineFor("xoshiro");
+    const char *fairnessLog = NULL;
+    char **fairnessQueries = NULL;
+    int fairnessQueryCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--journal") == 0) {
+            userStore.journalMode = true;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            userStore.binaryMode = true;
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+            checkpointer.interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            reportMetrics = true;
+        } else if (strcmp(argv[i], "--no-color") == 0) {
+            color = false;
+        } else if (strcmp(argv[i], "--async-output") == 0) {
+            asyncOutput = true;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchSizes = argv[++i];
+        } else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) {
+            benchOut = argv[++i];
+        } else if (strcmp(argv[i], "--analytics") == 0) {
+            analytics = true;
+        } else if (strcmp(argv[i], "--self-test") == 0) {
+            selfTest = true;
+        } else if (strcmp(argv[i], "--export-history") == 0 && i + 1 < argc) {
+            exportPath = argv[++i];
+        } else if (strcmp(argv[i], "--import-history") == 0 && i + 1 < argc) {
+            importPath = argv[++i];
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            simulateSpins = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            mixSpec = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rng") == 0 && i + 1 < argc && spinEngineFor(argv[i + 1])) {
+            engine = spinEngineFor(argv[++i]);
+        } else if (strcmp(argv[i], "--verify-fairness") == 0 && i + 1 < argc) {
+            // Everything after the log is a spin to recompute.
+            fairnessLog = argv[++i];
+            fairnessQueries = &argv[i + 1];
+            fairnessQueryCount = argc - i - 1;
+            break;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            serverAddress = argv[++i];
+        } else if (strcmp(argv[i], "--round") == 0 && i + 1 < argc) {
+            roundSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            scriptPath = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replaySpeed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--convert-to-binary") == 0) {
+            return convertTextToBinary(FILENAME, BINARY_FILENAME) ? 0 : 1;
+        } else if (strcmp(argv[i], "--convert-to-text") == 0) {
+            return convertBinaryToText(BINARY_FILENAME, FILENAME) ? 0 : 1;
+        } else {
+            unknownOption = argv[i];
+            break;
+        }
+    }
+
+    terminalInit(color, !simulateSpins && !benchSizes && !serverAddress && !analytics, asyncOutput);
+    atexit(terminalClose);
+    if (unknownOption) {
+        printf(RED BOLD "Unknown option '%s'\n" RESET, unknownOption);
+        printf("Usage: %s [--journal [--checkpoint-interval seconds] | --binary | --convert-to-binary |\n"
+               "          --convert-to-text] [--metrics] [--no-color] [--async-output]\n"
+               "       %s --simulate N [--mix type:selection:amount,...] [--seed S] [--threads T]\n"
+               "       %s --analytics [--threads T]\n"
+               "       %s --export-history file | --import-history file\n"
+               "       %s --server <port | unix:/path> [--round seconds] [--workers N]\n"
+               "       %s --bench rows[,rows...] [--bench-out file]\n"
+               "       %s --script <file | -> [--record log] [--seed S]\n"
+               "       %s --replay log [--speed X]\n"
+               "       %s --verify-fairness log [commit:nonce ...]\n"
+               "       %s --self-test\n"
+               "       Every mode except --simulate accepts --rng xoshiro|system|fair.\n",
+               argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (fairnessLog) {
+        return verifyFairness(fairnessLog, fairnessQueries, fairnessQueryCount) ? 0 : 1;
+    }
+    if (userStore.journalMode && userStore.binaryMode) {
+        printf(RED BOLD "--journal and --binary cannot be combined.\n" RESET);
+        return 1;
+    }
+
+    metricsInit(reportMetrics);
+    initPayoutTable();
+    if (selfTest) {
+        return kdfSelfTest() ? 0 : 1;
+    }
+    if (simulateSpins > 0) {
+        return runSimulation(simulateSpins, mixSpec, threads, seed) ? 0 : 1;
+    }
+    if (analytics) {
+        return runAnalytics(threads) ? 0 : 1;
+    }
+    if (exportPath) {
+        return exportHistory(exportPath) ? 0 : 1;
+    }
+    if (importPath) {
+        return importHistory(importPath) ? 0 : 1;
+    }
+    spinSourceInit(&gameSpins, engine, seed, "game");
+    atexit(spinSourcesShutdown);
+    if (benchSizes) {
+        return runBenchmarks(benchSizes, benchOut) ? 0 : 1;
+    }
+
+    if (!userStoreOpen()) {
+        return 1;
+    }
+    atexit(userStoreClose);
+    if (!historyStoreOpen()) {
+        return 1;
+    }
+    atexit(historyStoreClose);
+
+    if (serverAddress) {
+        return runServer(serverAddress, roundSeconds, workers) ? 0 : 1;
+    }
+    if (scriptPath) {
+        return runScript(scriptPath, recordPath, seed) ? 0 : 1;
+    }
+    if (replayPath) {
+        return runReplay(replayPath, replaySpeed) ? 0 : 1;
+    }
+
+    // An expired session returns to the welcome screen instead of exiting.
+    SessionWheel wheel = { .count = 0 };
+    while (1) {
+        User user;
+        int choice;
+
+        memset(&user, 0, sizeof(User));
+
+        printf(BOLD CYAN "====== Welcome To Team 16 Roulette Casino ======\n" RESET);
+        printf(BOLD YELLOW "1) Login\n2) Register\n" RED "3) Exit\n" RESET
+               BOLD CYAN "Enter your choice: " RESET);
+        if (scanf("%d", &choice) != 1) {
+            printf(RED BOLD "Invalid choice! Please enter a number.\n" RESET);
+            clearInputBuffer();
+            return 1;
+        }
+        clearInputBuffer();
+
+        if (choice == 3) {
+            printf(YELLOW "Exiting program. Goodbye!\n" RESET);
+            return 0;
+        }
+
+        printf(BOLD BLUE "Username: " RESET);
+        getInput(user.username, sizeof(user.username));
+
+        if (choice == 1) { // Login
+            printf(BOLD BLUE "Password: " RESET);
+            getInput(user.password, sizeof(user.password));
+            
+            int found = loadUser(&user);
+            
+            if (found == -1) {
+                printf(RED BOLD "Incorrect password!\n" RESET);
+                return 1;
+            } else if (!found) {
+                printf(RED BOLD "User '%s' not found! Please register.\n" RESET, user.username);
+                return 1;
+            }
+
+            updateUser(&user); // Records the login as activity.
+            printf(GREEN BOLD "\nWelcome back, %s! Enjoy the game!\n" RESET, user.username);
+
+        } else if (choice == 2) { // Register
+            User temp_check_user;
+            strcpy(temp_check_user.username, user.username);
+            temp_check_user.password[0] = '\0'; 
+            if (loadUser(&temp_check_user)) {
+                printf(RED BOLD "User '%s' already exists! Please login instead.\n" RESET, user.username);
+                return 1;
+            }
+
+            printf(BOLD BLUE "Enter Password (min 6 characters): " RESET);
+            getInput(user.password, sizeof(user.password));
+            
+            if (strlen(user.password) < 6) {
+                printf(RED BOLD "Password too short! Minimum 6 characters required.\n" RESET);
+                return 1;
+            }
+            
+            user.isAdmin = 0;
+            if (strcmp(user.username, "admin") == 0) {
+                printf(YELLOW "You are registering as 'admin'. Enter admin activation code: " RESET);
+                char code[50];
+                getInput(code, sizeof(code));
+                if (isAdminPassword(code)) {
+                    user.isAdmin = 1;
+                    printf(GREEN BOLD "Admin privileges granted upon registration!\n" RESET);
+                } else {
+                    printf(YELLOW "Incorrect admin code. Registering as a standard account.\n" RESET);
+                }
+            }
+            
+            user.balance = STARTING_BALANCE;
+            user.games_played = 0;
+            user.games_won = 0;
+            user.highest_win = 0;
+            user.last_active = time(NULL);
+            
+            hashPassword(user.password);
+            if (!saveUser(user)) {
+                printf(RED BOLD "User '%s' was just registered elsewhere! Please login instead.\n" RESET, user.username);
+                return 1;
+            }
+            printf(GREEN BOLD "\nRegistered successfully! Starting balance: $" CYAN "%d\n" RESET, STARTING_BALANCE);
+        } else {
+            printf(RED BOLD "Invalid initial choice! Please select 1, 2, or 3.\n" RESET);
+            return 1;
+        }
+
+        displayRules();
+
+        Session *session = sessionCreate(&user, userStoreFind(user.username));
+        sessionTouch(&wheel, session, time(NULL));
+        bool quit = playSession(&wheel, session);
+        sessionWheelRemove(&wheel, session);
+        sessionEnd(session);
+        if (quit) return 0;
+        printf(YELLOW BOLD "\nSession expired due to inactivity. Logging out...\n" RESET);
+    }
     return 0;
 }
\ No newline at end of file